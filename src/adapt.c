@@ -0,0 +1,256 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "adapt.h"
+#include "util.h"
+
+#include <X11/keysym.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+
+#define ADAPT_RATE 0.05          // Weight of each touch
+#define ADAPT_CORRECT_RATE 0.2   // Weight of a touch that was corrected
+#define ADAPT_CORRECT_NS 2000000000ULL // Window for BackSpace then a key
+#define ADAPT_MIN_SAMPLES 8      // Before a key's offset is used
+#define ADAPT_MAX_OFFSET 0.4     // Of a width unit or row
+#define ADAPT_SAVE_EVERY 50      // Updates
+
+
+static AdaptKey *adapt_find(Adapt *a, const char *layer, KeySym keysym,
+                            bool add) {
+  for (unsigned i = 0; i < a->nkeys; i++)
+    if (a->keys[i].keysym == keysym && !strcmp(a->keys[i].layer, layer))
+      return &a->keys[i];
+
+  if (!add) return 0;
+
+  a->keys = realloc(a->keys, ++a->nkeys * sizeof(AdaptKey));
+  AdaptKey *k = &a->keys[a->nkeys - 1];
+  memset(k, 0, sizeof(AdaptKey));
+  k->layer = strdup(layer);
+  k->keysym = keysym;
+
+  return k;
+}
+
+
+/// Loads the touch model.  A missing file starts an empty model.
+Adapt *adapt_load(const char *path) {
+  Adapt *a = calloc(1, sizeof(Adapt));
+  a->path = strdup(path);
+
+  FILE *f = fopen(path, "r");
+  if (!f) return a;
+
+  char *line = 0;
+  size_t len = 0;
+
+  while (getline(&line, &len, f) != -1) {
+    char layer[64], name[64];
+    float dx, dy;
+    unsigned samples;
+
+    if (line[0] == '#' ||
+        sscanf(line, "%63s %63s %f %f %u", layer, name, &dx, &dy,
+               &samples) != 5) continue;
+
+    KeySym keysym = XStringToKeysym(name);
+    if (keysym == NoSymbol) continue;
+
+    AdaptKey *k = adapt_find(a, layer, keysym, true);
+    k->dx = dx;
+    k->dy = dy;
+    k->samples = samples;
+  }
+
+  free(line);
+  fclose(f);
+
+  return a;
+}
+
+
+/// Saves the model if enough has been learned since the last save.  Called
+/// from the idle event loop and on exit, the write blocks.
+void adapt_save(Adapt *a, bool force) {
+  if (!a->updates || (!force && a->updates < ADAPT_SAVE_EVERY)) return;
+  a->updates = 0;
+
+  char *tmp = malloc(strlen(a->path) + 5);
+  sprintf(tmp, "%s.tmp", a->path);
+
+  FILE *f = fopen(tmp, "w");
+  bool ok = f;
+
+  if (f) {
+    fprintf(f, "# layer keysym dx dy samples\n");
+
+    for (unsigned i = 0; i < a->nkeys; i++) {
+      AdaptKey *k = &a->keys[i];
+      const char *name = XKeysymToString(k->keysym);
+      if (name) fprintf(f, "%s %s %.4f %.4f %u\n", k->layer, name, k->dx,
+                        k->dy, k->samples);
+    }
+
+    if (fclose(f)) ok = false;
+  }
+
+  if (ok && rename(tmp, a->path)) ok = false;
+  if (!ok) {
+    message("Failed to save touch model '%s'\n", a->path);
+    unlink(tmp);
+  }
+
+  free(tmp);
+}
+
+
+void adapt_free(Adapt *a) {
+  if (!a) return;
+
+  for (unsigned i = 0; i < a->nkeys; i++)
+    free(a->keys[i].layer);
+
+  free(a->keys);
+  free(a->path);
+  free(a);
+}
+
+
+static float adapt_clamp(float x) {
+  return x < -ADAPT_MAX_OFFSET ? -ADAPT_MAX_OFFSET :
+    (ADAPT_MAX_OFFSET < x ? ADAPT_MAX_OFFSET : x);
+}
+
+
+/// Returns true if the key's offset is now in use.
+static bool adapt_learn(Adapt *a, Layer *layer, Key *k, float x, float y,
+                        float rate) {
+  AdaptKey *ak = adapt_find(a, layer->name, k->keysym, true);
+
+  float dx = adapt_clamp(x - (k->col + k->width / 2.0));
+  float dy = adapt_clamp(y - (k->row + 0.5));
+
+  // Start from the mean of the first samples
+  if (ak->samples < 1 / rate) rate = 1.0 / (ak->samples + 1);
+
+  ak->dx += rate * (dx - ak->dx);
+  ak->dy += rate * (dy - ak->dy);
+  ak->samples++;
+  a->updates++;
+
+  return ADAPT_MIN_SAMPLES <= ak->samples;
+}
+
+
+/// Learns from a touch at ``x``, ``y``, in width units and rows from the
+/// layer's origin, that selected ``k``.  BackSpace followed by a different
+/// key counts the erased touch toward the key typed instead.  Returns true if
+/// the layer's hit-test table should be refolded.
+bool adapt_touch(Adapt *a, Layer *layer, Key *k, float x, float y) {
+  uint64_t now = get_time_ns();
+  bool recent = now - a->time < ADAPT_CORRECT_NS;
+  bool changed = false;
+
+  if (k->keysym == XK_BackSpace) {
+    a->state = recent && a->state == AdaptPressed ? AdaptErased : AdaptIdle;
+    a->time = now;
+    return false;
+  }
+
+  a->touches++;
+
+  if (a->state == AdaptErased && recent && a->layer == layer && a->key != k) {
+    a->corrections++;
+    changed = adapt_learn(a, layer, k, a->x, a->y, ADAPT_CORRECT_RATE);
+  }
+
+  if (adapt_learn(a, layer, k, x, y, ADAPT_RATE)) changed = true;
+
+  a->state = AdaptPressed;
+  a->layer = layer;
+  a->key = k;
+  a->x = x;
+  a->y = y;
+  a->time = now;
+
+  return changed;
+}
+
+
+typedef struct {
+  Key *key;
+  float x, y; // Center where the key is actually touched
+  float hw, hh; // Half size
+} AdaptTarget;
+
+
+/// Rebuilds the layer's hit-test table so each cell selects the key whose
+/// shifted target is nearest, measured in key sizes.  With no offsets this
+/// matches the key rectangles.
+void adapt_fold(Adapt *a, Layer *layer) {
+  int count = 0;
+  for (int r = 0; r < layer->rows; r++)
+    for (Key *k = layer->keys[r]; k->keysym; k++) count++;
+
+  AdaptTarget *targets = calloc(count, sizeof(AdaptTarget));
+  AdaptTarget *t = targets;
+
+  for (int r = 0; r < layer->rows; r++)
+    for (Key *k = layer->keys[r]; k->keysym; k++, t++) {
+      AdaptKey *ak = adapt_find(a, layer->name, k->keysym, false);
+      bool use = ak && ADAPT_MIN_SAMPLES <= ak->samples;
+
+      t->key = k;
+      t->x = k->col + k->width / 2.0 + (use ? ak->dx : 0);
+      t->y = r + 0.5 + (use ? ak->dy : 0);
+      t->hw = k->width / 2.0;
+      t->hh = 0.5;
+    }
+
+  int gw = layer->cols * LAYOUT_HIT_GRID;
+  int gh = layer->rows * LAYOUT_HIT_GRID;
+
+  for (int gy = 0; gy < gh; gy++) {
+    float y = (gy + 0.5) / LAYOUT_HIT_GRID;
+
+    for (int gx = 0; gx < gw; gx++) {
+      float x = (gx + 0.5) / LAYOUT_HIT_GRID;
+      Key *best = 0;
+      float bestDist = INFINITY;
+
+      for (int i = 0; i < count; i++) {
+        // Only neighboring rows can win
+        if (1.5 < fabsf(targets[i].y - y)) continue;
+
+        float dx = fabsf(x - targets[i].x) / targets[i].hw;
+        float dy = fabsf(y - targets[i].y) / targets[i].hh;
+        float dist = dx < dy ? dy : dx;
+
+        if (dist < bestDist) {
+          bestDist = dist;
+          best = targets[i].key;
+        }
+      }
+
+      // Leave cells well away from every key empty
+      layer->hits[gy * gw + gx] = bestDist <= 1.5 ? best : 0;
+    }
+  }
+
+  free(targets);
+  layer->hits_dirty = false;
+}
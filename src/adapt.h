@@ -0,0 +1,53 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include "layout.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/// Learned offset from a key's center to where it is actually touched, in
+/// width units and rows.
+typedef struct {
+  char *layer;
+  KeySym keysym;
+  float dx, dy;
+  unsigned samples;
+} AdaptKey;
+
+typedef enum {AdaptIdle, AdaptPressed, AdaptErased} AdaptState;
+
+typedef struct {
+  char *path;
+  AdaptKey *keys;
+  unsigned nkeys;
+  unsigned updates; // Since last save
+
+  // Correction tracking
+  AdaptState state;
+  Layer *layer;
+  Key *key;
+  float x, y;
+  uint64_t time;
+
+  unsigned touches;
+  unsigned corrections;
+} Adapt;
+
+
+Adapt *adapt_load(const char *path);
+void adapt_save(Adapt *a, bool force);
+void adapt_free(Adapt *a);
+bool adapt_touch(Adapt *a, Layer *layer, Key *k, float x, float y);
+void adapt_fold(Adapt *a, Layer *layer);
@@ -0,0 +1,229 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "atlas.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static void atlas_alloc(Atlas *a, int h) {
+  a->pixmap = XCreatePixmap(a->dpy, a->root, a->w, h, 8);
+  a->picture = XRenderCreatePicture(a->dpy, a->pixmap, a->format, 0, 0);
+  if (!a->gc) a->gc = XCreateGC(a->dpy, a->pixmap, 0, 0);
+  a->h = h;
+}
+
+
+static void atlas_free(Atlas *a) {
+  if (!a->pixmap) return;
+  XRenderFreePicture(a->dpy, a->picture);
+  XFreePixmap(a->dpy, a->pixmap);
+  a->pixmap = 0;
+}
+
+
+/// Doubles the height of the pixmap, keeping the masks already in it.
+static bool atlas_grow(Atlas *a) {
+  if (ATLAS_HEIGHT_MAX <= a->h) return false;
+
+  Pixmap old = a->pixmap;
+  Picture picture = a->picture;
+  atlas_alloc(a, a->h * 2);
+
+  XCopyArea(a->dpy, old, a->pixmap, a->gc, 0, 0, a->w, a->h / 2, 0, 0);
+  XRenderFreePicture(a->dpy, picture);
+  XFreePixmap(a->dpy, old);
+
+  return true;
+}
+
+
+/// Starts over with an empty atlas, for when it fills up.
+static void atlas_clear(Atlas *a) {
+  log_msg(LOG_INFO, "Glyph atlas full after %d labels, clearing", a->count);
+
+  int h = a->h;
+  atlas_free(a);
+  atlas_alloc(a, h);
+  a->count = a->shelf_x = a->shelf_y = a->shelf_h = 0;
+}
+
+
+/// Finds room for a ``w`` by ``h`` mask on the current shelf or a new one.
+static bool atlas_place(Atlas *a, int w, int h, int *x, int *y) {
+  if (a->w < a->shelf_x + w) {
+    a->shelf_y += a->shelf_h;
+    a->shelf_x = a->shelf_h = 0;
+  }
+
+  while (a->h < a->shelf_y + h)
+    if (!atlas_grow(a)) return false;
+
+  *x = a->shelf_x;
+  *y = a->shelf_y;
+  a->shelf_x += w;
+  a->shelf_h = MAX(a->shelf_h, h);
+
+  return true;
+}
+
+
+static void atlas_upload(Atlas *a, AtlasEntry *e, const uint8_t *mask,
+                         int stride) {
+  XImage *img =
+    XCreateImage(a->dpy, DefaultVisual(a->dpy, DefaultScreen(a->dpy)), 8,
+                 ZPixmap, 0, (char *)mask, e->w, e->h, 8, stride);
+  if (!img) return;
+
+  XPutImage(a->dpy, a->pixmap, a->gc, img, 0, 0, e->x, e->y, e->w, e->h);
+  img->data = 0; // Not ours to free
+  XDestroyImage(img);
+  a->uploads++;
+}
+
+
+/// Returns the label's mask, rasterizing and uploading it the first time.
+static AtlasEntry *atlas_entry(Atlas *a, const char *label) {
+  for (int i = 0; i < a->count; i++)
+    if (!strcmp(a->entries[i].label, label)) return &a->entries[i];
+
+  int w, h, x, y;
+  uint8_t *mask = raster_label(a->raster, label, &w, &h);
+  int stride = w;
+  w = MIN(w, a->w);
+
+  if (!atlas_place(a, w, h, &x, &y)) {
+    atlas_clear(a);
+    if (!atlas_place(a, w, h, &x, &y)) {
+      free(mask);
+      return 0;
+    }
+  }
+
+  if (a->size == a->count) {
+    a->size = a->size ? a->size * 2 : 64;
+    a->entries = realloc(a->entries, a->size * sizeof(AtlasEntry));
+  }
+
+  AtlasEntry *e = &a->entries[a->count++];
+  snprintf(e->label, sizeof(e->label), "%s", label);
+  e->x = x;
+  e->y = y;
+  e->w = w;
+  e->h = h;
+
+  atlas_upload(a, e, mask, stride);
+  free(mask);
+
+  return e;
+}
+
+
+static XRenderColor atlas_rgb(uint32_t rgb) {
+  XRenderColor c = {
+    (rgb >> 16 & 0xff) * 0x101, (rgb >> 8 & 0xff) * 0x101,
+    (rgb & 0xff) * 0x101, 0xffff};
+  return c;
+}
+
+
+/// Returns a solid fill of ``rgb``, one per color ever used.
+static Picture atlas_color(Atlas *a, uint32_t rgb) {
+  for (int i = 0; i < a->ncolors; i++)
+    if (a->colors[i].rgb == rgb) return a->colors[i].picture;
+
+  XRenderColor c = atlas_rgb(rgb);
+  a->colors = realloc(a->colors, (a->ncolors + 1) * sizeof(AtlasColor));
+  AtlasColor *color = &a->colors[a->ncolors++];
+  color->rgb = rgb;
+  color->picture = XRenderCreateSolidFill(a->dpy, &c);
+
+  return color->picture;
+}
+
+
+/// Returns zero if the server cannot composite through an alpha mask.
+Atlas *atlas_create(DrwCtx *ctx, Raster *raster) {
+  int event, error, major = 0, minor = 0;
+  if (!raster || !XRenderQueryExtension(ctx->dpy, &event, &error) ||
+      !XRenderQueryVersion(ctx->dpy, &major, &minor) ||
+      (major == 0 && minor < 10)) return 0; // 0.10 added solid fills
+
+  Atlas *a = calloc(1, sizeof(Atlas));
+  a->dpy = ctx->dpy;
+  a->root = ctx->root;
+  a->raster = raster;
+  a->format = XRenderFindStandardFormat(a->dpy, PictStandardA8);
+  a->w = ATLAS_WIDTH;
+
+  if (!a->format) {
+    free(a);
+    return 0;
+  }
+
+  atlas_alloc(a, 64);
+
+  return a;
+}
+
+
+void atlas_destroy(Atlas *a) {
+  if (!a) return;
+
+  for (int i = 0; i < a->ncolors; i++)
+    XRenderFreePicture(a->dpy, a->colors[i].picture);
+
+  atlas_free(a);
+  if (a->gc) XFreeGC(a->dpy, a->gc);
+  free(a->colors);
+  free(a->entries);
+  free(a);
+}
+
+
+/// Uploads the mask of ``label`` ahead of its first use.
+void atlas_warm(Atlas *a, const char *label) {
+  atlas_entry(a, label);
+}
+
+
+/// Draws a tile the way raster_draw() does: a fill in its background and
+/// the label centered in its foreground.  Two requests once the label and
+/// colors have been seen.
+void atlas_tile(Atlas *a, Picture dst, const RasterTile *tile) {
+  XRenderColor bg = atlas_rgb(tile->bg);
+  XRenderFillRectangle(a->dpy, PictOpSrc, dst, &bg, tile->x, tile->y,
+                       tile->w, tile->h);
+
+  AtlasEntry *e = *tile->label ? atlas_entry(a, tile->label) : 0;
+  if (!e) return;
+
+  // Centered and clipped to the tile
+  int x = tile->x + (tile->w - e->w) / 2;
+  int y = tile->y + (tile->h - e->h) / 2;
+  int sx = MAX(0, tile->x - x);
+  int sy = MAX(0, tile->y - y);
+  int w = MIN(e->w, tile->x + tile->w - x) - sx;
+  int h = MIN(e->h, tile->y + tile->h - y) - sy;
+  if (w <= 0 || h <= 0) return;
+
+  XRenderComposite(a->dpy, PictOpOver, atlas_color(a, tile->fg), a->picture,
+                   dst, 0, 0, e->x + sx, e->y + sy, x + sx, y + sy, w, h);
+}
+
+
+/// Server memory held by the atlas pixmap.
+size_t atlas_bytes(Atlas *a) {
+  return a ? (size_t)a->w * a->h : 0;
+}
@@ -0,0 +1,62 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include "drw.h"
+#include "raster.h"
+
+#include <stddef.h>
+
+
+#define ATLAS_WIDTH 1024
+#define ATLAS_HEIGHT_MAX 2048
+
+typedef struct {
+  char label[RASTER_LABEL_MAX];
+  int x, y, w, h; // Of its mask in the atlas
+} AtlasEntry;
+
+typedef struct {
+  uint32_t rgb;
+  Picture picture; // Solid fill
+} AtlasColor;
+
+/// Label masks uploaded once to an alpha only pixmap on the X server.  A key
+/// in any color scheme is then a fill and a composite through its mask.
+typedef struct {
+  Display *dpy;
+  Window root;
+  Raster *raster; // Rasterizes the labels
+
+  XRenderPictFormat *format; // A8
+  Pixmap pixmap;
+  Picture picture;
+  GC gc;
+  int w, h;
+  int shelf_x, shelf_y, shelf_h; // Where the next mask goes
+
+  AtlasEntry *entries;
+  int count;
+  int size;
+
+  AtlasColor *colors;
+  int ncolors;
+
+  unsigned uploads;
+} Atlas;
+
+
+Atlas *atlas_create(DrwCtx *ctx, Raster *raster);
+void atlas_destroy(Atlas *a);
+void atlas_warm(Atlas *a, const char *label);
+void atlas_tile(Atlas *a, Picture dst, const RasterTile *tile);
+size_t atlas_bytes(Atlas *a);
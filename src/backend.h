@@ -0,0 +1,119 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include "drw.h"
+#include "raster.h"
+#include "layout.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define HEADLESS_LOG_SIZE 1024 // Most recent operations kept, power of two
+#define HEADLESS_HELD_MAX 32
+
+struct Keyboard;
+
+/// What a long press popup shows, one cell per alternate
+typedef struct {
+  int n;
+  int selected; // Cell drawn pressed, -1 for none
+  int cell_w, cell_h; // Each cell is inset by ``space`` on its top left
+  int space;
+  Clr *scheme;
+  Clr *press;
+  Clr *bg;
+  char labels[LAYOUT_ALTS_MAX][LAYOUT_ALT_MAX];
+} BackendPopup;
+
+/// What the keyboard needs from the display system.  Layout, hit-testing
+/// and the press and modifier state machine only go through this.
+typedef struct Backend {
+  const char *name;
+  unsigned modifier_delay_us; // Lets the system act on a tapped modifier
+
+  uint64_t (*clock)(struct Keyboard *kbd); // Nanoseconds, for timers
+
+  // Window control.  The popup window is created hidden with the keyboard's.
+  void (*window_create)(struct Keyboard *kbd);
+  void (*window_destroy)(struct Keyboard *kbd);
+  void (*window_move)(struct Keyboard *kbd, int x, int y, int w, int h);
+  void (*window_show)(struct Keyboard *kbd, bool show);
+  int (*screen_height)(struct Keyboard *kbd);
+
+  // Back buffers, one per layer.  Called between lock() and unlock().
+  void *(*buffers_create)(struct Keyboard *kbd, int w, int h, int n);
+  void (*buffers_resize)(void *buffers, int w, int h, int n);
+  void (*buffers_free)(void *buffers);
+  void (*lock)(struct Keyboard *kbd); // Until queued drawing is done
+  void (*unlock)(struct Keyboard *kbd);
+
+  // Drawing in to the selected buffer and presenting it
+  void (*schemes_create)(struct Keyboard *kbd, Clr *schemes[],
+                         const char *colors[][2], size_t count);
+  void (*select)(struct Keyboard *kbd, int buffer);
+  void (*fill)(struct Keyboard *kbd, int x, int y, int w, int h,
+               Clr *scheme);
+  void (*text)(struct Keyboard *kbd, int x, int y, int w, int h,
+               Clr *scheme, const char *label, bool present);
+  void (*present)(struct Keyboard *kbd, int x, int y, int w, int h);
+  void (*flush)(struct Keyboard *kbd);
+
+  // Long press popup.  Its buffer is reserved ahead of time so showing it
+  // only draws, moves and maps.
+  void (*popup_reserve)(struct Keyboard *kbd, int w, int h);
+  void (*popup_show)(struct Keyboard *kbd, int x, int y,
+                     const BackendPopup *popup);
+  void (*popup_hide)(struct Keyboard *kbd);
+
+  // Optional, draws a whole buffer of tiles over ``bg`` at once.  Returns
+  // false to have it drawn with fill() and text() instead.
+  bool (*tiles)(struct Keyboard *kbd, uint32_t bg, const RasterTile *tiles,
+                int n);
+
+  // Input injection
+  void (*inject_key)(struct Keyboard *kbd, KeySym keysym, bool press);
+  unsigned (*inject_string)(struct Keyboard *kbd, const char *text);
+} Backend;
+
+
+typedef enum {
+  HeadlessSelect, HeadlessFill, HeadlessText, HeadlessPresent, HeadlessPress,
+  HeadlessRelease, HeadlessString, HeadlessMove, HeadlessShow, HeadlessHide,
+  HeadlessPopup, HeadlessPopupHide, HeadlessLast
+} HeadlessOpType;
+
+typedef struct {
+  HeadlessOpType type;
+  int x, y, w, h; // Or the buffer selected
+  KeySym keysym;
+} HeadlessOp;
+
+/// Operations recorded in memory by the headless backend
+typedef struct {
+  unsigned counts[HeadlessLast];
+  unsigned long total;
+  uint64_t clock; // Time of the event being replayed
+
+  struct {
+    KeySym keysym;
+    unsigned count;
+  } held[HEADLESS_HELD_MAX]; // Keys pressed and not yet released
+  int nheld;
+  unsigned unmatched; // Releases without a press
+  HeadlessOp ops[HEADLESS_LOG_SIZE];
+} HeadlessLog;
+
+
+extern const Backend backend_x11;
+extern const Backend backend_headless;
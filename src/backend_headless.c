@@ -0,0 +1,223 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "backend.h"
+#include "keyboard.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+
+#define HEADLESS_WINDOW 1 // Traces replay their keyboard events to this
+#define HEADLESS_XI_OPCODE 131 // Any nonzero value enables touch events
+
+
+static HeadlessLog *headless_log(Keyboard *kbd) {
+  return (HeadlessLog *)kbd->backend_data;
+}
+
+
+static void headless_record(Keyboard *kbd, HeadlessOpType type, int x, int y,
+                            int w, int h, KeySym keysym) {
+  HeadlessLog *log = headless_log(kbd);
+  HeadlessOp op = {type, x, y, w, h, keysym};
+
+  log->ops[log->total++ & (HEADLESS_LOG_SIZE - 1)] = op;
+  log->counts[type]++;
+}
+
+
+/// Injected keys are checked in place of being sent: every release must
+/// follow a press of the same key.
+static void headless_hold(HeadlessLog *log, KeySym keysym, bool press) {
+  int i = 0;
+  while (i < log->nheld && log->held[i].keysym != keysym) i++;
+
+  if (press) {
+    if (i == log->nheld) {
+      if (i == HEADLESS_HELD_MAX) {
+        log->unmatched++;
+        return;
+      }
+
+      log->held[log->nheld++].keysym = keysym;
+      log->held[i].count = 0;
+    }
+
+    log->held[i].count++;
+    return;
+  }
+
+  if (i == log->nheld) {
+    log->unmatched++;
+    return;
+  }
+
+  if (!--log->held[i].count) log->held[i] = log->held[--log->nheld];
+}
+
+
+static uint64_t headless_clock(Keyboard *kbd) {
+  return headless_log(kbd)->clock;
+}
+
+
+static void headless_window_create(Keyboard *kbd) {
+  kbd->backend_data = calloc(1, sizeof(HeadlessLog));
+  kbd->win = HEADLESS_WINDOW;
+  kbd->xi_opcode = HEADLESS_XI_OPCODE;
+}
+
+
+static void headless_window_destroy(Keyboard *kbd) {
+  free(kbd->backend_data);
+  kbd->backend_data = 0;
+}
+
+
+static void headless_window_move(Keyboard *kbd, int x, int y, int w, int h) {
+  headless_record(kbd, HeadlessMove, x, y, w, h, 0);
+}
+
+
+static void headless_window_show(Keyboard *kbd, bool show) {
+  headless_record(kbd, show ? HeadlessShow : HeadlessHide, kbd->x, kbd->y,
+                  kbd->w, kbd->h, 0);
+}
+
+
+static int headless_screen_height(Keyboard *kbd) {
+  return kbd->y + kbd->h;
+}
+
+
+// Buffers hold nothing, a distinct allocation lets keyboards share them
+static void *headless_buffers_create(Keyboard *kbd, int w, int h, int n) {
+  return calloc(1, 1);
+}
+
+
+static void headless_buffers_resize(void *buffers, int w, int h, int n) {}
+static void headless_buffers_free(void *buffers) {free(buffers);}
+static void headless_lock(Keyboard *kbd) {}
+static void headless_unlock(Keyboard *kbd) {}
+
+
+/// Only ``#rrggbb`` colors are understood, others are black.
+static void headless_schemes_create(Keyboard *kbd, Clr *schemes[],
+                                    const char *colors[][2], size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    schemes[i] = calloc(ColBg + 1, sizeof(Clr));
+
+    for (int j = 0; j <= ColBg; j++) {
+      unsigned r = 0, g = 0, b = 0;
+      if (colors[i][j]) sscanf(colors[i][j], "#%2x%2x%2x", &r, &g, &b);
+
+      XRenderColor c = {r * 257, g * 257, b * 257, 0xffff};
+      schemes[i][j].color = c;
+    }
+  }
+}
+
+
+static void headless_select(Keyboard *kbd, int buffer) {
+  headless_record(kbd, HeadlessSelect, buffer, 0, 0, 0, 0);
+}
+
+
+static void headless_fill(Keyboard *kbd, int x, int y, int w, int h,
+                          Clr *scheme) {
+  headless_record(kbd, HeadlessFill, x, y, w, h, 0);
+}
+
+
+static void headless_text(Keyboard *kbd, int x, int y, int w, int h,
+                          Clr *scheme, const char *label, bool present) {
+  headless_record(kbd, HeadlessText, x, y, w, h, 0);
+  if (present) headless_record(kbd, HeadlessPresent, x, y, w, h, 0);
+}
+
+
+static void headless_present(Keyboard *kbd, int x, int y, int w, int h) {
+  headless_record(kbd, HeadlessPresent, x, y, w, h, 0);
+}
+
+
+static void headless_flush(Keyboard *kbd) {}
+static void headless_popup_reserve(Keyboard *kbd, int w, int h) {}
+
+
+static void headless_popup_show(Keyboard *kbd, int x, int y,
+                                const BackendPopup *p) {
+  headless_record(kbd, HeadlessPopup, x, y, p->n * p->cell_w + p->space,
+                  p->cell_h + p->space, 0);
+}
+
+
+static void headless_popup_hide(Keyboard *kbd) {
+  headless_record(kbd, HeadlessPopupHide, 0, 0, 0, 0, 0);
+}
+
+
+static void headless_inject_key(Keyboard *kbd, KeySym keysym, bool press) {
+  if (!keysym) return;
+
+  headless_record(kbd, press ? HeadlessPress : HeadlessRelease, 0, 0, 0, 0,
+                  keysym);
+  headless_hold(headless_log(kbd), keysym, press);
+}
+
+
+static unsigned headless_inject_string(Keyboard *kbd, const char *text) {
+  unsigned count = 0;
+
+  // Counts UTF-8 characters
+  for (const char *s = text; *s; s++)
+    if ((*s & 0xc0) != 0x80) count++;
+
+  headless_record(kbd, HeadlessString, count, 0, 0, 0, 0);
+  return count;
+}
+
+
+/// Records in memory what the X11 backend would draw and send.  Traces
+/// replay through it without a display to fuzz and benchmark the keyboard.
+const Backend backend_headless = {
+  .name = "headless",
+  .modifier_delay_us = 0,
+  .clock = headless_clock,
+
+  .window_create = headless_window_create,
+  .window_destroy = headless_window_destroy,
+  .window_move = headless_window_move,
+  .window_show = headless_window_show,
+  .screen_height = headless_screen_height,
+
+  .buffers_create = headless_buffers_create,
+  .buffers_resize = headless_buffers_resize,
+  .buffers_free = headless_buffers_free,
+  .lock = headless_lock,
+  .unlock = headless_unlock,
+
+  .schemes_create = headless_schemes_create,
+  .select = headless_select,
+  .fill = headless_fill,
+  .text = headless_text,
+  .present = headless_present,
+  .flush = headless_flush,
+
+  .popup_reserve = headless_popup_reserve,
+  .popup_show = headless_popup_show,
+  .popup_hide = headless_popup_hide,
+
+  .inject_key = headless_inject_key,
+  .inject_string = headless_inject_string,
+};
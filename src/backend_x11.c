@@ -0,0 +1,496 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "backend.h"
+#include "keyboard.h"
+#include "inject.h"
+#include "util.h"
+
+#include <X11/Xatom.h>
+#include <X11/extensions/XInput2.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/// A whole buffer queued for the rasterizer, owned by its operation
+typedef struct {
+  uint32_t bg;
+  int n;
+  RasterTile tiles[];
+} X11Tiles;
+
+
+static Window create_window(Display *dpy, DrwCtx *ctx, const char *name,
+                            int w, int h, int x, int y, unsigned long fg,
+                            unsigned long bg) {
+  XSetWindowAttributes wa;
+  wa.border_pixel = fg;
+  wa.background_pixel = bg;
+  wa.backing_store = Always;
+
+  Window win = XCreateWindow
+    (dpy, ctx->root, x, y, w, h, 0, CopyFromParent, CopyFromParent,
+     CopyFromParent, CWBorderPixel | CWBackingPixel | CWBackingStore, &wa);
+
+  // Enable window events
+  XSelectInput(dpy, win, StructureNotifyMask | ButtonReleaseMask |
+               ButtonPressMask | ExposureMask | PointerMotionMask |
+               LeaveWindowMask);
+
+  // Set window properties
+  XWMHints *wmHints = XAllocWMHints();
+  wmHints->input = false;
+  wmHints->flags = InputHint;
+
+  XTextProperty str;
+  XStringListToTextProperty((char **)&name, 1, &str);
+
+  XClassHint *classHints = XAllocClassHint();
+  classHints->res_class = (char *)name;
+  classHints->res_name = (char *)name;
+
+  XSetWMProperties(dpy, win, &str, &str, 0, 0, 0, wmHints, classHints);
+
+  XFree(classHints);
+  XFree(wmHints);
+  XFree(str.value);
+
+  // Set window type
+  Atom *atoms = display_ctx(dpy)->atoms;
+  XChangeProperty(dpy, win, atoms[NetWMWindowType], XA_ATOM, 32,
+                  PropModeReplace,
+                  (unsigned char *)&atoms[NetWMWindowTypeDock], 1);
+
+  // Set cursor
+  Cursor cursor = drw_ctx_cursor(ctx, "hand1");
+  if (ctx->dpy != dpy) XSync(ctx->dpy, false); // Created on the render display
+  XDefineCursor(dpy, win, cursor);
+
+  return win;
+}
+
+
+/// Selects XInput2 touch events so each finger is tracked separately.
+/// Returns the extension's opcode, or zero if only core pointer events are
+/// available.
+static int select_touch(Display *dpy, Window win) {
+  int opcode, event, error;
+  if (!XQueryExtension(dpy, "XInputExtension", &opcode, &event, &error))
+    return 0;
+
+  int major = 2, minor = 2; // First version with touch events
+  if (XIQueryVersion(dpy, &major, &minor) != Success ||
+      (major == 2 && minor < 2)) return 0;
+
+  unsigned char bits[XIMaskLen(XI_LASTEVENT)] = {0};
+  XISetMask(bits, XI_TouchBegin);
+  XISetMask(bits, XI_TouchUpdate);
+  XISetMask(bits, XI_TouchEnd);
+
+  XIEventMask mask = {XIAllMasterDevices, sizeof(bits), bits};
+  XISelectEvents(dpy, win, &mask, 1);
+
+  return opcode;
+}
+
+
+/// An unmanaged window above the keyboard, drawn only from its buffer.
+static Window create_popup(Display *dpy, DrwCtx *ctx) {
+  XSetWindowAttributes wa;
+  wa.override_redirect = true;
+  wa.background_pixmap = None; // Nothing is painted before the copy
+  wa.backing_store = Always;
+
+  Window win = XCreateWindow
+    (dpy, ctx->root, 0, 0, 1, 1, 0, CopyFromParent, CopyFromParent,
+     CopyFromParent, CWOverrideRedirect | CWBackPixmap | CWBackingStore, &wa);
+
+  // Drawn and mapped from the render connection
+  XSync(dpy, false);
+
+  return win;
+}
+
+
+static uint64_t x11_clock(Keyboard *kbd) {return get_time_ns();}
+
+
+static void x11_window_create(Keyboard *kbd) {
+  Clr *clr = kbd->scheme[SchemeNorm];
+  kbd->win = create_window(kbd->dpy, kbd->render->ctx, "bbkbd", kbd->w,
+                           kbd->h, kbd->x, kbd->y, clr[ColFg].pixel,
+                           clr[ColBg].pixel);
+  kbd->xi_opcode = select_touch(kbd->dpy, kbd->win);
+  kbd->popup_win = create_popup(kbd->dpy, kbd->render->ctx);
+  pthread_mutex_init(&kbd->popup_lock, 0);
+}
+
+
+static void x11_window_destroy(Keyboard *kbd) {
+  Display *dpy = kbd->dpy;
+
+  if (kbd->popup_buffers) {
+    drw_sync((Drw *)kbd->popup_buffers);
+    drw_free((Drw *)kbd->popup_buffers);
+  }
+
+  XSync(dpy, false);
+  XDestroyWindow(dpy, kbd->popup_win);
+  XDestroyWindow(dpy, kbd->win);
+  XSync(dpy, false);
+  pthread_mutex_destroy(&kbd->popup_lock);
+  XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
+}
+
+
+static void x11_window_move(Keyboard *kbd, int x, int y, int w, int h) {
+  XMoveResizeWindow(kbd->dpy, kbd->win, x, y, w, h);
+}
+
+
+/// Shows by mapping, or moving back on screen when parked.  Hides by
+/// unmapping, or parking below the screen.
+static void x11_window_show(Keyboard *kbd, bool show) {
+  Display *dpy = kbd->dpy;
+
+  if (show) {
+    XRaiseWindow(dpy, kbd->win);
+    if (kbd->park) XMoveWindow(dpy, kbd->win, kbd->x, kbd->y);
+    if (!kbd->mapped) XMapWindow(dpy, kbd->win);
+
+  } else if (kbd->park) XMoveWindow(dpy, kbd->win, kbd->x, kbd->park_y);
+  else XUnmapWindow(dpy, kbd->win);
+}
+
+
+static int x11_screen_height(Keyboard *kbd) {
+  return DisplayHeight(kbd->dpy, kbd->render->ctx->screen);
+}
+
+
+static void *x11_buffers_create(Keyboard *kbd, int w, int h, int n) {
+  Drw *drw = drw_create(kbd->render->ctx, w, h);
+  drw_buffers(drw, n);
+  return drw;
+}
+
+
+static void x11_buffers_resize(void *buffers, int w, int h, int n) {
+  Drw *drw = (Drw *)buffers;
+  bool recount = drw->nbuffers != n;
+
+  if (recount) drw_buffers(drw, 0);
+  drw_resize(drw, w, h);
+  if (recount) drw_buffers(drw, n);
+}
+
+
+static void x11_buffers_free(void *buffers) {
+  drw_sync((Drw *)buffers);
+  drw_free((Drw *)buffers);
+}
+
+
+static void x11_lock(Keyboard *kbd) {render_lock(kbd->render);}
+static void x11_unlock(Keyboard *kbd) {render_unlock(kbd->render);}
+
+
+static void x11_schemes_create(Keyboard *kbd, Clr *schemes[],
+                               const char *colors[][2], size_t count) {
+  drw_scms_create((Drw *)kbd->buffers, schemes, colors, count);
+}
+
+
+// The following run wherever the render queue executes operations and may
+// only use what the operation carries.
+
+/// Draws a key from the glyph atlas if there is one, otherwise with Xft.
+static void draw_key(Render *render, Drw *drw, int x, int y, int w, int h,
+                     Clr *scheme, const char *label) {
+  if (render->atlas) {
+    RasterTile tile = {x, y, w, h, drw_clr_rgb(&scheme[ColFg]),
+      drw_clr_rgb(&scheme[ColBg])};
+    snprintf(tile.label, sizeof(tile.label), "%s", label);
+    atlas_tile(render->atlas, drw_picture(drw), &tile);
+    return;
+  }
+
+  drw_setscheme(drw, scheme);
+  drw_rect(drw, x, y, w, h, 1, 1);
+
+  int th = drw->ctx->fonts[0].xfont->height * 2;
+  int ty = y + (h - th) / 2;
+  int tw = drw_fontset_getwidth(drw, label);
+  int tx = x + (w - tw) / 2;
+  drw_text(drw, tx, ty, tw, th, 0, label, 0);
+}
+
+
+static void exec_key(void *data, const RenderOp *op) {
+  Keyboard *kbd = (Keyboard *)data;
+  Drw *drw = (Drw *)kbd->buffers;
+
+  draw_key(kbd->render, drw, op->x, op->y, op->w, op->h, (Clr *)op->ptr,
+           op->text);
+
+  if (op->arg) drw_map(drw, kbd->win, op->x, op->y, op->w, op->h);
+}
+
+
+/// Draws every cell, then moves, maps and fills the window in one batch of
+/// requests so the popup appears complete.  The cells are the keyboard's
+/// one popup slot, so an operation overtaken by a later show draws nothing.
+static void exec_popup(void *data, const RenderOp *op) {
+  Keyboard *kbd = (Keyboard *)data;
+  Drw *drw = (Drw *)kbd->popup_buffers;
+  BackendPopup p;
+
+  pthread_mutex_lock(&kbd->popup_lock);
+  bool latest = kbd->popup_serial == (unsigned)op->arg;
+  if (latest) p = kbd->popup_shown;
+  pthread_mutex_unlock(&kbd->popup_lock);
+  if (!latest) return;
+
+  draw_key(kbd->render, drw, 0, 0, op->w, op->h, p.bg, "");
+
+  for (int i = 0; i < p.n; i++)
+    draw_key(kbd->render, drw, i * p.cell_w + p.space, p.space,
+             p.cell_w - p.space, p.cell_h - p.space,
+             i == p.selected ? p.press : p.scheme, p.labels[i]);
+
+  XMoveResizeWindow(drw->dpy, kbd->popup_win, op->x, op->y, op->w, op->h);
+  XMapRaised(drw->dpy, kbd->popup_win);
+  drw_map(drw, kbd->popup_win, 0, 0, op->w, op->h);
+}
+
+
+static void exec_popup_hide(void *data, const RenderOp *op) {
+  Keyboard *kbd = (Keyboard *)data;
+  XUnmapWindow(kbd->render->dpy, kbd->popup_win);
+}
+
+
+static void exec_fill(void *data, const RenderOp *op) {
+  Drw *drw = (Drw *)((Keyboard *)data)->buffers;
+  drw_setscheme(drw, (Clr *)op->ptr);
+  drw_rect(drw, op->x, op->y, op->w, op->h, 1, 1);
+}
+
+
+static void exec_map(void *data, const RenderOp *op) {
+  Keyboard *kbd = (Keyboard *)data;
+  drw_map((Drw *)kbd->buffers, kbd->win, op->x, op->y, op->w, op->h);
+}
+
+
+static void exec_select(void *data, const RenderOp *op) {
+  drw_select((Drw *)((Keyboard *)data)->buffers, op->arg);
+}
+
+
+/// Composites every tile from the atlas on the server.
+static void exec_atlas(Keyboard *kbd, const RenderOp *op, const X11Tiles *t) {
+  Drw *drw = (Drw *)kbd->buffers;
+  Picture dst = drw_picture(drw);
+  RasterTile bg = {0, 0, op->w, op->h, t->bg, t->bg};
+
+  atlas_tile(kbd->render->atlas, dst, &bg);
+  for (int i = 0; i < t->n; i++)
+    atlas_tile(kbd->render->atlas, dst, &t->tiles[i]);
+}
+
+
+/// Takes the keyboard's part of the buffer from the cache, or rasterizes it
+/// on the pool while the render thread waits, then uploads it in one image.
+static void exec_tiles(void *data, const RenderOp *op) {
+  Keyboard *kbd = (Keyboard *)data;
+  Drw *drw = (Drw *)kbd->buffers;
+  X11Tiles *t = (X11Tiles *)op->ptr;
+  Raster *raster = kbd->render->raster;
+  Cache *cache = kbd->render->cache;
+  int w = op->w, h = op->h;
+
+  if (kbd->render->atlas) {
+    exec_atlas(kbd, op, t);
+    free(t);
+    return;
+  }
+
+  uint64_t key = cache ? raster_key(raster, w, h, t->bg, t->tiles, t->n) : 0;
+  const uint32_t *pixels = cache ? cache_find(cache, key, w, h) : 0;
+
+  if (!pixels) {
+    pixels = raster_draw(raster, w, h, t->bg, t->tiles, t->n);
+    if (cache) cache_add(cache, key, w, h, pixels);
+  }
+
+  drw_put(drw, pixels, w, h);
+  free(t);
+}
+
+
+static void x11_select(Keyboard *kbd, int buffer) {
+  RenderOp op = {exec_select, kbd, .arg = buffer};
+  render_push(kbd->render, &op);
+}
+
+
+static void x11_fill(Keyboard *kbd, int x, int y, int w, int h, Clr *scheme) {
+  RenderOp op = {exec_fill, kbd, x, y, w, h, 0, scheme, .redraw = true};
+  render_push(kbd->render, &op);
+}
+
+
+/// Labels are copied as suggestions change before they are drawn.
+static void x11_text(Keyboard *kbd, int x, int y, int w, int h, Clr *scheme,
+                     const char *label, bool present) {
+  RenderOp op = {exec_key, kbd, x, y, w, h, present, scheme, .redraw = true};
+  snprintf(op.text, sizeof(op.text), "%s", label);
+  render_push(kbd->render, &op);
+}
+
+
+static void x11_present(Keyboard *kbd, int x, int y, int w, int h) {
+  RenderOp op = {exec_map, kbd, x, y, w, h, .redraw = true};
+  render_push(kbd->render, &op);
+}
+
+
+static bool x11_tiles(Keyboard *kbd, uint32_t bg, const RasterTile *tiles,
+                      int n) {
+  if (!kbd->render->raster) return false;
+
+  X11Tiles *t = malloc(sizeof(X11Tiles) + n * sizeof(RasterTile));
+  t->bg = bg;
+  t->n = n;
+  memcpy(t->tiles, tiles, n * sizeof(RasterTile));
+
+  RenderOp op = {exec_tiles, kbd, 0, 0, kbd->w, kbd->h, .ptr = t};
+  render_push(kbd->render, &op);
+
+  return true;
+}
+
+
+/// Loads the glyphs of every alternate in the layout, in to the atlas or
+/// with any fallback fonts Xft needs, so a long press draws from cache.
+static void popup_warm(Keyboard *kbd) {
+  Layout *layout = kbd->layout;
+  Atlas *atlas = kbd->render->atlas;
+  char label[LAYOUT_ALT_MAX];
+
+  for (int i = 0; i < layout->nlayers; i++) {
+    Layer *layer = &layout->layers[i];
+
+    for (int r = 0; r < layer->rows; r++)
+      for (Key *k = layer->keys[r]; k->keysym; k++)
+        for (const char *s = k->alts; s && *s;) {
+          int len = strcspn(s, " ");
+          snprintf(label, sizeof(label), "%.*s", len, s);
+          s += len + strspn(s + len, " ");
+
+          if (atlas) atlas_warm(atlas, label);
+          else drw_fontset_getwidth((Drw *)kbd->popup_buffers, label);
+        }
+  }
+}
+
+
+/// Grows the popup's buffer and warms its glyphs, never on the press path.
+static void x11_popup_reserve(Keyboard *kbd, int w, int h) {
+  bool grow = kbd->popup_w < w || kbd->popup_h < h;
+  kbd->popup_w = MAX(w, kbd->popup_w);
+  kbd->popup_h = MAX(h, kbd->popup_h);
+
+  render_lock(kbd->render);
+  if (grow && kbd->popup_buffers)
+    drw_resize((Drw *)kbd->popup_buffers, kbd->popup_w, kbd->popup_h);
+  else if (grow)
+    kbd->popup_buffers =
+      drw_create(kbd->render->ctx, kbd->popup_w, kbd->popup_h);
+
+  if (kbd->popup_buffers) popup_warm(kbd);
+  render_unlock(kbd->render);
+}
+
+
+/// Copies ``popup`` in to the keyboard's one slot, nothing is allocated.
+static void x11_popup_show(Keyboard *kbd, int x, int y,
+                           const BackendPopup *popup) {
+  int w = MIN(popup->n * popup->cell_w + popup->space, kbd->popup_w);
+  int h = MIN(popup->cell_h + popup->space, kbd->popup_h);
+  if (!kbd->popup_buffers || w <= 0 || h <= 0) return;
+
+  pthread_mutex_lock(&kbd->popup_lock);
+  kbd->popup_shown = *popup;
+  unsigned serial = ++kbd->popup_serial;
+  pthread_mutex_unlock(&kbd->popup_lock);
+
+  RenderOp op = {exec_popup, kbd, x, y, w, h, serial};
+  render_push(kbd->render, &op);
+}
+
+
+static void x11_popup_hide(Keyboard *kbd) {
+  RenderOp op = {exec_popup_hide, kbd};
+  render_push(kbd->render, &op);
+}
+
+
+static void x11_flush(Keyboard *kbd) {
+  XFlush(kbd->dpy);
+  render_flush(kbd->render);
+}
+
+
+static void x11_inject_key(Keyboard *kbd, KeySym keysym, bool press) {
+  inject_key(kbd->inject, keysym, press);
+}
+
+
+static unsigned x11_inject_string(Keyboard *kbd, const char *text) {
+  return inject_string(kbd->inject, text);
+}
+
+
+const Backend backend_x11 = {
+  .name = "x11",
+  .modifier_delay_us = 100000,
+  .clock = x11_clock,
+
+  .window_create = x11_window_create,
+  .window_destroy = x11_window_destroy,
+  .window_move = x11_window_move,
+  .window_show = x11_window_show,
+  .screen_height = x11_screen_height,
+
+  .buffers_create = x11_buffers_create,
+  .buffers_resize = x11_buffers_resize,
+  .buffers_free = x11_buffers_free,
+  .lock = x11_lock,
+  .unlock = x11_unlock,
+
+  .schemes_create = x11_schemes_create,
+  .select = x11_select,
+  .fill = x11_fill,
+  .text = x11_text,
+  .present = x11_present,
+  .flush = x11_flush,
+
+  .popup_reserve = x11_popup_reserve,
+  .popup_show = x11_popup_show,
+  .popup_hide = x11_popup_hide,
+  .tiles = x11_tiles,
+
+  .inject_key = x11_inject_key,
+  .inject_string = x11_inject_string,
+};
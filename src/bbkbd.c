@@ -10,18 +10,32 @@
 \******************************************************************************/
 
 #include "keyboard.h"
+#include "backend.h"
 #include "button.h"
 #include "drw.h"
 #include "util.h"
 #include "wm.h"
+#include "trace.h"
+#include "render.h"
+#include "ctl.h"
+#include "clip.h"
+#include "inject.h"
+#include "log.h"
+#include "output.h"
 #include "config.h"
 
+#include <X11/extensions/XInput2.h>
+
 #include <signal.h>
 #include <locale.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <limits.h>
 
 
 #define DEFAULT_FONT "DejaVu Sans:size=18"
@@ -29,39 +43,142 @@
 static const char *font = DEFAULT_FONT;
 static float button_x = 1;
 static float button_y = 0;
-static bool running = true;
+static volatile bool running = true;
 static const char *show_cmd = 0;
 static const char *hide_cmd = 0;
 static const char *kiosk_cmd = 0;
 static int space = 4;
-static volatile bool signal_open = false;
-static bool button_open = false;
+static volatile uint64_t signal_time = 0;
+static const char *record_path = 0;
+static const char *replay_path = 0;
+static bool replay_fast = false;
+static bool replay_headless = false;
+static int raster_threads = 0;
+static int raster_bench_width = 0;
+static const char *cache_path = 0;
+static bool glyph_atlas = false;
+static const char *layout_path = 0;
+static bool startup_timing = false;
+static bool render_threaded = false;
+static const char *ctl_path = 0;
+static const char *dict_path = 0;
+static bool gestures = false;
+static const char *adapt_path = 0;
+static bool park = false;
+static bool overlay = false;
+static const char *displays[DISPLAY_MAX];
+static int ndisplays = 0;
+static sem_t session_started;
 
 
-static void signaled(int sig) {
-  running = false;
-  message("Signal %d received\n", sig);
-}
+struct Context;
+
+/// The keyboard, button and layout of one output
+typedef struct {
+  struct Context *ctx;
+  Keyboard *kbd;
+  Button *btn;
+  Layout *layout;
+} Head;
+
+/// Everything belonging to one display
+typedef struct Context {
+  const char *name; // Of the display, zero for the default
+  int index;
+  pthread_t thread;
+  int ret;
+
+  DisplayCtx *display;
+  Display *dpy;
+  const Backend *backend;
+  WM *wm;
+  Render *render;
+  Outputs *outputs;
+  Head heads[OUTPUT_MAX];
+  int nheads;
+  int active; // Head shown and hidden by signals and commands
+
+  Ctl *ctl;
+  Clip *clip;
+  Dict *dict;
+  Adapt *adapt;
+  Trace *trace;
+  int layout_fd;
+  int child; // Kiosk process
+
+  bool signal_open; // Requested by the last signal or command
+  atomic_int signal; // SIGUSR1 or SIGUSR2 not yet handled, zero if none
+  bool button_open; // Shown by a button rather than a signal
+  bool button_shown;
+
+  unsigned events;
+  unsigned toggles;
+  unsigned reloads;
+  unsigned output_changes;
+} Context;
 
+static Context *sessions = 0; // Signaled from the handler
+static int nsessions = 0;
 
+
+// Signal handlers must not log, the logger takes a lock
+static void signaled(int sig) {running = false;}
+
+
+/// Every display's session handles the signal on its own thread.
 static void kbd_signal(int sig) {
-  signal_open = sig == SIGUSR1;
-  message("Signal %d received\n", sig);
+  signal_time = get_time_ns();
+  for (int i = 0; i < nsessions; i++) atomic_store(&sessions[i].signal, sig);
 }
 
 
 void usage(char *argv0, int ret) {
   const char *usage =
-    "usage: %s [-hdb] [-f <font>] [-b <x> <y>]\n"
+    "usage: %s [-hvFnTtgOPA] [-f <font>] [-b <x> <y>] [-l <layout>]\n"
+    "       [-R <file>] [-r <file>] [-c <socket>] [-d <dict>]\n"
+    "       [-C <src> <dst>] [-D <src> <dst>] [-M <src> <dst>] [-a <file>]\n"
+    "       [-x <display>] [-j <threads>] [-J <width>] [-K <file>]\n"
     "Options:\n"
     "  -h         - Print this help screen and exit\n"
     "  -v         - Verbose output\n"
     "  -f <font>  - Font string, default: " DEFAULT_FONT "\n"
-    "  -b <x> <y> - Button screen position. Values between 0 and 1.\n"
+    "  -b <x> <y> - Button position on each output. Values between 0 and 1.\n"
     "  -S <cmd>   - Command to run before showing the keyboard.\n"
     "  -H <cmd>   - Command to run after hiding the keyboard.\n"
     "  -k <cmd>   - Run in kiosk mode.  Command is run as child process.\n"
-    "  -s <int>   - Space between buttons.\n";
+    "  -O         - Overlay clients instead of resizing them.  The covered\n"
+    "               area is published in the root property _BBKBD_OCCLUDED.\n"
+    "  -P         - Hide by moving the keyboard off screen instead of\n"
+    "               unmapping it.\n"
+    "  -s <int>   - Space between buttons.\n"
+    "  -R <file>  - Record handled X events to a trace file.\n"
+    "  -r <file>  - Replay a trace file, report timings and exit.\n"
+    "  -F         - Replay as fast as possible.\n"
+    "  -n         - Replay without a display, drawing and keys are only\n"
+    "               recorded.  Reports the operations and fails if a key\n"
+    "               was released without being pressed.\n"
+    "  -T         - Print a startup timing breakdown.\n"
+    "  -t         - Draw from a separate thread and display connection.\n"
+    "  -j <int>   - Draw whole layers with FreeType on this many threads,\n"
+    "               0 for one per core.\n"
+    "  -J <width> - Time drawing every layer at this width with 1 to one\n"
+    "               thread per core and exit.\n"
+    "  -K <file>  - Keep drawn layers in this file for the next start.\n"
+    "               Implies -j 0 unless -j is given.\n"
+    "  -A         - Upload labels once to a glyph atlas on the X server and\n"
+    "               composite them in each color.  Replaces -K.  Implies\n"
+    "               -j 0 unless -j is given.\n"
+    "  -l <file>  - Load a compiled layout.  Reloaded when the file changes.\n"
+    "  -c <path>  - Accept commands on a UNIX domain socket.\n"
+    "  -d <file>  - Suggest words from a compiled dictionary.\n"
+    "  -g         - Gesture typing.  Requires a dictionary.\n"
+    "  -a <file>  - Learn touch targets and keep them in this file.\n"
+    "  -C <src> <dst> - Compile a text layout to a binary layout and exit.\n"
+    "  -D <src> <dst> - Compile a word list to a dictionary and exit.\n"
+    "  -M <src> <dst> - Compile a touch script to a trace and exit.\n"
+    "  -x <display> - Serve this display.  Repeat to serve several from one\n"
+    "               process, each on its own thread.  Sockets and touch\n"
+    "               target files get the display's index appended.\n";
 
   fprintf(ret ? stderr : stdout, usage, argv0);
   exit(ret);
@@ -97,6 +214,69 @@ void parse_args(int argc, char *argv[]) {
       if (argc - 1 <= i) usage(argv[0], 1);
       space = atoi(argv[++i]);
 
+    } else if (!strcmp(argv[i], "-R")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      record_path = argv[++i];
+
+    } else if (!strcmp(argv[i], "-r")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      replay_path = argv[++i];
+
+    } else if (!strcmp(argv[i], "-F")) replay_fast = true;
+    else if (!strcmp(argv[i], "-n")) replay_headless = true;
+    else if (!strcmp(argv[i], "-j")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      raster_threads = atoi(argv[++i]);
+      if (raster_threads < 1) raster_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    } else if (!strcmp(argv[i], "-K")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      cache_path = argv[++i];
+
+    } else if (!strcmp(argv[i], "-A")) glyph_atlas = true;
+    else if (!strcmp(argv[i], "-J")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      raster_bench_width = atoi(argv[++i]);
+      if (raster_bench_width < 1) usage(argv[0], 1);
+
+    } else if (!strcmp(argv[i], "-T")) startup_timing = true;
+    else if (!strcmp(argv[i], "-t")) render_threaded = true;
+    else if (!strcmp(argv[i], "-g")) gestures = true;
+    else if (!strcmp(argv[i], "-O")) overlay = true;
+    else if (!strcmp(argv[i], "-P")) park = true;
+    else if (!strcmp(argv[i], "-l")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      layout_path = argv[++i];
+
+    } else if (!strcmp(argv[i], "-c")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      ctl_path = argv[++i];
+
+    } else if (!strcmp(argv[i], "-d")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      dict_path = argv[++i];
+
+    } else if (!strcmp(argv[i], "-a")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      adapt_path = argv[++i];
+
+    } else if (!strcmp(argv[i], "-x")) {
+      if (argc - 1 <= i) usage(argv[0], 1);
+      if (ndisplays == DISPLAY_MAX) die("too many displays");
+      displays[ndisplays++] = argv[++i];
+
+    } else if (!strcmp(argv[i], "-D")) {
+      if (argc - 2 <= i) usage(argv[0], 1);
+      exit(dict_compile(argv[i + 1], argv[i + 2]) ? 0 : 1);
+
+    } else if (!strcmp(argv[i], "-M")) {
+      if (argc - 2 <= i) usage(argv[0], 1);
+      exit(trace_compile(argv[i + 1], argv[i + 2]) ? 0 : 1);
+
+    } else if (!strcmp(argv[i], "-C")) {
+      if (argc - 2 <= i) usage(argv[0], 1);
+      exit(layout_compile(argv[i + 1], argv[i + 2]) ? 0 : 1);
+
     } else {
       fprintf(stderr, "Invalid argument: %s\n", argv[i]);
       usage(argv[0], 1);
@@ -105,92 +285,833 @@ void parse_args(int argc, char *argv[]) {
 }
 
 
-static void toggle(Keyboard *kbd) {
+/// Startup is timed on the first display only.
+static void startup_mark(Context *ctx, const char *phase) {
+  static uint64_t start = 0, last = 0;
+  if (!startup_timing || ctx->index) return;
+
+  uint64_t now = get_time_ns();
+  if (!start) start = last = now;
+
+  fprintf(stderr, "startup: %-16s %8.2fms %8.2fms\n", phase,
+          (now - last) / 1e6, (now - start) / 1e6);
+  last = now;
+}
+
+
+/// With several displays each one gets its own file or socket.
+static const char *session_path(Context *ctx, const char *path, char *buf) {
+  if (!path || ndisplays < 2) return path;
+  snprintf(buf, PATH_MAX, "%s.%d", path, ctx->index);
+  return buf;
+}
+
+
+static void toggle(Context *ctx, Keyboard *kbd) {
   if (!kbd->visible && show_cmd) system(show_cmd);
   keyboard_toggle(kbd);
   if (!kbd->visible && hide_cmd) system(hide_cmd);
-  wm_keyboard(kbd);
+  wm_keyboard(ctx->wm, kbd);
 }
 
 
-static void button_callback(Keyboard *kbd) {
-  button_open = !kbd->visible;
-  signal_open = false;
-  toggle(kbd);
+/// Shows or hides the keyboard as if this session was signaled.
+static void set_visible(Context *ctx, Keyboard *kbd, bool show) {
+  ctx->button_open = false;
+  ctx->signal_open = show;
+  if (kbd->visible != show) toggle(ctx, kbd);
 }
 
 
-int main(int argc, char *argv[]) {
-  signal(SIGTERM, signaled);
-  signal(SIGINT,  signaled);
-  signal(SIGUSR1, kbd_signal);
-  signal(SIGUSR2, kbd_signal);
+static void button_callback(Head *head) {
+  Context *ctx = head->ctx;
+  Keyboard *kbd = head->kbd;
 
-  parse_args(argc, argv);
+  ctx->active = head - ctx->heads;
+  ctx->button_open = !kbd->visible;
+  ctx->signal_open = false;
+  toggle(ctx, kbd);
+}
 
-  // Check locale support
-  if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
-    fprintf(stderr, "warning: no locale support");
 
-  // Init
-  Display *dpy = XOpenDisplay(0);
-  if (!dpy) die("cannot open display");
+static void head_button(Context *ctx, int i) {
+  Head *head = &ctx->heads[i];
+  head->ctx = ctx;
+  head->btn = button_create(ctx->dpy, ctx->render, &ctx->outputs->outputs[i],
+                            button_x, button_y, 55, 35);
+  button_set_callback(head->btn, button_callback, head);
+  wm_button(ctx->wm, head->btn);
+}
+
+
+static void head_keyboard(Context *ctx, int i) {
+  Head *head = &ctx->heads[i];
+
+  head->layout = layout_path ? layout_load(layout_path) :
+    layout_create(layers, colors);
+  if (!head->layout) die("failed to load layout");
+
+  Keyboard *kbd = head->kbd =
+    keyboard_create(ctx->dpy, ctx->render, ctx->backend, head->layout, space,
+                    &ctx->outputs->outputs[i]);
+  kbd->park = park;
+  kbd->inject = ctx->display ? ctx->display->inject : 0;
+  kbd->clip = ctx->clip;
+  if (ctx->clip) ctx->clip->xi = kbd->xi_opcode;
+
+  if (ctx->dict) keyboard_set_dict(kbd, ctx->dict);
+  kbd->swipe = gestures ? swipe_create() : 0;
+  if (ctx->adapt) keyboard_set_adapt(kbd, ctx->adapt);
+}
+
+
+static void head_destroy(Context *ctx, Head *head) {
+  wm_forget(ctx->wm, head->btn->win);
+  wm_forget(ctx->wm, head->kbd->win);
+  button_destroy(head->btn);
+  swipe_destroy(head->kbd->swipe);
+  keyboard_destroy(head->kbd);
+  layout_free(head->layout);
+  memset(head, 0, sizeof(Head));
+}
+
+
+/// Follows RandR changes so every output has its own keyboard and button.
+static void heads_update(Context *ctx) {
+  Outputs *o = ctx->outputs;
+
+  while (o->count < ctx->nheads)
+    head_destroy(ctx, &ctx->heads[--ctx->nheads]);
+
+  for (int i = 0; i < ctx->nheads; i++) {
+    keyboard_set_output(ctx->heads[i].kbd, &o->outputs[i]);
+    button_set_output(ctx->heads[i].btn, &o->outputs[i]);
+  }
+
+  while (ctx->nheads < o->count) {
+    head_button(ctx, ctx->nheads);
+    head_keyboard(ctx, ctx->nheads++);
+  }
+
+  // Windows must exist before the render display draws to them
+  if (render_threaded) XSync(ctx->dpy, false);
+
+  if (ctx->nheads <= ctx->active) ctx->active = 0;
+  ctx->output_changes++;
+  message("Outputs changed, %d keyboards\n", ctx->nheads);
+
+  wm_set_outputs(ctx->wm, o);
+  for (int i = 0; i < ctx->nheads; i++)
+    wm_keyboard(ctx->wm, ctx->heads[i].kbd);
+}
+
+
+static void ctl_command(CtlClient *client, char *cmd, char *arg, void *data) {
+  Context *ctx = (Context *)data;
+
+  // Showing on a given output makes it the one commands apply to
+  if (*arg && (!strcmp(cmd, "show") || !strcmp(cmd, "toggle"))) {
+    int i = atoi(arg);
+
+    if (i < 0 || ctx->nheads <= i) {
+      ctl_reply(client, "error no output %d", i);
+      return;
+    }
+
+    if (i != ctx->active) {
+      set_visible(ctx, ctx->heads[ctx->active].kbd, false);
+      ctx->active = i;
+    }
+  }
+
+  Keyboard *kbd = ctx->heads[ctx->active].kbd;
+
+  if (!strcmp(cmd, "show") || !strcmp(cmd, "hide") ||
+      !strcmp(cmd, "toggle")) {
+    bool show = strcmp(cmd, "toggle") ? !strcmp(cmd, "show") : !kbd->visible;
+
+    // Acknowledged once the window has actually mapped or unmapped
+    if (kbd->visible == show && kbd->onscreen == show)
+      ctl_reply(client, "ok %s", show ? "visible" : "hidden");
+
+    else {
+      client->waiting = true;
+      client->visible = show;
+      set_visible(ctx, kbd, show);
+      ctx->toggles++;
+    }
+
+  } else if (!strcmp(cmd, "state"))
+    ctl_reply(client, "state %s %s", kbd->onscreen ? "visible" : "hidden",
+              kbd->layout->layers[kbd->layer].name);
+
+  else if (!strcmp(cmd, "height")) ctl_reply(client, "height %d", kbd->h);
+  else if (!strcmp(cmd, "type"))
+    ctl_reply(client, "ok typed %u", keyboard_type(kbd, arg));
+
+  else if (!strcmp(cmd, "paste")) {
+    if (keyboard_paste(kbd, arg))
+      ctl_reply(client, "ok pasted %zu", strlen(arg));
+    else ctl_reply(client, "error clipboard unavailable");
+
+  } else if (!strcmp(cmd, "stats")) {
+    Dict *dict = ctx->dict;
+    Adapt *adapt = ctx->adapt;
+    Cache *cache = ctx->render->cache;
+    Atlas *atlas = ctx->render->atlas;
+    unsigned swipes = 0, shows = 0, raises = 0;
+    unsigned resize_requests = 0, resizes = 0, buffer_allocs = 0;
+    uint64_t swipe_max_ns = 0, show_max_ns = 0;
+
+    for (int i = 0; i < ctx->nheads; i++) {
+      Keyboard *k = ctx->heads[i].kbd;
+      Swipe *swipe = k->swipe;
+
+      if (swipe) {
+        swipes += swipe->decodes;
+        swipe_max_ns = MAX(swipe_max_ns, swipe->max_ns);
+      }
+
+      shows += k->shows;
+      show_max_ns = MAX(show_max_ns, k->show_max_ns);
+      raises += ctx->heads[i].btn->raises;
+      resize_requests += k->resize_requests;
+      resizes += k->resizes;
+      buffer_allocs += k->buffer_allocs;
+    }
+
+    ctl_reply(client, "stats events %u toggles %u reloads %u render_stalls %u "
+              "lookups %u lookup_max_us %.1f swipes %u swipe_max_us %.1f "
+              "touches %u corrections %u shows %u show_max_us %.1f "
+              "button_raises %u log_dropped %u outputs %d output_changes %u "
+              "displays %d rss_kb %ld cache_hits %u cache_misses %u "
+              "cache_kb %zu atlas_kb %zu atlas_uploads %u "
+              "resize_requests %u resizes %u buffer_allocs %u",
+              ctx->events, ctx->toggles, ctx->reloads, ctx->render->stalls,
+              dict ? dict->lookups : 0, dict ? dict->max_ns / 1e3 : 0.0,
+              swipes, swipe_max_ns / 1e3,
+              adapt ? adapt->touches : 0, adapt ? adapt->corrections : 0,
+              shows, show_max_ns / 1e3, raises, log_dropped(), ctx->nheads,
+              ctx->output_changes, ndisplays, get_rss_kb(),
+              cache ? cache->hits : 0, cache ? cache->misses : 0,
+              cache_bytes(cache) / 1024, atlas_bytes(atlas) / 1024,
+              atlas ? atlas->uploads : 0, resize_requests, resizes,
+              buffer_allocs);
+
+  } else ctl_reply(client, "error unknown command '%s'", cmd);
+}
+
+
+static void dispatch(XEvent *ev, void *data) {
+  Context *ctx = (Context *)data;
+  ctx->events++;
+
+  wm_event(ctx->wm, ev);
+  clip_event(ctx->clip, ev);
+  if (ctx->display) inject_event(ctx->display->inject, ev);
+  if (outputs_event(ctx->outputs, ev)) heads_update(ctx);
+
+  for (int i = 0; i < ctx->nheads; i++) {
+    Head *head = &ctx->heads[i];
+    Keyboard *kbd = head->kbd;
+    bool onscreen = kbd->onscreen;
+
+    // Generic events carry no window, each keyboard checks its own
+    if (ev->type == GenericEvent || ev->xany.window == kbd->win)
+      keyboard_event(kbd, ev);
+
+    else if (ev->xany.window == head->btn->win) {
+      button_event(head->btn, ev);
+
+      if (!ctx->button_shown && ev->type == Expose) {
+        ctx->button_shown = true;
+        startup_mark(ctx, "button visible");
+      }
+    }
+
+    if (i == ctx->active && kbd->onscreen != onscreen)
+      ctl_notify(ctx->ctl, !onscreen);
+  }
+
+  // Resize once the events already read are handled
+  if (!ctx->dpy || !QLength(ctx->dpy))
+    for (int i = 0; i < ctx->nheads; i++) keyboard_settle(ctx->heads[i].kbd);
+
+  render_flush(ctx->render);
+}
+
+
+/// Opens the display and everything shown on it.  Returns false if the
+/// display cannot be opened.
+static bool session_open(Context *ctx) {
+  ctx->display = display_open(ctx->name);
+  if (!ctx->display) {
+    log_msg(LOG_ERROR, "cannot open display %s",
+            ctx->name ? ctx->name : XDisplayName(0));
+    return false;
+  }
+
+  Display *dpy = ctx->dpy = ctx->display->dpy;
+  ctx->backend = &backend_x11;
+  startup_mark(ctx, "open display");
 
   // Create window manager
-  int child = 0;
+  ctx->wm = wm_create(dpy, overlay);
   if (kiosk_cmd) {
-    wm_init(dpy);
+    wm_manage(ctx->wm);
+
+    ctx->child = fork();
+    if (ctx->child == -1) die("Failed to execute child process");
+    if (!ctx->child) {
+      if (ctx->name) setenv("DISPLAY", ctx->name, 1);
+      execl("/bin/sh", "sh", "-c", kiosk_cmd, NULL);
+      _exit(127);
+    }
+    startup_mark(ctx, "window manager");
+  }
+
+  // Shared render context
+  Render *render = ctx->render = render_create(dpy, render_threaded);
+  if (!drw_fontset_create(render->ctx, &font, 1))
+    die("no fonts could be loaded");
+
+  if (raster_threads && !drw_ctx_rgb(render->ctx))
+    log_msg(LOG_WARN, "visual is not 24 bit RGB, drawing with Xft");
+  else if (raster_threads)
+    render->raster =
+      raster_create(render->ctx->fonts->xfont->pattern, raster_threads);
+
+  if (render->raster && glyph_atlas) {
+    render->atlas = atlas_create(render->ctx, render->raster);
+    if (!render->atlas)
+      log_msg(LOG_WARN, "XRender 0.10 or A8 pictures missing, no atlas");
+  }
 
-    child = fork();
-    if (child == -1) die("Failed to execute child process");
-    if (!child) execl("/bin/sh", "sh", "-c", kiosk_cmd, NULL);
+  // Cached images are only valid for the same font
+  char path[PATH_MAX];
+  if (render->raster && cache_path && !render->atlas) {
+    uint64_t key = hash_bytes(render->raster->font, font, strlen(font));
+    render->cache = cache_open(session_path(ctx, cache_path, path), key);
   }
+  startup_mark(ctx, "fonts");
 
-  Button *btn = button_create(dpy, button_x, button_y, 55, 35, font);
-  Keyboard *kbd = keyboard_create(dpy, keys, space, font, colors);
+  // One keyboard and button per output
+  ctx->outputs = outputs_create(dpy, DefaultScreen(dpy));
+  wm_set_outputs(ctx->wm, ctx->outputs);
+  startup_mark(ctx, "outputs");
+
+  ctx->nheads = ctx->outputs->count;
+  for (int i = 0; i < ctx->nheads; i++) head_button(ctx, i);
+  XFlush(dpy);
+  startup_mark(ctx, "button");
+
+  // Each display maps the same dictionary pages
+  ctx->dict = dict_path ? dict_load(dict_path) : 0;
+  if (gestures && !ctx->dict) die("gesture typing requires a dictionary");
+  ctx->adapt = adapt_path ?
+    adapt_load(session_path(ctx, adapt_path, path)) : 0;
+  ctx->clip = clip_create(dpy);
+
+  for (int i = 0; i < ctx->nheads; i++) head_keyboard(ctx, i);
+  startup_mark(ctx, "keyboard");
+
+  // Windows must exist before the render display draws to them
+  if (render_threaded) XSync(dpy, false);
+  render_start(render);
+  ctx->layout_fd = layout_path ? layout_watch(layout_path) : -1;
+
+  if (ctl_path)
+    ctx->ctl = ctl_create(session_path(ctx, ctl_path, path), ctl_command, ctx);
+
+  // Record through the first output's windows
+  Keyboard *kbd = ctx->heads[0].kbd;
+  if (record_path)
+    ctx->trace = trace_create(record_path, kbd->win, ctx->heads[0].btn->win,
+                              kbd->xi_opcode);
+
+  return true;
+}
 
-  button_set_callback(btn, button_callback, kbd);
 
-  // Event loop
+/// Events for the keyboard without a display.
+/// Timers run on the time of the events replayed.
+static void headless_dispatch(XEvent *ev, void *data) {
+  Context *ctx = (Context *)data;
+  Keyboard *kbd = ctx->heads[0].kbd;
+  ctx->events++;
+
+  if (ev->type == GenericEvent) {
+    XIDeviceEvent *e = (XIDeviceEvent *)ev->xcookie.data;
+    ((HeadlessLog *)kbd->backend_data)->clock = e->time * 1000000ull;
+    keyboard_timers(kbd);
+  }
+
+  if (ev->type == GenericEvent || ev->xany.window == kbd->win)
+    keyboard_event(kbd, ev);
+  keyboard_settle(kbd);
+}
+
+
+/// Replays through the first output's windows and reports.
+static void session_replay(Context *ctx) {
+  Head *head = &ctx->heads[0];
+  Keyboard *kbd = head->kbd;
+  Swipe *swipe = kbd->swipe;
+
+  if (ctx->dpy)
+    trace_replay(replay_path, ctx->dpy, kbd->win, head->btn->win,
+                 kbd->xi_opcode, !replay_fast, dispatch, ctx);
+  else trace_replay(replay_path, 0, kbd->win, 0, kbd->xi_opcode, false,
+                    headless_dispatch, ctx);
+  running = false;
+
+  if (kbd->shows)
+    fprintf(stdout, "Shows %u avg %.2fms max %.2fms\n", kbd->shows,
+            kbd->show_total_ns / 1e6 / kbd->shows, kbd->show_max_ns / 1e6);
+
+  // Compare runs with and without -t
+  if (kbd->keystrokes)
+    fprintf(stdout, "Keystrokes %u avg %.3fms max %.3fms\n", kbd->keystrokes,
+            kbd->keystroke_total_ns / 1e6 / kbd->keystrokes,
+            kbd->keystroke_max_ns / 1e6);
+
+  // Every touch must have ended and released what it pressed
+  if (kbd->touch_begins) {
+    unsigned held = 0;
+    for (int i = 0; i < KEYBOARD_MAX_TOUCHES; i++)
+      if (kbd->touches[i].active) held++;
+
+    fprintf(stdout, "Touches %u ended %u held %u lost %u\n",
+            kbd->touch_begins, kbd->touch_ends, held, kbd->touch_lost);
+
+    if (held || kbd->touch_lost) {
+      fprintf(stderr, "error, unbalanced touches\n");
+      ctx->ret = 1;
+    }
+  }
+
+  // Recorded gestures double as a decoder benchmark
+  if (swipe && swipe->decodes) {
+    fprintf(stdout, "Swipe decodes %u avg %.2fms max %.2fms\n",
+            swipe->decodes, swipe->total_ns / 1e6 / swipe->decodes,
+            swipe->max_ns / 1e6);
+
+    if (SWIPE_BUDGET_NS < swipe->max_ns) {
+      fprintf(stderr, "error, swipe decode exceeded %.0fms\n",
+              SWIPE_BUDGET_NS / 1e6);
+      ctx->ret = 1;
+    }
+  }
+}
+
+
+/// Replays the trace through the headless backend, which records what would
+/// have been drawn and sent, and checks every injected release had a press.
+static int headless_replay() {
+  Context *ctx = calloc(1, sizeof(Context));
+  ctx->backend = &backend_headless;
+  ctx->layout_fd = -1;
+
+  Outputs outputs = {.w = 1280, .h = 800, .count = 1};
+  outputs.outputs[0] = (Output){0, 0, outputs.w, outputs.h};
+  ctx->outputs = &outputs;
+
+  char path[PATH_MAX];
+  ctx->dict = dict_path ? dict_load(dict_path) : 0;
+  if (gestures && !ctx->dict) die("gesture typing requires a dictionary");
+  ctx->adapt = adapt_path ?
+    adapt_load(session_path(ctx, adapt_path, path)) : 0;
+
+  ctx->nheads = 1;
+  head_keyboard(ctx, 0);
+  Head *head = &ctx->heads[0];
+  Keyboard *kbd = head->kbd;
+
+  session_replay(ctx);
+
+  // Whatever is still held or latched must release cleanly
+  keyboard_reset(kbd);
+  HeadlessLog *log = (HeadlessLog *)kbd->backend_data;
+  unsigned *n = log->counts;
+
+  fprintf(stdout, "Headless fills %u texts %u presents %u selects %u\n",
+          n[HeadlessFill], n[HeadlessText], n[HeadlessPresent],
+          n[HeadlessSelect]);
+  fprintf(stdout, "Headless presses %u releases %u strings %u held %d\n",
+          n[HeadlessPress], n[HeadlessRelease], n[HeadlessString],
+          log->nheld);
+  fprintf(stdout, "Headless popups %u draws %u hides %u alternates %u\n",
+          kbd->popup.opens, n[HeadlessPopup], n[HeadlessPopupHide],
+          kbd->popup.commits);
+
+  if (log->nheld || log->unmatched) {
+    fprintf(stderr, "error, unbalanced key injection, %u unmatched\n",
+            log->unmatched);
+    ctx->ret = 1;
+  }
+
+  int ret = ctx->ret;
+  swipe_destroy(kbd->swipe);
+  keyboard_destroy(kbd);
+  layout_free(head->layout);
+  dict_free(ctx->dict);
+  if (ctx->adapt) {
+    adapt_save(ctx->adapt, true);
+    adapt_free(ctx->adapt);
+  }
+  free(ctx);
+
+  return ret;
+}
+
+
+/// Compares a full color image per layer and shift state, as -K keeps, with
+/// one mask per distinct label, as the glyph atlas keeps.  Pressed keys and
+/// other color schemes add images but no masks.
+static void memory_report(Keyboard *kbd, FcPattern *pattern, RasterTile *tiles,
+                          int max) {
+  Raster *raster = raster_create(pattern, 1);
+  if (!raster) return;
+
+  int nlayers = kbd->layout->nlayers;
+  char (*labels)[RASTER_LABEL_MAX] = calloc(2 * nlayers * max, sizeof(*labels));
+  int nlabels = 0, states = 0;
+  size_t masks = 0;
+
+  for (int shift = 0; shift < 2; shift++)
+    for (int i = 0; i < nlayers; i++, states++) {
+      kbd->layer = i;
+      kbd->shift = shift;
+      int n = keyboard_tiles(kbd, tiles, max);
+
+      for (int j = 0; j < n; j++) {
+        const char *label = tiles[j].label;
+        bool seen = !*label;
+        for (int k = 0; k < nlabels && !seen; k++)
+          seen = !strcmp(labels[k], label);
+        if (seen) continue;
+
+        int w, h;
+        free(raster_label(raster, label, &w, &h));
+        masks += (size_t)w * h;
+        strcpy(labels[nlabels++], label);
+      }
+    }
+
+  size_t image = (size_t)kbd->w * kbd->h * sizeof(uint32_t);
+  fprintf(stdout, "Layer images %zu kB each, %zu kB for %d states\n",
+          image / 1024, image * states / 1024, states);
+  fprintf(stdout, "Glyph atlas %zu kB for %d labels in any scheme\n",
+          masks / 1024, nlabels);
+
+  kbd->shift = false;
+  free(labels);
+  raster_destroy(raster);
+}
+
+
+/// Draws every layer of a keyboard ``width`` wide in to client memory with
+/// 1, 2, 4 and so on up to one thread per core, as when a cache is built at
+/// startup or after a resize, and reports the best of several runs.
+static int raster_benchmark(int width) {
+  FcPattern *pattern = raster_match(font);
+  if (!pattern) die("cannot match font '%s'", font);
+
+  Layout *layout = layout_path ? layout_load(layout_path) :
+    layout_create(layers, colors);
+  if (!layout) die("failed to load layout");
+
+  Output out = {0, 0, width, 2160};
+  Keyboard *kbd =
+    keyboard_create(0, 0, &backend_headless, layout, space, &out);
+
+  int max = 0;
+  for (int i = 0; i < layout->nlayers; i++) {
+    kbd->layer = i;
+    max = MAX(max, keyboard_tiles(kbd, 0, 0));
+  }
+  RasterTile *tiles = malloc(max * sizeof(RasterTile));
+  uint32_t bg = drw_clr_rgb(&kbd->scheme[SchemeBG][ColBg]);
+
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  double base = 0;
+
+  fprintf(stdout, "%d layers %dx%d, %d cores\n", layout->nlayers, kbd->w,
+          kbd->h, cores);
+  fprintf(stdout, "%8s %10s %8s\n", "Threads", "Build ms", "Speedup");
+
+  for (int threads = 1;; threads = MIN(threads * 2, cores)) {
+    Raster *raster = raster_create(pattern, threads);
+    if (!raster) die("cannot rasterize with font '%s'", font);
+
+    uint64_t best = 0;
+    for (int run = 0; run < 5; run++) {
+      uint64_t start = get_time_ns();
+
+      for (int i = 0; i < layout->nlayers; i++) {
+        kbd->layer = i;
+        int n = keyboard_tiles(kbd, tiles, max);
+        raster_draw(raster, kbd->w, kbd->h, bg, tiles, n);
+      }
+
+      uint64_t t = get_time_ns() - start;
+      if (!run || t < best) best = t;
+    }
+
+    raster_destroy(raster);
+
+    if (threads == 1) base = best;
+    fprintf(stdout, "%8d %10.2f %7.2fx\n", threads, best / 1e6,
+            base / best);
+
+    if (threads == cores) break;
+  }
+
+  memory_report(kbd, pattern, tiles, max);
+
+  free(tiles);
+  kbd->layer = 0;
+  keyboard_destroy(kbd);
+  layout_free(layout);
+  FcPatternDestroy(pattern);
+
+  return 0;
+}
+
+
+static void session_loop(Context *ctx) {
+  Display *dpy = ctx->dpy;
+  struct Inject *inject = ctx->display->inject;
+
   while (running) {
     // Handle signal
-    if (!button_open &&
-        ((!kbd->visible && signal_open) || (kbd->visible && !signal_open)))
-      toggle(kbd);
+    int sig = atomic_exchange(&ctx->signal, 0);
+    if (sig) ctx->signal_open = sig == SIGUSR1;
 
-    // Wait for input
+    Keyboard *kbd = ctx->heads[ctx->active].kbd;
+    if (!ctx->button_open && kbd->visible != ctx->signal_open) {
+      kbd->show_start = signal_time; // Time shows from the signal
+      message("%s signaled\n", ctx->signal_open ? "Show" : "Hide");
+      toggle(ctx, kbd);
+    }
+
+    // Wait for input, the next keyboard timer or queued keys
     struct timeval tv;
     tv.tv_sec = 0;
     tv.tv_usec = 100000; // 100ms
 
+    uint64_t now = get_time_ns();
+    for (int i = 0; i <= ctx->nheads; i++) {
+      uint64_t deadline = i < ctx->nheads ?
+        keyboard_deadline(ctx->heads[i].kbd) : inject_deadline(inject);
+      if (!deadline) continue;
+
+      uint64_t us = deadline <= now ? 0 : (deadline - now + 999) / 1000;
+      if (us < (uint64_t)tv.tv_usec) tv.tv_usec = us;
+    }
+
     int xfd = ConnectionNumber(dpy);
+    int layout_fd = ctx->layout_fd;
     fd_set fds;
     FD_ZERO(&fds);
     FD_SET(xfd, &fds);
-    int r = select(xfd + 1, &fds, 0, 0, &tv);
+    if (layout_fd != -1) FD_SET(layout_fd, &fds);
+    int max = ctl_fds(ctx->ctl, &fds, MAX(xfd, layout_fd));
+    int r = select(max + 1, &fds, 0, 0, &tv);
 
     if (r == -1 && errno != EINTR) break;
 
+    // Save newly drawn layers once idle, the render thread must be done
+    // with the entries while they are copied for the helper thread
+    Cache *cache = ctx->render->cache;
+    if (!r && cache && atomic_load(&cache->dirty)) {
+      render_lock(ctx->render);
+      cache_save(cache);
+      render_unlock(ctx->render);
+    }
+
+    // Save the touch model between touches, never on the press path
+    if (!r && ctx->adapt) adapt_save(ctx->adapt, false);
+    if (0 < r) ctl_process(ctx->ctl, &fds);
+
+    // Hot reload layout
+    if (0 < r && layout_fd != -1 && FD_ISSET(layout_fd, &fds) &&
+        layout_changed(layout_fd, layout_path)) {
+      int reloaded = 0;
+
+      // Each output lays out its own copy
+      for (int i = 0; i < ctx->nheads; i++) {
+        Head *head = &ctx->heads[i];
+        Layout *next = layout_load(layout_path);
+        if (!next) break;
+
+        keyboard_set_layout(head->kbd, next);
+        layout_free(head->layout);
+        head->layout = next;
+        if (head->kbd->visible) wm_keyboard(ctx->wm, head->kbd);
+        reloaded++;
+      }
+
+      if (reloaded) {
+        message("Reloaded layout %s\n", layout_path);
+        ctx->reloads++;
+      }
+    }
+
     while (XPending(dpy)) {
       XEvent ev;
       XNextEvent(dpy, &ev);
+      if (ev.type == GenericEvent) XGetEventData(dpy, &ev.xcookie);
 
-      wm_event(&ev);
-      if (ev.xany.window == kbd->win) keyboard_event(kbd, &ev);
-      if (ev.xany.window == btn->win) button_event(btn, &ev);
+      if (ctx->trace) trace_record(ctx->trace, &ev);
+      dispatch(&ev, ctx);
+      XFreeEventData(dpy, &ev.xcookie);
     }
+
+    for (int i = 0; i < ctx->nheads; i++) keyboard_timers(ctx->heads[i].kbd);
+    inject_timers(inject);
+
+    if (render_recover(ctx->render))
+      for (int i = 0; i < ctx->nheads; i++) keyboard_redraw(ctx->heads[i].kbd);
+
+    for (int i = 0; i < ctx->nheads; i++)
+      if (ctx->heads[i].kbd->visible) keyboard_prerender(ctx->heads[i].kbd);
+    render_flush(ctx->render);
   }
+}
 
-  // Cleanup
-  button_destroy(btn);
-  keyboard_destroy(kbd);
-  XCloseDisplay(dpy);
+
+static void session_close(Context *ctx) {
+  trace_destroy(ctx->trace);
+  ctl_destroy(ctx->ctl);
+  for (int i = 0; i < ctx->nheads; i++) head_destroy(ctx, &ctx->heads[i]);
+  clip_destroy(ctx->clip);
+  dict_free(ctx->dict);
+  outputs_destroy(ctx->outputs);
+
+  Adapt *adapt = ctx->adapt;
+  if (adapt) {
+    if (adapt->touches)
+      message("Touch corrections %u of %u\n", adapt->corrections,
+              adapt->touches);
+    adapt_save(adapt, true);
+    adapt_free(adapt);
+  }
+
+  Render *render = ctx->render;
+  if (render->stalls)
+    message("Render queue full, %u redraws dropped\n", render->stalls);
+  render_destroy(render);
+  if (ctx->layout_fd != -1) close(ctx->layout_fd);
+  wm_destroy(ctx->wm);
+  display_close(ctx->display);
 
   // Kill your children
-  if (child) {
-    kill(child, SIGTERM);
-    waitpid(child, 0, 0);
+  if (ctx->child) {
+    kill(ctx->child, SIGTERM);
+    waitpid(ctx->child, 0, 0);
+  }
+}
+
+
+static void *session_run(void *arg) {
+  Context *ctx = (Context *)arg;
+  bool opened = session_open(ctx);
+  sem_post(&session_started);
+
+  if (!opened) {
+    ctx->ret = 1;
+    return 0;
   }
 
+  if (replay_path) session_replay(ctx);
+  session_loop(ctx);
+  session_close(ctx);
+
   return 0;
 }
+
+
+int main(int argc, char *argv[]) {
+  signal(SIGTERM, signaled);
+  signal(SIGINT,  signaled);
+  signal(SIGUSR1, kbd_signal);
+  signal(SIGUSR2, kbd_signal);
+
+  parse_args(argc, argv);
+  log_init(verbose ? LOG_DEBUG : LOG_INFO);
+  if ((cache_path || glyph_atlas) && !raster_threads)
+    raster_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (1 < ndisplays && (record_path || replay_path))
+    die("traces are for a single display");
+
+  if (raster_bench_width) {
+    int ret = raster_benchmark(raster_bench_width);
+    log_shutdown();
+    return ret;
+  }
+
+  if (replay_headless) {
+    if (!replay_path) die("headless replay needs a trace");
+    int ret = headless_replay();
+    log_shutdown();
+    return ret;
+  }
+
+  // Check locale support
+  if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
+    fprintf(stderr, "warning: no locale support");
+
+  // Init
+  if ((render_threaded || 1 < ndisplays) && !XInitThreads())
+    die("no X thread support");
+  if (!ndisplays) displays[ndisplays++] = 0;
+
+  sessions = calloc(ndisplays, sizeof(Context));
+  sem_init(&session_started, 0, 0);
+
+  for (int i = 0; i < ndisplays; i++) {
+    Context *ctx = &sessions[i];
+    ctx->name = displays[i];
+    ctx->index = i;
+    ctx->layout_fd = -1;
+    startup_mark(ctx, "start");
+  }
+  nsessions = ndisplays;
+
+  if (ndisplays == 1) {
+    session_run(&sessions[0]);
+    if (sessions[0].ret && !sessions[0].dpy) die("cannot open display");
+
+  } else {
+    // Started one at a time so each reports what it added
+    long rss = get_rss_kb();
+
+    for (int i = 0; i < ndisplays; i++) {
+      Context *ctx = &sessions[i];
+      if (pthread_create(&ctx->thread, 0, session_run, ctx))
+        die("failed to start display thread");
+      sem_wait(&session_started);
+
+      long now = get_rss_kb();
+      if (ctx->dpy)
+        log_msg(LOG_INFO, "Serving %s, RSS %ld kB, +%ld kB", ctx->name, now,
+                now - rss);
+      rss = now;
+    }
+
+    for (int i = 0; i < ndisplays; i++) pthread_join(sessions[i].thread, 0);
+  }
+
+  int ret = 0;
+  for (int i = 0; i < ndisplays; i++)
+    if (sessions[i].ret) ret = sessions[i].ret;
+
+  nsessions = 0;
+  free(sessions);
+  sem_destroy(&session_started);
+  log_shutdown();
+
+  return ret;
+}
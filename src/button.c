@@ -13,14 +13,14 @@
 #include "util.h"
 
 #include <X11/Xatom.h>
-#include <X11/Xcursor/Xcursor.h>
 
 
-void button_draw(Button *btn) {
+static void exec_draw(void *data, const RenderOp *op) {
+  Button *btn = (Button *)data;
   drw_rect(btn->drw, 0, 0, 100, 100, 1, 1);
 
   const char *label = "⌨";
-  int h = btn->drw->fonts[0].xfont->height * 2;
+  int h = btn->drw->ctx->fonts[0].xfont->height * 2;
   int y = (btn->h - h) / 2;
   int w = drw_fontset_getwidth(btn->drw, label);
   int x = (btn->w - w) / 2;
@@ -30,11 +30,25 @@ void button_draw(Button *btn) {
 }
 
 
+void button_draw(Button *btn) {
+  RenderOp op = {exec_draw, btn};
+  render_push(btn->render, &op);
+}
+
+
 void button_event(Button *btn, XEvent *e) {
   switch (e->type) {
   case VisibilityNotify: {
-    if (e->xvisibility.state == VisibilityFullyObscured)
-      XRaiseWindow(btn->drw->dpy, btn->win);
+    // Without our window manager, raise at a limited rate so a client that
+    // also wants the top cannot start a raise storm
+    uint64_t now = get_time_ns();
+
+    if (e->xvisibility.state == VisibilityFullyObscured && !btn->managed &&
+        BUTTON_RAISE_NS <= now - btn->raised) {
+      XRaiseWindow(btn->dpy, btn->win);
+      btn->raised = now;
+      btn->raises++;
+    }
     break;
   }
 
@@ -63,25 +77,37 @@ void button_set_callback(Button *btn, button_cb cb, void *data) {
 }
 
 
-Button *button_create(Display *dpy, float x, float y, int w, int h,
-                      const char *font) {
-  Button *btn = (Button *)calloc(1, sizeof(Button));
+static int button_x(Button *btn, const Output *out) {
+  return out->x + btn->fx * (out->w - btn->w);
+}
+
 
-  int screen = DefaultScreen(dpy);
-  Window root = RootWindow(dpy, screen);
+static int button_y(Button *btn, const Output *out) {
+  return out->y + btn->fy * (out->h - btn->h);
+}
+
+
+void button_set_output(Button *btn, const Output *out) {
+  XMoveWindow(btn->dpy, btn->win, button_x(btn, out), button_y(btn, out));
+}
+
+
+/// ``x`` and ``y`` place the button within ``out`` and are between 0 and 1.
+Button *button_create(Display *dpy, Render *render, const Output *out,
+                      float x, float y, int w, int h) {
+  DrwCtx *ctx = render->ctx;
+  Button *btn = (Button *)calloc(1, sizeof(Button));
+  btn->dpy = dpy;
+  btn->render = render;
 
   // Dimensions
-  Dim dim = get_display_dims(dpy, screen);
-  x *= dim.width - w;
-  y *= dim.height - h;
+  btn->fx = x;
+  btn->fy = y;
   btn->w = w;
   btn->h = h;
 
   // Create drawable
-  Drw *drw = btn->drw = drw_create(dpy, screen, root, w, h);
-
-  // Setup font
-  if (!drw_fontset_create(drw, &font, 1)) die("no fonts could be loaded");
+  Drw *drw = btn->drw = drw_create(ctx, w, h);
 
   // Init color scheme
   const char *colors[] = {"#bbbbbb", "#132a33"};
@@ -92,8 +118,9 @@ Button *button_create(Display *dpy, float x, float y, int w, int h,
   wa.override_redirect = true;
 
   btn->win = XCreateWindow
-    (dpy, root, x, y, w, h, 0, CopyFromParent, CopyFromParent,
-     CopyFromParent, CWOverrideRedirect | CWBorderPixel | CWBackingPixel, &wa);
+    (dpy, ctx->root, button_x(btn, out), button_y(btn, out), w, h, 0,
+     CopyFromParent, CopyFromParent, CopyFromParent,
+     CWOverrideRedirect | CWBorderPixel | CWBackingPixel, &wa);
 
   // Enable window events
   XSelectInput(dpy, btn->win, ButtonReleaseMask | ButtonPressMask |
@@ -119,14 +146,15 @@ Button *button_create(Display *dpy, float x, float y, int w, int h,
   XFree(str.value);
 
   // Set window type
-  Atom atom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", false);
-  Atom type = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_UTILITY", false);
-  XChangeProperty(dpy, btn->win, atom, XA_ATOM, 32, PropModeReplace,
-                  (unsigned char *)&type, 1);
+  Atom *atoms = display_ctx(dpy)->atoms;
+  XChangeProperty(dpy, btn->win, atoms[NetWMWindowType], XA_ATOM, 32,
+                  PropModeReplace,
+                  (unsigned char *)&atoms[NetWMWindowTypeUtility], 1);
 
   // Set cursor
-  Cursor c = XcursorLibraryLoadCursor(dpy, "hand2");
-  XDefineCursor(dpy, btn->win, c);
+  Cursor cursor = drw_ctx_cursor(ctx, "hand2");
+  if (ctx->dpy != dpy) XSync(ctx->dpy, false); // Created on the render display
+  XDefineCursor(dpy, btn->win, cursor);
 
   // Raise window to top of stack
   XMapRaised(dpy, btn->win);
@@ -136,8 +164,10 @@ Button *button_create(Display *dpy, float x, float y, int w, int h,
 
 
 void button_destroy(Button *btn) {
+  render_lock(btn->render);
   drw_sync(btn->drw);
   drw_free(btn->drw);
+  render_unlock(btn->render);
 
   free(btn->scheme);
   free(btn);
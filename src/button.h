@@ -12,27 +12,41 @@
 #pragma once
 
 #include "drw.h"
+#include "render.h"
+#include "output.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+
+
+#define BUTTON_RAISE_NS 500000000 // Least time between raises
 
 typedef void (*button_cb)();
 
 typedef struct {
+  Display *dpy;
   Window win;
-  Drw *drw;
+  Render *render;
+  Drw *drw; // Only used through the render queue
   Clr *scheme;
 
   button_cb cb;
   void *cb_data;
 
+  float fx, fy; // Position within the output, between 0 and 1
   int w;
   int h;
   bool mouse_in;
+
+  bool managed; // Stacking is kept by the window manager
+  uint64_t raised; // When the button last raised itself
+  unsigned raises;
 } Button;
 
 
-Button *button_create(Display *dpy, float x, float y, int w, int h,
-                      const char *font);
+Button *button_create(Display *dpy, Render *render, const Output *out,
+                      float x, float y, int w, int h);
+void button_set_output(Button *btn, const Output *out);
 void button_destroy(Button *btn);
 void button_set_callback(Button *btn, button_cb cb, void *data);
 void button_event(Button *btn, XEvent *e);
@@ -0,0 +1,267 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "cache.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define CACHE_MAGIC 0x43424b42 // "BKBC"
+#define CACHE_VERSION 1
+
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uint32_t count;
+  uint32_t reserved;
+} CacheHeader;
+
+typedef struct {
+  uint64_t key;
+  uint32_t w, h;
+  uint64_t offset; // Of the pixels from the start of the file
+} CacheIndex;
+
+
+static size_t image_size(int w, int h) {
+  return (size_t)w * h * sizeof(uint32_t);
+}
+
+
+/// Maps the entries of an existing file if it was written under ``key``.
+static void cache_map(Cache *c) {
+  int fd = open(c->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return;
+
+  struct stat st;
+  void *image = MAP_FAILED;
+  if (!fstat(fd, &st) && sizeof(CacheHeader) <= st.st_size)
+    image = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (image == MAP_FAILED) return;
+
+  const CacheHeader *hdr = image;
+  size_t size = st.st_size;
+  const CacheIndex *index = (const CacheIndex *)(hdr + 1);
+
+  if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+      hdr->key != c->key || CACHE_MAX_ENTRIES < hdr->count ||
+      size < sizeof(CacheHeader) + hdr->count * sizeof(CacheIndex)) {
+    message("Render cache '%s' is stale\n", c->path);
+    munmap(image, size);
+    return;
+  }
+
+  for (unsigned i = 0; i < hdr->count; i++) {
+    const CacheIndex *ix = &index[i];
+    size_t bytes = image_size(ix->w, ix->h);
+
+    if (size < ix->offset || size - ix->offset < bytes || ix->offset % 4) {
+      message("Render cache '%s' is truncated\n", c->path);
+      c->count = 0;
+      munmap(image, size);
+      return;
+    }
+
+    CacheEntry *e = &c->entries[c->count++];
+    e->key = ix->key;
+    e->w = ix->w;
+    e->h = ix->h;
+    e->pixels = (const uint32_t *)((char *)image + ix->offset);
+  }
+
+  c->image = image;
+  c->size = size;
+}
+
+
+/// Writes ``entries`` to a temporary file and renames it over the mapped
+/// file, which stays intact.
+static bool cache_write(const char *path, uint64_t key,
+                        const CacheEntry *entries, int count) {
+  CacheHeader hdr = {CACHE_MAGIC, CACHE_VERSION, key, count};
+  CacheIndex index[CACHE_MAX_ENTRIES];
+  uint64_t offset = sizeof(hdr) + count * sizeof(CacheIndex);
+
+  for (int i = 0; i < count; i++) {
+    const CacheEntry *e = &entries[i];
+    CacheIndex ix = {e->key, e->w, e->h, offset};
+    index[i] = ix;
+    offset += image_size(e->w, e->h);
+  }
+
+  char *tmp = malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+
+  FILE *f = fopen(tmp, "wb");
+  bool ok = f && fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+    (!count || fwrite(index, sizeof(CacheIndex), count, f) == count);
+
+  for (int i = 0; ok && i < count; i++) {
+    const CacheEntry *e = &entries[i];
+    ok = fwrite(e->pixels, image_size(e->w, e->h), 1, f) == 1;
+  }
+
+  if (f && fclose(f)) ok = false;
+  if (ok && rename(tmp, path)) ok = false;
+
+  if (!ok) {
+    message("Failed to save render cache '%s'\n", path);
+    unlink(tmp);
+
+  } else message("Saved render cache '%s', %d entries\n", path, count);
+
+  free(tmp);
+
+  return ok;
+}
+
+
+static void *cache_thread(void *arg) {
+  Cache *c = arg;
+  cache_write(c->path, c->key, c->saved, c->nsaved);
+  atomic_store(&c->saving, false);
+  return 0;
+}
+
+
+/// Waits for the last write and frees the images it kept alive.
+static void cache_join(Cache *c) {
+  if (!c->started) return;
+
+  pthread_join(c->thread, 0);
+  c->started = false;
+
+  for (int i = 0; i < c->nretired; i++) free((void *)c->retired[i]);
+  c->nretired = 0;
+}
+
+
+/// Frees replaced pixels unless the last write may still be reading them.
+static void cache_release(Cache *c, const uint32_t *pixels) {
+  for (int i = 0; c->started && i < c->nsaved; i++)
+    if (c->saved[i].pixels == pixels) {
+      c->retired[c->nretired++] = pixels;
+      return;
+    }
+
+  free((void *)pixels);
+}
+
+
+/// Entries written under another ``key`` are dropped when next saved.
+Cache *cache_open(const char *path, uint64_t key) {
+  Cache *c = calloc(1, sizeof(Cache));
+  c->path = strdup(path);
+  c->key = key;
+  cache_map(c);
+
+  message("Render cache '%s' has %d entries\n", path, c->count);
+
+  return c;
+}
+
+
+void cache_close(Cache *c) {
+  if (!c) return;
+
+  cache_join(c);
+  if (atomic_exchange(&c->dirty, false))
+    cache_write(c->path, c->key, c->entries, c->count);
+
+  for (int i = 0; i < c->count; i++)
+    if (c->entries[i].owned) free((void *)c->entries[i].pixels);
+
+  if (c->image) munmap(c->image, c->size);
+  free(c->path);
+  free(c);
+}
+
+
+const uint32_t *cache_find(Cache *c, uint64_t key, int w, int h) {
+  for (int i = 0; i < c->count; i++) {
+    CacheEntry *e = &c->entries[i];
+
+    if (e->key == key && e->w == w && e->h == h) {
+      e->used = true;
+      c->hits++;
+      return e->pixels;
+    }
+  }
+
+  c->misses++;
+  return 0;
+}
+
+
+/// Copies ``pixels``.  When full an entry not used this run is replaced.
+void cache_add(Cache *c, uint64_t key, int w, int h, const uint32_t *pixels) {
+  CacheEntry *e = 0;
+
+  if (c->count < CACHE_MAX_ENTRIES) e = &c->entries[c->count++];
+  else {
+    for (int i = 0; i < c->count && !e; i++)
+      if (!c->entries[i].used) e = &c->entries[i];
+
+    if (!e) e = &c->entries[0];
+    if (e->owned) cache_release(c, e->pixels);
+  }
+
+  size_t bytes = image_size(w, h);
+  uint32_t *copy = malloc(bytes);
+  memcpy(copy, pixels, bytes);
+
+  e->key = key;
+  e->w = w;
+  e->h = h;
+  e->pixels = copy;
+  e->owned = true;
+  e->used = true;
+
+  atomic_store(&c->dirty, true);
+}
+
+
+/// Starts writing every entry on a helper thread if any were added since the
+/// last write and it is done.  Must not run while entries are being found or
+/// added, the write itself needs no lock.
+void cache_save(Cache *c) {
+  if (!atomic_load(&c->dirty) || atomic_load(&c->saving)) return;
+
+  cache_join(c);
+  atomic_store(&c->dirty, false);
+  c->nsaved = c->count;
+  memcpy(c->saved, c->entries, c->count * sizeof(CacheEntry));
+
+  atomic_store(&c->saving, true);
+  if (pthread_create(&c->thread, 0, cache_thread, c))
+    die("failed to start cache thread");
+  c->started = true;
+}
+
+
+/// Memory held by the images, mapped or owned.
+size_t cache_bytes(Cache *c) {
+  size_t bytes = 0;
+  for (int i = 0; c && i < c->count; i++)
+    bytes += image_size(c->entries[i].w, c->entries[i].h);
+  return bytes;
+}
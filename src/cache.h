@@ -0,0 +1,61 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+
+#define CACHE_MAX_ENTRIES 32
+
+typedef struct {
+  uint64_t key; // Of everything that went in to the image
+  int w, h;
+  const uint32_t *pixels; // Mapped from the file or owned
+  bool owned;
+  bool used; // This run
+} CacheEntry;
+
+/// Drawn layer images kept in a file and mapped on the next start
+typedef struct {
+  char *path;
+  uint64_t key; // Of the font, entries under another key are stale
+  void *image;
+  size_t size;
+
+  int count;
+  CacheEntry entries[CACHE_MAX_ENTRIES];
+  atomic_bool dirty;
+
+  // Written by a helper thread from a snapshot of the entries
+  pthread_t thread;
+  bool started; // Not yet joined
+  atomic_bool saving;
+  int nsaved;
+  CacheEntry saved[CACHE_MAX_ENTRIES];
+  int nretired; // Replaced while being written, freed once joined
+  const uint32_t *retired[CACHE_MAX_ENTRIES];
+
+  unsigned hits;
+  unsigned misses;
+} Cache;
+
+
+Cache *cache_open(const char *path, uint64_t key);
+void cache_close(Cache *c);
+const uint32_t *cache_find(Cache *c, uint64_t key, int w, int h);
+void cache_add(Cache *c, uint64_t key, int w, int h, const uint32_t *pixels);
+void cache_save(Cache *c);
+size_t cache_bytes(Cache *c);
@@ -0,0 +1,310 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "clip.h"
+#include "util.h"
+
+#include <X11/Xatom.h>
+#include <X11/extensions/XInput2.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define CLIP_INCR_CHUNK 65536
+
+
+// The error handler is process wide, so requestors are trapped one at a time
+static pthread_mutex_t clip_trap_lock = PTHREAD_MUTEX_INITIALIZER;
+static XErrorHandler clip_handler;
+static Display *clip_trap_dpy;
+static Window clip_trap_win;
+static bool clip_trapped;
+
+
+/// Errors about the trapped requestor are expected, it may be gone.  Others
+/// go to the handler that was installed.
+static int on_clip_error(Display *dpy, XErrorEvent *e) {
+  if (dpy == clip_trap_dpy && e->resourceid == clip_trap_win) {
+    clip_trapped = true;
+    return 0;
+  }
+
+  return clip_handler ? clip_handler(dpy, e) : 0;
+}
+
+
+static void clip_trap(Clip *clip, Window requestor) {
+  pthread_mutex_lock(&clip_trap_lock);
+  clip_trap_dpy = clip->dpy;
+  clip_trap_win = requestor;
+  clip_trapped = false;
+  clip_handler = XSetErrorHandler(on_clip_error);
+}
+
+
+/// Returns false if a request on the requestor failed.
+static bool clip_untrap(Clip *clip) {
+  XSync(clip->dpy, false);
+  XSetErrorHandler(clip_handler);
+  bool ok = !clip_trapped;
+  Window requestor = clip_trap_win;
+  clip_trap_dpy = 0;
+  pthread_mutex_unlock(&clip_trap_lock);
+
+  if (!ok) message("Clipboard requestor 0x%lx is gone\n", requestor);
+  return ok;
+}
+
+
+Clip *clip_create(Display *dpy) {
+  Clip *clip = calloc(1, sizeof(Clip));
+  clip->dpy = dpy;
+  clip->atoms = display_ctx(dpy)->atoms;
+
+  // An unmapped window to own the selection and get timestamps with
+  clip->win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), -10, -10, 1, 1,
+                                  0, 0, 0);
+  XSelectInput(dpy, clip->win, PropertyChangeMask);
+
+  size_t max = XMaxRequestSize(dpy) * 4 - 256;
+  clip->chunk = max < CLIP_INCR_CHUNK ? max : CLIP_INCR_CHUNK;
+
+  return clip;
+}
+
+
+void clip_destroy(Clip *clip) {
+  if (!clip) return;
+
+  if (clip->owned) XSetSelectionOwner(clip->dpy, clip->atoms[Clipboard], None,
+                                      CurrentTime);
+  XDestroyWindow(clip->dpy, clip->win);
+  free(clip->text);
+  free(clip);
+}
+
+
+static ClipTransfer *clip_find(Clip *clip, Window requestor, Atom property) {
+  for (int i = 0; i < CLIP_MAX_TRANSFERS; i++) {
+    ClipTransfer *t = &clip->transfers[i];
+    if (t->requestor == requestor && t->property == property) return t;
+  }
+
+  return 0;
+}
+
+
+/// Another transfer to the same requestor, which keeps its event mask.
+static ClipTransfer *clip_sibling(Clip *clip, ClipTransfer *t) {
+  for (int i = 0; i < CLIP_MAX_TRANSFERS; i++) {
+    ClipTransfer *o = &clip->transfers[i];
+    if (o != t && o->requestor && o->requestor == t->requestor) return o;
+  }
+
+  return 0;
+}
+
+
+/// Must be called with the requestor trapped.
+static void clip_end(Clip *clip, ClipTransfer *t) {
+  if (t->requestor && !clip_sibling(clip, t))
+    XSelectInput(clip->dpy, t->requestor, t->mask);
+
+  t->requestor = None;
+  t->property = None;
+}
+
+
+/// Gets the current server time by touching a property on our window.  Only
+/// needed before any event has brought a timestamp.
+static Time clip_time(Clip *clip) {
+  XEvent e;
+
+  XChangeProperty(clip->dpy, clip->win, clip->atoms[Clipboard], XA_STRING, 8,
+                  PropModeAppend, 0, 0);
+  XWindowEvent(clip->dpy, clip->win, PropertyChangeMask, &e);
+
+  return e.xproperty.time;
+}
+
+
+/// Takes the CLIPBOARD selection with ``text``, as of the latest event seen,
+/// normally the touch that asked for it.  Requests are answered from
+/// clip_event().
+bool clip_set(Clip *clip, const char *text) {
+  free(clip->text);
+  clip->len = strlen(text);
+  clip->text = strdup(text);
+
+  // Transfers of the old text can not be completed
+  for (int i = 0; i < CLIP_MAX_TRANSFERS; i++) {
+    ClipTransfer *t = &clip->transfers[i];
+    if (!t->requestor) continue;
+
+    clip_trap(clip, t->requestor);
+    clip_end(clip, t);
+    clip_untrap(clip);
+  }
+
+  Display *dpy = clip->dpy;
+  Time time = clip->time ? clip->time : clip_time(clip);
+  XSetSelectionOwner(dpy, clip->atoms[Clipboard], clip->win, time);
+  clip->owned = XGetSelectionOwner(dpy, clip->atoms[Clipboard]) == clip->win;
+
+  if (!clip->owned) message("Failed to take the clipboard\n");
+  return clip->owned;
+}
+
+
+static bool clip_start_incr(Clip *clip, XSelectionRequestEvent *req,
+                            Atom property) {
+  ClipTransfer *t = clip_find(clip, None, None);
+  if (!t) return false;
+
+  t->requestor = req->requestor;
+  t->property = property;
+  t->target = req->target;
+  t->offset = 0;
+
+  // Keep what this connection already selected on the requestor
+  ClipTransfer *o = clip_sibling(clip, t);
+  XWindowAttributes attrs;
+  if (o) t->mask = o->mask;
+  else if (XGetWindowAttributes(clip->dpy, req->requestor, &attrs))
+    t->mask = attrs.your_event_mask;
+  else {
+    t->requestor = None;
+    t->property = None;
+    return false;
+  }
+
+  // Deleting the INCR property asks for the first chunk
+  long size = clip->len;
+  XSelectInput(clip->dpy, req->requestor,
+               t->mask | PropertyChangeMask | StructureNotifyMask);
+  XChangeProperty(clip->dpy, req->requestor, property, clip->atoms[Incr], 32,
+                  PropModeReplace, (unsigned char *)&size, 1);
+
+  return true;
+}
+
+
+static void clip_request(Clip *clip, XSelectionRequestEvent *req) {
+  Display *dpy = clip->dpy;
+  Atom target = req->target;
+  Atom property = req->property ? req->property : target; // Obsolete clients
+  bool ok = true;
+
+  clip_trap(clip, req->requestor);
+
+  if (target == clip->atoms[Targets]) {
+    Atom targets[] = {clip->atoms[Targets], clip->atoms[Utf8String], XA_STRING};
+    XChangeProperty(dpy, req->requestor, property, XA_ATOM, 32,
+                    PropModeReplace, (unsigned char *)targets, 3);
+
+  } else if (!clip->text ||
+             (target != clip->atoms[Utf8String] && target != XA_STRING))
+    ok = false;
+
+  else if (clip->chunk < clip->len) ok = clip_start_incr(clip, req, property);
+
+  else XChangeProperty(dpy, req->requestor, property, target, 8,
+                       PropModeReplace, (unsigned char *)clip->text,
+                       clip->len);
+
+  XEvent reply = {0};
+  reply.xselection.type = SelectionNotify;
+  reply.xselection.requestor = req->requestor;
+  reply.xselection.selection = req->selection;
+  reply.xselection.target = target;
+  reply.xselection.property = ok ? property : None;
+  reply.xselection.time = req->time;
+
+  XSendEvent(dpy, req->requestor, false, 0, &reply);
+
+  // A requestor gone mid request never reads its transfer
+  if (!clip_untrap(clip)) {
+    ClipTransfer *t = clip_find(clip, req->requestor, property);
+    if (t) t->requestor = t->property = None;
+  }
+}
+
+
+/// Sends the next chunk once the requestor has deleted the previous one.  A
+/// zero length chunk ends the transfer.
+static void clip_continue(Clip *clip, XPropertyEvent *e) {
+  ClipTransfer *t = clip_find(clip, e->window, e->atom);
+  if (!t || e->state != PropertyDelete) return;
+
+  size_t len = clip->len - t->offset;
+  if (clip->chunk < len) len = clip->chunk;
+
+  clip_trap(clip, t->requestor);
+  XChangeProperty(clip->dpy, t->requestor, t->property, t->target, 8,
+                  PropModeReplace, (unsigned char *)clip->text + t->offset,
+                  len);
+  t->offset += len;
+
+  if (!len) clip_end(clip, t);
+  if (!clip_untrap(clip)) t->requestor = t->property = None;
+}
+
+
+/// Keeps the latest server timestamp so the selection is taken as of the
+/// touch or command that asked for it, without a round trip.
+static void clip_timestamp(Clip *clip, XEvent *e) {
+  Time time = 0;
+
+  switch (e->type) {
+  case KeyPress: case KeyRelease: time = e->xkey.time; break;
+  case ButtonPress: case ButtonRelease: time = e->xbutton.time; break;
+  case MotionNotify: time = e->xmotion.time; break;
+  case PropertyNotify: time = e->xproperty.time; break;
+  case SelectionClear: time = e->xselectionclear.time; break;
+  case GenericEvent:
+    if (clip->xi && e->xcookie.extension == clip->xi && e->xcookie.data)
+      time = ((XIEvent *)e->xcookie.data)->time;
+    break;
+  }
+
+  if (time) clip->time = time;
+}
+
+
+void clip_event(Clip *clip, XEvent *e) {
+  if (!clip) return;
+
+  clip_timestamp(clip, e);
+
+  switch (e->type) {
+  case SelectionRequest:
+    if (e->xselectionrequest.owner == clip->win &&
+        e->xselectionrequest.selection == clip->atoms[Clipboard])
+      clip_request(clip, &e->xselectionrequest);
+    break;
+
+  case SelectionClear:
+    if (e->xselectionclear.window == clip->win) clip->owned = false;
+    break;
+
+  case PropertyNotify: clip_continue(clip, &e->xproperty); break;
+
+  case DestroyNotify:
+    for (int i = 0; i < CLIP_MAX_TRANSFERS; i++)
+      if (clip->transfers[i].requestor == e->xdestroywindow.window) {
+        clip->transfers[i].requestor = None;
+        clip->transfers[i].property = None;
+      }
+    break;
+  }
+}
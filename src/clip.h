@@ -0,0 +1,50 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define CLIP_MAX_TRANSFERS 4
+
+/// An INCR transfer to one requestor
+typedef struct {
+  Window requestor;
+  Atom property;
+  Atom target;
+  size_t offset;
+  long mask; // Our event mask on the requestor before the transfer
+} ClipTransfer;
+
+typedef struct {
+  Display *dpy;
+  const Atom *atoms;
+  Window win; // Selection owner
+  bool owned;
+  int xi; // XInput2 opcode, touch events carry timestamps too
+  Time time; // Of the latest event seen
+
+  char *text;
+  size_t len;
+  size_t chunk; // Largest property written at once
+
+  ClipTransfer transfers[CLIP_MAX_TRANSFERS];
+} Clip;
+
+
+Clip *clip_create(Display *dpy);
+void clip_destroy(Clip *clip);
+bool clip_set(Clip *clip, const char *text);
+void clip_event(Clip *clip, XEvent *e);
@@ -46,13 +46,13 @@ static Key row1[] = {
   {"Tab ➡", "Tab ⬅", XK_Tab, 1},
   {"q", "Q", XK_q, 1},
   {"w", "W", XK_w, 1},
-  {"e", "E", XK_e, 1},
+  {"e", "E", XK_e, 1, .alts = "è é ê ë ē ė ę"},
   {"r", "R", XK_r, 1},
   {"t", "T", XK_t, 1},
-  {"y", "Y", XK_y, 1},
-  {"u", "U", XK_u, 1},
-  {"i", "I", XK_i, 1},
-  {"o", "O", XK_o, 1},
+  {"y", "Y", XK_y, 1, .alts = "ý ÿ"},
+  {"u", "U", XK_u, 1, .alts = "ù ú û ü ū"},
+  {"i", "I", XK_i, 1, .alts = "ì í î ï ī į"},
+  {"o", "O", XK_o, 1, .alts = "ò ó ô ö õ ø ō œ"},
   {"p", "P", XK_p, 1},
   {"[", "{", XK_bracketleft, 1},
   {"]", "}", XK_bracketright, 1},
@@ -62,8 +62,8 @@ static Key row1[] = {
 
 static Key row2[] = {
   {"Esc", 0, XK_Escape, 1},
-  {"a", "A", XK_a, 1},
-  {"s", "S", XK_s, 1},
+  {"a", "A", XK_a, 1, .alts = "à á â ä æ ã å ā"},
+  {"s", "S", XK_s, 1, .alts = "ß ś š"},
   {"d", "D", XK_d, 1},
   {"f", "F", XK_f, 1},
   {"g", "G", XK_g, 1},
@@ -81,10 +81,10 @@ static Key row3[] = {
   {"⬆ Shift", 0, XK_Shift_L, 2},
   {"z", "Z", XK_z, 1},
   {"x", "X", XK_x, 1},
-  {"c", "C", XK_c, 1},
+  {"c", "C", XK_c, 1, .alts = "ç ć č"},
   {"v", "V", XK_v, 1},
   {"b", "B", XK_b, 1},
-  {"n", "N", XK_n, 1},
+  {"n", "N", XK_n, 1, .alts = "ñ ń"},
   {"m", "M", XK_m, 1},
   {",", "<", XK_comma, 1},
   {".", ">", XK_period, 1},
@@ -94,10 +94,90 @@ static Key row3[] = {
 };
 
 static Key row4[] = {
+  {"?123", 0, XK_Mode_switch, 2, 1},
   {"Ctrl", 0, XK_Control_L, 2},
-  {"Space", 0, XK_space, 10},
+  {"Space", 0, XK_space, 8},
   {"Alt", 0, XK_Alt_R, 2},
   {0}
 };
 
 static Key *keys[] = {row0, row1, row2, row3, row4, 0};
+
+
+static Key num0[] = {
+  {"!", 0, XK_exclam, 1},
+  {"@", 0, XK_at, 1},
+  {"#", 0, XK_numbersign, 1},
+  {"$", 0, XK_dollar, 1},
+  {"%", 0, XK_percent, 1},
+  {"^", 0, XK_asciicircum, 1},
+  {"7", 0, XK_7, 1},
+  {"8", 0, XK_8, 1},
+  {"9", 0, XK_9, 1},
+  {"/", 0, XK_slash, 1},
+  {"Back", 0, XK_BackSpace, 2},
+  {0}
+};
+
+static Key num1[] = {
+  {"&", 0, XK_ampersand, 1},
+  {"?", 0, XK_question, 1},
+  {"(", 0, XK_parenleft, 1},
+  {")", 0, XK_parenright, 1},
+  {"[", 0, XK_bracketleft, 1},
+  {"]", 0, XK_bracketright, 1},
+  {"4", 0, XK_4, 1},
+  {"5", 0, XK_5, 1},
+  {"6", 0, XK_6, 1},
+  {"*", 0, XK_asterisk, 1},
+  {"Tab ➡", 0, XK_Tab, 2},
+  {0}
+};
+
+static Key num2[] = {
+  {"{", 0, XK_braceleft, 1},
+  {"}", 0, XK_braceright, 1},
+  {"<", 0, XK_less, 1},
+  {">", 0, XK_greater, 1},
+  {"'", 0, XK_apostrophe, 1},
+  {"\"", 0, XK_quotedbl, 1},
+  {"1", 0, XK_1, 1},
+  {"2", 0, XK_2, 1},
+  {"3", 0, XK_3, 1},
+  {"-", 0, XK_minus, 1},
+  {"↲ Enter", 0, XK_Return, 2},
+  {0}
+};
+
+static Key num3[] = {
+  {"~", 0, XK_asciitilde, 1},
+  {"`", 0, XK_grave, 1},
+  {"|", 0, XK_bar, 1},
+  {"\\", 0, XK_backslash, 1},
+  {":", 0, XK_colon, 1},
+  {";", 0, XK_semicolon, 1},
+  {"0", 0, XK_0, 1},
+  {".", 0, XK_period, 1},
+  {",", 0, XK_comma, 1},
+  {"+", 0, XK_plus, 1},
+  {"=", 0, XK_equal, 1},
+  {"_", 0, XK_underscore, 1},
+  {0}
+};
+
+static Key num4[] = {
+  {"ABC", 0, XK_Mode_switch, 2, 0},
+  {"Ctrl", 0, XK_Control_L, 2},
+  {"Space", 0, XK_space, 6},
+  {"Esc", 0, XK_Escape, 2},
+  {0}
+};
+
+static Key *numkeys[] = {num0, num1, num2, num3, num4, 0};
+
+
+static Layer layers[] = {
+  {"abc", keys},
+  {"123", numkeys},
+  {0}
+};
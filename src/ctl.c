@@ -0,0 +1,238 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "ctl.h"
+#include "util.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+/// Removes a socket left by a previous run.  Anything else at ``path``, or a
+/// socket something still listens on, is left alone.
+static void ctl_unlink_stale(const struct sockaddr_un *addr) {
+  const char *path = addr->sun_path;
+  struct stat st;
+
+  if (lstat(path, &st) == -1) return;
+  if (!S_ISSOCK(st.st_mode))
+    die("control socket path '%s' exists and is not a socket", path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) die("failed to create control socket:");
+
+  bool live = !connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+  close(fd);
+
+  if (live) die("control socket '%s' is in use", path);
+  unlink(path);
+}
+
+
+Ctl *ctl_create(const char *path, ctl_cb cb, void *data) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (sizeof(addr.sun_path) <= strlen(path))
+    die("control socket path too long '%s'", path);
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) die("failed to create control socket:");
+
+  ctl_unlink_stale(&addr);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, CTL_MAX_CLIENTS) == -1)
+    die("failed to bind control socket '%s':", path);
+
+  Ctl *ctl = calloc(1, sizeof(Ctl));
+  ctl->fd = fd;
+  ctl->path = strdup(path);
+  ctl->cb = cb;
+  ctl->data = data;
+
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++)
+    ctl->clients[i].fd = -1;
+
+  return ctl;
+}
+
+
+static void ctl_close(CtlClient *client) {
+  close(client->fd);
+  client->fd = -1;
+  client->len = 0;
+  client->waiting = false;
+  client->visible = false;
+}
+
+
+void ctl_destroy(Ctl *ctl) {
+  if (!ctl) return;
+
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++)
+    if (ctl->clients[i].fd != -1) ctl_close(&ctl->clients[i]);
+
+  close(ctl->fd);
+  unlink(ctl->path);
+  free(ctl->path);
+  free(ctl);
+}
+
+
+/// Adds the socket and its clients to ``fds`` and returns the highest fd.
+int ctl_fds(Ctl *ctl, fd_set *fds, int max) {
+  if (!ctl) return max;
+
+  FD_SET(ctl->fd, fds);
+  if (max < ctl->fd) max = ctl->fd;
+
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+    int fd = ctl->clients[i].fd;
+    if (fd == -1) continue;
+
+    FD_SET(fd, fds);
+    if (max < fd) max = fd;
+  }
+
+  return max;
+}
+
+
+static void ctl_accept(Ctl *ctl) {
+  int fd = accept(ctl->fd, 0, 0);
+  if (fd == -1) return;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++)
+    if (ctl->clients[i].fd == -1) {
+      ctl->clients[i].fd = fd;
+      return;
+    }
+
+  message("Too many control clients\n");
+  close(fd);
+}
+
+
+static void ctl_line(Ctl *ctl, CtlClient *client, char *line) {
+  // Trim
+  int len = strlen(line);
+  while (len && strchr(" \t\r", line[len - 1])) line[--len] = 0;
+  char *cmd = line + strspn(line, " \t\r");
+
+  // Split command from argument
+  char *arg = cmd + strcspn(cmd, " \t\r");
+  if (*arg) {
+    *arg++ = 0;
+    arg += strspn(arg, " \t\r");
+  }
+
+  if (*cmd) ctl->cb(client, cmd, arg, ctl->data);
+}
+
+
+static void ctl_read(Ctl *ctl, CtlClient *client) {
+  while (true) {
+    ssize_t n = read(client->fd, client->line + client->len,
+                     CTL_LINE_MAX - 1 - client->len);
+
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) {ctl_close(client); return;}
+
+    client->len += n;
+    client->line[client->len] = 0;
+
+    // Handle complete lines
+    char *start = client->line;
+    char *end;
+    while ((end = strchr(start, '\n'))) {
+      *end = 0;
+      ctl_line(ctl, client, start);
+      if (client->fd == -1) return;
+      start = end + 1;
+    }
+
+    client->len -= start - client->line;
+    memmove(client->line, start, client->len);
+
+    if (client->len == CTL_LINE_MAX - 1) {
+      ctl_reply(client, "error line too long");
+      ctl_close(client);
+      return;
+    }
+  }
+}
+
+
+void ctl_process(Ctl *ctl, fd_set *fds) {
+  if (!ctl) return;
+
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+    CtlClient *client = &ctl->clients[i];
+    if (client->fd != -1 && FD_ISSET(client->fd, fds)) ctl_read(ctl, client);
+  }
+
+  if (FD_ISSET(ctl->fd, fds)) ctl_accept(ctl);
+}
+
+
+/// Replies are one line sent whole, allocated when longer than a command
+/// line.  A client that stops reading is dropped.
+void ctl_reply(CtlClient *client, const char *fmt, ...) {
+  char line[CTL_LINE_MAX];
+  char *buf = line;
+
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+  va_end(ap);
+
+  if (len < 0) return;
+  if ((int)sizeof(line) - 1 <= len) {
+    buf = malloc(len + 2);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
+    va_end(ap);
+  }
+
+  buf[len++] = '\n';
+
+  if (send(client->fd, buf, len, MSG_NOSIGNAL) != len) ctl_close(client);
+  if (buf != line) free(buf);
+}
+
+
+/// Acknowledges commands waiting for the keyboard to reach ``visible``.
+/// Clients waiting for the other state keep waiting.
+void ctl_notify(Ctl *ctl, bool visible) {
+  if (!ctl) return;
+
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+    CtlClient *client = &ctl->clients[i];
+
+    if (client->fd != -1 && client->waiting && client->visible == visible) {
+      client->waiting = false;
+      ctl_reply(client, "ok %s", visible ? "visible" : "hidden");
+    }
+  }
+}
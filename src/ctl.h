@@ -0,0 +1,46 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/select.h>
+
+
+#define CTL_MAX_CLIENTS 8
+#define CTL_LINE_MAX 256
+
+typedef struct {
+  int fd;
+  char line[CTL_LINE_MAX];
+  unsigned len;
+  bool waiting; // For the keyboard to map or unmap
+  bool visible; // The state waited for
+} CtlClient;
+
+typedef void (*ctl_cb)(CtlClient *client, char *cmd, char *arg, void *data);
+
+typedef struct {
+  int fd;
+  char *path;
+  CtlClient clients[CTL_MAX_CLIENTS];
+
+  ctl_cb cb;
+  void *data;
+} Ctl;
+
+
+Ctl *ctl_create(const char *path, ctl_cb cb, void *data);
+void ctl_destroy(Ctl *ctl);
+int ctl_fds(Ctl *ctl, fd_set *fds, int max);
+void ctl_process(Ctl *ctl, fd_set *fds);
+void ctl_reply(CtlClient *client, const char *fmt, ...);
+void ctl_notify(Ctl *ctl, bool visible);
@@ -0,0 +1,459 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "dict.h"
+#include "util.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define DICT_MAGIC 0x444b4242 // "BBKD"
+#define DICT_VERSION 1
+#define DICT_NONE 0xffffffff
+
+
+// Binary dictionary image.  A radix trie where each edge carries a run of
+// characters from the string pool.  Words are ranked by frequency, zero
+// being the most frequent, and every node records the best rank below it so
+// completions are found best first without visiting the whole subtree.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;
+  uint32_t nodes;
+  uint32_t edges;
+  uint32_t strs;
+} DictHeader;
+
+
+typedef struct DictNode {
+  uint32_t edges; // Index of the first edge, sorted by first character
+  uint32_t count;
+  uint32_t rank;  // Of the word ending here or DICT_NONE
+  uint32_t best;  // Best rank in this subtree
+} DictNode;
+
+
+typedef struct DictEdge {
+  uint32_t label; // Offset in the string pool
+  uint32_t len;
+  uint32_t node;
+} DictEdge;
+
+
+typedef struct {
+  char *word;
+  unsigned freq;
+  uint32_t rank;
+} DictWord;
+
+
+typedef struct {
+  void *data;
+  size_t size;
+  size_t alloc;
+} DictBuffer;
+
+
+static uint32_t dict_add(DictBuffer *buf, const void *data, size_t len) {
+  if (buf->alloc < buf->size + len) {
+    buf->alloc = buf->alloc * 2 < buf->size + len ?
+      buf->size + len : buf->alloc * 2;
+    buf->data = realloc(buf->data, buf->alloc);
+  }
+
+  uint32_t offset = buf->size;
+  memcpy((char *)buf->data + offset, data, len);
+  buf->size += len;
+
+  return offset;
+}
+
+
+Dict *dict_load(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    log_msg(LOG_ERROR, "cannot open dictionary '%s'", path);
+    return 0;
+  }
+
+  struct stat st;
+  void *image = MAP_FAILED;
+  if (!fstat(fd, &st) && sizeof(DictHeader) <= st.st_size)
+    image = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (image == MAP_FAILED) {
+    log_msg(LOG_ERROR, "cannot map dictionary '%s'", path);
+    return 0;
+  }
+
+  // Only the header is checked here.  Indices are checked during lookups so
+  // that loading does not touch every page.
+  const DictHeader *hdr = image;
+  size_t size = st.st_size;
+  size_t edgesOffset = sizeof(DictHeader) + hdr->nodes * sizeof(DictNode);
+  size_t strsOffset = edgesOffset + hdr->edges * sizeof(DictEdge);
+
+  if (hdr->magic != DICT_MAGIC || hdr->version != DICT_VERSION ||
+      hdr->size != size || !hdr->nodes || strsOffset + hdr->strs != size) {
+    log_msg(LOG_ERROR, "invalid dictionary '%s'", path);
+    munmap(image, size);
+    return 0;
+  }
+
+  Dict *dict = calloc(1, sizeof(Dict));
+  dict->image = image;
+  dict->size = size;
+  dict->nodes = (const DictNode *)(hdr + 1);
+  dict->edges = (const DictEdge *)((char *)image + edgesOffset);
+  dict->strs = (const char *)image + strsOffset;
+  dict->nnodes = hdr->nodes;
+  dict->nedges = hdr->edges;
+  dict->nstrs = hdr->strs;
+
+  return dict;
+}
+
+
+void dict_free(Dict *dict) {
+  if (!dict) return;
+  munmap(dict->image, dict->size);
+  free(dict);
+}
+
+
+static const DictEdge *dict_edge(Dict *dict, const DictNode *node,
+                                 uint32_t i) {
+  uint32_t e = node->edges + i;
+  if (dict->nedges <= e) return 0;
+
+  const DictEdge *edge = &dict->edges[e];
+  if (dict->nnodes <= edge->node || !edge->len ||
+      dict->nstrs < edge->label + edge->len) return 0;
+
+  return edge;
+}
+
+
+/// Finds the edge leaving ``node`` that starts with ``c``.
+static const DictEdge *dict_find(Dict *dict, const DictNode *node, char c) {
+  int lo = 0, hi = (int)node->count - 1;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    const DictEdge *edge = dict_edge(dict, node, mid);
+    if (!edge) return 0;
+
+    char first = dict->strs[edge->label];
+    if (first == c) return edge;
+    if ((unsigned char)first < (unsigned char)c) lo = mid + 1;
+    else hi = mid - 1;
+  }
+
+  return 0;
+}
+
+
+typedef struct {
+  Dict *dict;
+  char word[DICT_WORD_MAX];
+  char (*results)[DICT_WORD_MAX];
+  uint32_t ranks[DICT_MAX_RESULTS];
+  int count;
+  int max;
+} DictSearch;
+
+
+/// Returns the rank a subtree must beat to be worth visiting.
+static uint32_t dict_worst(DictSearch *s) {
+  return s->count < s->max ? DICT_NONE : s->ranks[s->count - 1];
+}
+
+
+static void dict_insert(DictSearch *s, uint32_t rank, int len) {
+  int i = s->count < s->max ? s->count++ : s->max - 1;
+
+  // Keep results sorted by rank
+  for (; i && rank < s->ranks[i - 1]; i--) {
+    s->ranks[i] = s->ranks[i - 1];
+    memcpy(s->results[i], s->results[i - 1], DICT_WORD_MAX);
+  }
+
+  s->ranks[i] = rank;
+  memcpy(s->results[i], s->word, len);
+  s->results[i][len] = 0;
+}
+
+
+static void dict_search(DictSearch *s, const DictNode *node, int len) {
+  if (dict_worst(s) <= node->best) return;
+
+  if (node->rank != DICT_NONE && node->rank < dict_worst(s))
+    dict_insert(s, node->rank, len);
+
+  for (uint32_t i = 0; i < node->count; i++) {
+    const DictEdge *edge = dict_edge(s->dict, node, i);
+    if (!edge) return;
+
+    const DictNode *child = &s->dict->nodes[edge->node];
+    if (dict_worst(s) <= child->best) continue;
+    if (DICT_WORD_MAX <= len + edge->len) continue;
+
+    memcpy(s->word + len, s->dict->strs + edge->label, edge->len);
+    dict_search(s, child, len + edge->len);
+  }
+}
+
+
+/// Finds up to ``max`` of the most frequent words starting with ``prefix``,
+/// most frequent first.
+int dict_complete(Dict *dict, const char *prefix,
+                  char results[][DICT_WORD_MAX], int max) {
+  uint64_t start = get_time_ns();
+  int plen = strlen(prefix);
+
+  DictSearch s = {dict};
+  s.results = results;
+  s.max = max < DICT_MAX_RESULTS ? max : DICT_MAX_RESULTS;
+
+  // Walk down to the node at or below the end of the prefix
+  const DictNode *node = &dict->nodes[0];
+  int len = 0;
+
+  while (node && len < plen) {
+    const DictEdge *edge = dict_find(dict, node, prefix[len]);
+    if (!edge || DICT_WORD_MAX <= len + edge->len) {node = 0; break;}
+
+    const char *label = dict->strs + edge->label;
+    int n = plen - len < (int)edge->len ? plen - len : (int)edge->len;
+    if (strncmp(label, prefix + len, n)) {node = 0; break;}
+
+    memcpy(s.word + len, label, edge->len);
+    len += edge->len;
+    node = &dict->nodes[edge->node];
+  }
+
+  if (node && plen) dict_search(&s, node, len);
+
+  uint64_t t = get_time_ns() - start;
+  dict->lookups++;
+  dict->total_ns += t;
+  if (dict->max_ns < t) dict->max_ns = t;
+
+  return s.count;
+}
+
+
+typedef struct {
+  Dict *dict;
+  dict_filter filter;
+  dict_match match;
+  void *data;
+  char word[DICT_WORD_MAX];
+} DictWalk;
+
+
+static void dict_walk_node(DictWalk *w, const DictNode *node, int len,
+                           int state) {
+  if (node->rank != DICT_NONE) {
+    w->word[len] = 0;
+    w->match(w->data, state, w->word, node->rank);
+  }
+
+  for (uint32_t i = 0; i < node->count; i++) {
+    const DictEdge *edge = dict_edge(w->dict, node, i);
+    if (!edge) return;
+    if (DICT_WORD_MAX <= len + edge->len) continue;
+
+    int s = state;
+    const char *label = w->dict->strs + edge->label;
+
+    for (uint32_t j = 0; 0 <= s && j < edge->len; j++) {
+      w->word[len + j] = label[j];
+      s = w->filter(w->data, s, len + j, label[j]);
+    }
+
+    if (0 <= s) dict_walk_node(w, &w->dict->nodes[edge->node],
+                               len + edge->len, s);
+  }
+}
+
+
+/// Visits every word the filter accepts character by character.
+void dict_walk(Dict *dict, dict_filter filter, dict_match match, void *data) {
+  DictWalk w = {dict, filter, match, data};
+  dict_walk_node(&w, &dict->nodes[0], 0, 0);
+}
+
+
+static int dict_cmp_freq(const void *a, const void *b) {
+  const DictWord *x = a, *y = b;
+  if (x->freq != y->freq) return x->freq < y->freq ? 1 : -1;
+  return strcmp(x->word, y->word);
+}
+
+
+static int dict_cmp_word(const void *a, const void *b) {
+  const DictWord *x = a, *y = b;
+  int cmp = strcmp(x->word, y->word);
+  if (cmp) return cmp;
+  return x->rank < y->rank ? -1 : x->rank > y->rank;
+}
+
+
+typedef struct {
+  DictBuffer nodes;
+  DictBuffer edges;
+  DictBuffer strs;
+} DictBuild;
+
+
+/// Builds the subtree for ``words``, all of which share their first ``depth``
+/// characters, and returns its node index.
+static uint32_t dict_build(DictBuild *b, DictWord *words, int count,
+                           int depth) {
+  DictNode node = {0, 0, DICT_NONE, DICT_NONE};
+  uint32_t index = b->nodes.size / sizeof(DictNode);
+  dict_add(&b->nodes, &node, sizeof(node));
+
+  if (!words[0].word[depth]) {
+    node.rank = node.best = words[0].rank;
+    words++;
+    count--;
+  }
+
+  // Group by next character
+  DictEdge *edges = calloc(count, sizeof(DictEdge));
+  int nedges = 0;
+
+  for (int i = 0; i < count;) {
+    int j = i + 1;
+    while (j < count && words[j].word[depth] == words[i].word[depth]) j++;
+
+    // The label is the longest prefix the group has in common
+    const char *first = words[i].word, *last = words[j - 1].word;
+    int end = depth + 1;
+    while (first[end] && first[end] == last[end]) end++;
+
+    DictEdge *edge = &edges[nedges++];
+    edge->label = dict_add(&b->strs, first + depth, end - depth);
+    edge->len = end - depth;
+    edge->node = dict_build(b, words + i, j - i, end);
+
+    uint32_t best = ((DictNode *)b->nodes.data)[edge->node].best;
+    if (best < node.best) node.best = best;
+
+    i = j;
+  }
+
+  node.edges = b->edges.size / sizeof(DictEdge);
+  node.count = nedges;
+  if (nedges) dict_add(&b->edges, edges, nedges * sizeof(DictEdge));
+  free(edges);
+
+  ((DictNode *)b->nodes.data)[index] = node;
+
+  return index;
+}
+
+
+/// Compiles a word list, one word per line optionally followed by its
+/// frequency, in to a binary dictionary.
+bool dict_compile(const char *src, const char *dst) {
+  FILE *f = fopen(src, "r");
+  if (!f) {
+    fprintf(stderr, "error, cannot open '%s'\n", src);
+    return false;
+  }
+
+  DictBuffer words = {0};
+  char *line = 0;
+  size_t len = 0;
+
+  while (getline(&line, &len, f) != -1) {
+    char word[DICT_WORD_MAX];
+    unsigned freq = 0;
+
+    if (sscanf(line, "%63s %u", word, &freq) < 1 || word[0] == '#') continue;
+
+    // Only ASCII, UTF-8 sequences pass through untouched
+    for (char *c = word; *c; c++)
+      if ('A' <= *c && *c <= 'Z') *c += 'a' - 'A';
+    DictWord w = {strdup(word), freq, 0};
+    dict_add(&words, &w, sizeof(w));
+  }
+
+  free(line);
+  fclose(f);
+
+  DictWord *list = words.data;
+  int count = words.size / sizeof(DictWord);
+
+  // Rank by frequency, then sort and drop duplicates keeping the best rank
+  qsort(list, count, sizeof(DictWord), dict_cmp_freq);
+  for (int i = 0; i < count; i++) list[i].rank = i;
+  qsort(list, count, sizeof(DictWord), dict_cmp_word);
+
+  int unique = 0;
+  for (int i = 0; i < count; i++)
+    if (!unique || strcmp(list[unique - 1].word, list[i].word))
+      list[unique++] = list[i];
+    else free(list[i].word);
+
+  DictBuild b = {{0}};
+  DictWord empty = {"", 0, DICT_NONE};
+  if (unique) dict_build(&b, list, unique, 0);
+  else dict_build(&b, &empty, 1, 0);
+
+  DictHeader hdr;
+  hdr.magic = DICT_MAGIC;
+  hdr.version = DICT_VERSION;
+  hdr.nodes = b.nodes.size / sizeof(DictNode);
+  hdr.edges = b.edges.size / sizeof(DictEdge);
+  hdr.strs = b.strs.size;
+  hdr.size = sizeof(hdr) + b.nodes.size + b.edges.size + b.strs.size;
+
+  // Write to a temporary file and rename so readers see an atomic swap
+  char *tmp = malloc(strlen(dst) + 5);
+  sprintf(tmp, "%s.tmp", dst);
+
+  FILE *out = fopen(tmp, "wb");
+  bool ok = out && fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+    fwrite(b.nodes.data, b.nodes.size, 1, out) == 1 &&
+    (!b.edges.size || fwrite(b.edges.data, b.edges.size, 1, out) == 1) &&
+    (!b.strs.size || fwrite(b.strs.data, b.strs.size, 1, out) == 1);
+  if (out && fclose(out)) ok = false;
+  if (ok && rename(tmp, dst)) ok = false;
+
+  if (!ok) {
+    fprintf(stderr, "error, cannot write '%s'\n", dst);
+    unlink(tmp);
+
+  } else message("%d words, %u nodes, %u bytes\n", unique, hdr.nodes,
+                 hdr.size);
+
+  for (int i = 0; i < unique; i++) free(list[i].word);
+  free(list);
+  free(tmp);
+  free(b.nodes.data);
+  free(b.edges.data);
+  free(b.strs.data);
+
+  return ok;
+}
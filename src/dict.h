@@ -0,0 +1,51 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define DICT_WORD_MAX 64
+#define DICT_MAX_RESULTS 3
+
+/// Returns the state after appending ``c`` to a word of length ``depth`` or
+/// -1 to skip every word continuing that way.
+typedef int (*dict_filter)(void *data, int state, int depth, char c);
+typedef void (*dict_match)(void *data, int state, const char *word,
+                           uint32_t rank);
+
+typedef struct {
+  void *image;
+  size_t size;
+
+  const struct DictNode *nodes;
+  const struct DictEdge *edges;
+  const char *strs;
+  uint32_t nnodes;
+  uint32_t nedges;
+  uint32_t nstrs;
+
+  // Lookup timing
+  unsigned lookups;
+  uint64_t total_ns;
+  uint64_t max_ns;
+} Dict;
+
+
+Dict *dict_load(const char *path);
+void dict_free(Dict *dict);
+bool dict_compile(const char *src, const char *dst);
+int dict_complete(Dict *dict, const char *prefix,
+                  char results[][DICT_WORD_MAX], int max);
+void dict_walk(Dict *dict, dict_filter filter, dict_match match, void *data);
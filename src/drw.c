@@ -12,8 +12,12 @@
 #include "drw.h"
 #include "util.h"
 
+#include <X11/Xcursor/Xcursor.h>
+
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 
 #ifndef FC_COLOR
@@ -23,6 +27,10 @@
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
 
+// Xft shares font files and their FreeType faces between every display in
+// the process without locking them, so fonts are used by one thread at a time
+static pthread_mutex_t font_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static const uint8_t utfbyte[] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const uint8_t utfmask[] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static const long utfmin[] = {       0,    0,  0x80,  0x800, 0x10000};
@@ -71,43 +79,160 @@ static size_t utf8decode(const char *c, long *u, size_t clen) {
 }
 
 
-Drw *drw_create(Display *dpy, int screen, Window root, unsigned w, unsigned h) {
+DrwCtx *drw_ctx_create(Display *dpy, int screen, Window root) {
+  DrwCtx *ctx = calloc(1, sizeof(DrwCtx));
+
+  ctx->dpy = dpy;
+  ctx->screen = screen;
+  ctx->root = root;
+  ctx->gc = XCreateGC(dpy, root, 0, 0);
+  XSetLineAttributes(dpy, ctx->gc, 1, LineSolid, CapButt, JoinMiter);
+
+  return ctx;
+}
+
+
+void drw_ctx_free(DrwCtx *ctx) {
+  for (unsigned i = 0; i < ctx->ncolors; i++)
+    free(ctx->colors[i].name);
+
+  for (unsigned i = 0; i < ctx->ncursors; i++)
+    XFreeCursor(ctx->dpy, ctx->cursors[i].cursor);
+
+  XFreeGC(ctx->dpy, ctx->gc);
+  drw_fontset_free(ctx->fonts);
+  free(ctx->colors);
+  free(ctx->cursors);
+  free(ctx->missing);
+  free(ctx);
+}
+
+
+Cursor drw_ctx_cursor(DrwCtx *ctx, const char *name) {
+  for (unsigned i = 0; i < ctx->ncursors; i++)
+    if (!strcmp(ctx->cursors[i].name, name)) return ctx->cursors[i].cursor;
+
+  Cursor cursor = XcursorLibraryLoadCursor(ctx->dpy, name);
+
+  ctx->cursors =
+    realloc(ctx->cursors, (ctx->ncursors + 1) * sizeof(DrwCursor));
+  ctx->cursors[ctx->ncursors].name = name;
+  ctx->cursors[ctx->ncursors++].cursor = cursor;
+
+  return cursor;
+}
+
+
+static bool drw_ctx_missing(DrwCtx *ctx, long codepoint) {
+  for (unsigned i = 0; i < ctx->nmissing; i++)
+    if (ctx->missing[i] == codepoint) return true;
+  return false;
+}
+
+
+static void drw_ctx_add_missing(DrwCtx *ctx, long codepoint) {
+  ctx->missing = realloc(ctx->missing, (ctx->nmissing + 1) * sizeof(long));
+  ctx->missing[ctx->nmissing++] = codepoint;
+}
+
+
+static Drawable drw_buffer_create(Drw *drw) {
+  DrwCtx *ctx = drw->ctx;
+  return XCreatePixmap(ctx->dpy, ctx->root, drw->w, drw->h,
+                       DefaultDepth(ctx->dpy, ctx->screen));
+}
+
+
+Drw *drw_create(DrwCtx *ctx, unsigned w, unsigned h) {
   Drw *drw = calloc(1, sizeof(Drw));
 
-  drw->dpy = dpy;
-  drw->screen = screen;
-  drw->root = root;
+  drw->dpy = ctx->dpy;
+  drw->ctx = ctx;
   drw->w = w;
   drw->h = h;
-  drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
-  drw->gc = XCreateGC(dpy, root, 0, 0);
-  XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
+  drw_buffers(drw, 1);
 
   return drw;
 }
 
 
+static void drw_picture_free(Drw *drw, unsigned i) {
+  if (drw->pictures[i]) XRenderFreePicture(drw->dpy, drw->pictures[i]);
+  drw->pictures[i] = 0;
+}
+
+
 void drw_resize(Drw *drw, unsigned w, unsigned h) {
   if (!drw) return;
 
   drw->w = w;
   drw->h = h;
-  if (drw->drawable) XFreePixmap(drw->dpy, drw->drawable);
-  drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+
+  for (unsigned i = 0; i < drw->nbuffers; i++) {
+    bool selected = drw->drawable == drw->buffers[i];
+    drw_picture_free(drw, i);
+    XFreePixmap(drw->dpy, drw->buffers[i]);
+    drw->buffers[i] = drw_buffer_create(drw);
+    if (selected) drw->drawable = drw->buffers[i];
+  }
 }
 
 
 void drw_free(Drw *drw) {
-  XFreePixmap(drw->dpy, drw->drawable);
-  XFreeGC(drw->dpy, drw->gc);
-  drw_fontset_free(drw->fonts);
+  drw_buffers(drw, 0);
   free(drw);
 }
 
 
+/// Allocates ``count`` back buffers and selects the first.
+void drw_buffers(Drw *drw, unsigned count) {
+  for (unsigned i = 0; i < drw->nbuffers; i++) {
+    drw_picture_free(drw, i);
+    XFreePixmap(drw->dpy, drw->buffers[i]);
+  }
+
+  free(drw->buffers);
+  free(drw->pictures);
+  drw->nbuffers = count;
+  drw->buffers = count ? calloc(count, sizeof(Drawable)) : 0;
+  drw->pictures = count ? calloc(count, sizeof(Picture)) : 0;
+
+  for (unsigned i = 0; i < count; i++)
+    drw->buffers[i] = drw_buffer_create(drw);
+
+  drw->drawable = count ? drw->buffers[0] : 0;
+}
+
+
+void drw_select(Drw *drw, unsigned i) {
+  if (i < drw->nbuffers) drw->drawable = drw->buffers[i];
+}
+
+
+/// Returns an XRender picture of the selected buffer.
+Picture drw_picture(Drw *drw) {
+  DrwCtx *ctx = drw->ctx;
+
+  for (unsigned i = 0; i < drw->nbuffers; i++) {
+    if (drw->buffers[i] != drw->drawable) continue;
+
+    if (!drw->pictures[i]) {
+      Visual *visual = DefaultVisual(drw->dpy, ctx->screen);
+      XRenderPictFormat *fmt = XRenderFindVisualFormat(drw->dpy, visual);
+      drw->pictures[i] =
+        XRenderCreatePicture(drw->dpy, drw->drawable, fmt, 0, 0);
+    }
+
+    return drw->pictures[i];
+  }
+
+  return 0;
+}
+
+
 /// This function is an implementation detail. Library users should use
 /// drw_fontset_create instead.
-static Fnt *xfont_create(Drw *drw, const char *fontname,
+static Fnt *xfont_create(DrwCtx *ctx, const char *fontname,
                          FcPattern *fontpattern) {
   XftFont *xfont = 0;
   FcPattern *pattern = 0;
@@ -118,7 +243,7 @@ static Fnt *xfont_create(Drw *drw, const char *fontname,
     // FcNameParse; using the latter results in the desired fallback
     // behaviour whereas the former just results in missing-character
     // rectangles being drawn, at least with some fonts.
-    if (!(xfont = XftFontOpenName(drw->dpy, drw->screen, fontname))) {
+    if (!(xfont = XftFontOpenName(ctx->dpy, ctx->screen, fontname))) {
       fprintf(stderr, "error, cannot load font from name: '%s'\n", fontname);
       return 0;
     }
@@ -126,12 +251,12 @@ static Fnt *xfont_create(Drw *drw, const char *fontname,
     if (!(pattern = FcNameParse((FcChar8 *) fontname))) {
       fprintf(stderr, "error, cannot parse font name to pattern: '%s'\n",
               fontname);
-      XftFontClose(drw->dpy, xfont);
+      XftFontClose(ctx->dpy, xfont);
       return 0;
     }
 
   } else if (fontpattern) {
-    if (!(xfont = XftFontOpenPattern(drw->dpy, fontpattern))) {
+    if (!(xfont = XftFontOpenPattern(ctx->dpy, fontpattern))) {
       fprintf(stderr, "error, cannot load font from pattern.\n");
       return 0;
     }
@@ -147,7 +272,7 @@ static Fnt *xfont_create(Drw *drw, const char *fontname,
   FcBool iscol;
   if (FcPatternGetBool(xfont->pattern, FC_COLOR, 0, &iscol) == FcResultMatch &&
       iscol) {
-    XftFontClose(drw->dpy, xfont);
+    XftFontClose(ctx->dpy, xfont);
     return 0;
   }
 
@@ -155,7 +280,7 @@ static Fnt *xfont_create(Drw *drw, const char *fontname,
   font->xfont = xfont;
   font->pattern = pattern;
   font->h = xfont->ascent + xfont->descent;
-  font->dpy = drw->dpy;
+  font->dpy = ctx->dpy;
 
   return font;
 }
@@ -169,36 +294,67 @@ static void xfont_free(Fnt *font) {
 }
 
 
-Fnt *drw_fontset_create(Drw *drw, const char *fonts[], size_t count) {
+Fnt *drw_fontset_create(DrwCtx *ctx, const char *fonts[], size_t count) {
   Fnt *cur, *ret = 0;
 
-  if (!drw || !fonts) return 0;
+  if (!ctx || !fonts) return 0;
+
+  pthread_mutex_lock(&font_lock);
 
   for (size_t i = 1; i <= count; i++)
-    if ((cur = xfont_create(drw, fonts[count - i], 0))) {
+    if ((cur = xfont_create(ctx, fonts[count - i], 0))) {
       cur->next = ret;
       ret = cur;
     }
 
-  return drw->fonts = ret;
+  pthread_mutex_unlock(&font_lock);
+
+  return ctx->fonts = ret;
 }
 
 
-void drw_fontset_free(Fnt *font) {
+static void fontset_free(Fnt *font) {
   if (font) {
-    drw_fontset_free(font->next);
+    fontset_free(font->next);
     xfont_free(font);
   }
 }
 
 
+void drw_fontset_free(Fnt *font) {
+  pthread_mutex_lock(&font_lock);
+  fontset_free(font);
+  pthread_mutex_unlock(&font_lock);
+}
+
+
+/// Colors are allocated once per context and shared by all schemes.
 void drw_clr_create(Drw *drw, Clr *dest, const char *clrname) {
   if (!drw || !dest || !clrname) return;
 
-  if (!XftColorAllocName(drw->dpy, DefaultVisual(drw->dpy, drw->screen),
-                         DefaultColormap(drw->dpy, drw->screen),
-                         clrname, dest))
+  DrwCtx *ctx = drw->ctx;
+
+  for (unsigned i = 0; i < ctx->ncolors; i++)
+    if (!strcmp(ctx->colors[i].name, clrname)) {
+      *dest = ctx->colors[i].clr;
+      return;
+    }
+
+  // Parsed on the client, computed locally for TrueColor visuals
+  Visual *visual = DefaultVisual(ctx->dpy, ctx->screen);
+  Colormap cmap = DefaultColormap(ctx->dpy, ctx->screen);
+  XColor color;
+
+  if (!XParseColor(ctx->dpy, cmap, clrname, &color))
+    die("error, cannot parse color '%s'", clrname);
+
+  XRenderColor render = {color.red, color.green, color.blue, 0xffff};
+  if (!XftColorAllocValue(ctx->dpy, visual, cmap, &render, dest))
     die("error, cannot allocate color '%s'", clrname);
+
+  ctx->colors = realloc(ctx->colors, (ctx->ncolors + 1) * sizeof(DrwColor));
+  ctx->colors[ctx->ncolors].name = strdup(clrname);
+  ctx->colors[ctx->ncolors++].clr = *dest;
 }
 
 
@@ -220,7 +376,22 @@ Clr *drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount) {
 }
 
 
-void drw_setfontset(Drw *drw, Fnt *set) {if (drw) drw->fonts = set;}
+/// Creates ``count`` two color schemes at once.
+void drw_scms_create(Drw *drw, Clr *scms[], const char *clrnames[][2],
+                     size_t count) {
+  for (size_t i = 0; i < count; i++)
+    scms[i] = drw_scm_create(drw, clrnames[i], 2);
+}
+
+
+/// As 0xRRGGBB for drawing in client memory.
+uint32_t drw_clr_rgb(const Clr *clr) {
+  const XRenderColor *c = &clr->color;
+  return (c->red >> 8) << 16 | (c->green >> 8) << 8 | c->blue >> 8;
+}
+
+
+void drw_setfontset(DrwCtx *ctx, Fnt *set) {if (ctx) ctx->fonts = set;}
 void drw_setscheme(Drw *drw, Clr *scm) {if (drw) drw->scheme = scm;}
 
 
@@ -228,16 +399,29 @@ void drw_rect(Drw *drw, int x, int y, unsigned w, unsigned h, int filled,
               int invert) {
   if (!drw || !drw->scheme) return;
 
-  XSetForeground(drw->dpy, drw->gc,
+  GC gc = drw->ctx->gc;
+  XSetForeground(drw->dpy, gc,
                  invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
 
-  if (filled) XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-  else XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+  if (filled) XFillRectangle(drw->dpy, drw->drawable, gc, x, y, w, h);
+  else XDrawRectangle(drw->dpy, drw->drawable, gc, x, y, w - 1, h - 1);
 }
 
 
-int drw_text(Drw *drw, int x, int y, unsigned w, unsigned h, unsigned lpad,
-             const char *text, int invert) {
+static void font_getexts(Fnt *font, const char *text, unsigned len,
+                         unsigned *w, unsigned *h) {
+  XGlyphInfo ext;
+
+  if (!font || !text) return;
+
+  XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+  if (w) *w = ext.xOff;
+  if (h) *h = font->h;
+}
+
+
+static int text_draw(Drw *drw, int x, int y, unsigned w, unsigned h,
+                     unsigned lpad, const char *text, int invert) {
   char buf[1024];
   int ty;
   XftDraw *d = 0;
@@ -251,21 +435,23 @@ int drw_text(Drw *drw, int x, int y, unsigned w, unsigned h, unsigned lpad,
   FcPattern *match;
   XftResult result;
   int charexists = 0;
+  DrwCtx *ctx = drw ? drw->ctx : 0;
 
-  if (!drw || (render && !drw->scheme) || !text || !drw->fonts) return 0;
+  if (!drw || (render && !drw->scheme) || !text || !ctx->fonts) return 0;
 
   if (!render) w = ~w;
   else {
-    XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-    XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+    XSetForeground(drw->dpy, ctx->gc,
+                   drw->scheme[invert ? ColFg : ColBg].pixel);
+    XFillRectangle(drw->dpy, drw->drawable, ctx->gc, x, y, w, h);
     d = XftDrawCreate(drw->dpy, drw->drawable,
-                      DefaultVisual(drw->dpy, drw->screen),
-                      DefaultColormap(drw->dpy, drw->screen));
+                      DefaultVisual(drw->dpy, ctx->screen),
+                      DefaultColormap(drw->dpy, ctx->screen));
     x += lpad;
     w -= lpad;
   }
 
-  Fnt *usedfont = drw->fonts;
+  Fnt *usedfont = ctx->fonts;
 
   while (1) {
     utf8strlen = 0;
@@ -274,7 +460,7 @@ int drw_text(Drw *drw, int x, int y, unsigned w, unsigned h, unsigned lpad,
 
     while (*text) {
       utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-      for (curfont = drw->fonts; curfont; curfont = curfont->next) {
+      for (curfont = ctx->fonts; curfont; curfont = curfont->next) {
         charexists =
           charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
         if (charexists) {
@@ -293,11 +479,11 @@ int drw_text(Drw *drw, int x, int y, unsigned w, unsigned h, unsigned lpad,
 
     if (utf8strlen) {
       unsigned ew = 0;
-      drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, 0);
+      font_getexts(usedfont, utf8str, utf8strlen, &ew, 0);
 
       // shorten text if necessary
       for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-        drw_font_getexts(usedfont, utf8str, len, &ew, 0);
+        font_getexts(usedfont, utf8str, len, &ew, 0);
 
       if (len) {
         memcpy(buf, utf8str, len);
@@ -326,39 +512,47 @@ int drw_text(Drw *drw, int x, int y, unsigned w, unsigned h, unsigned lpad,
       // character must be drawn.
       charexists = 1;
 
+      // Skip the search for characters no font was found for before
+      if (drw_ctx_missing(ctx, utf8codepoint)) {
+        usedfont = ctx->fonts;
+        continue;
+      }
+
       fccharset = FcCharSetCreate();
       FcCharSetAddChar(fccharset, utf8codepoint);
 
-      if (!drw->fonts->pattern)
+      if (!ctx->fonts->pattern)
         // Refer to the comment in xfont_create for more information.
         die("the first font in the cache must be loaded from a font string.");
 
-      fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+      fcpattern = FcPatternDuplicate(ctx->fonts->pattern);
       FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
       FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
       FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
 
       FcConfigSubstitute(0, fcpattern, FcMatchPattern);
       FcDefaultSubstitute(fcpattern);
-      match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+      match = XftFontMatch(drw->dpy, ctx->screen, fcpattern, &result);
 
       FcCharSetDestroy(fccharset);
       FcPatternDestroy(fcpattern);
 
       if (match) {
-        usedfont = xfont_create(drw, 0, match);
+        usedfont = xfont_create(ctx, 0, match);
 
         if (usedfont &&
             XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-          for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+          for (curfont = ctx->fonts; curfont->next; curfont = curfont->next)
             continue;
           curfont->next = usedfont;
 
         } else {
           xfont_free(usedfont);
-          usedfont = drw->fonts;
+          usedfont = ctx->fonts;
+          drw_ctx_add_missing(ctx, utf8codepoint);
         }
-      }
+
+      } else drw_ctx_add_missing(ctx, utf8codepoint);
     }
   }
 
@@ -368,28 +562,66 @@ int drw_text(Drw *drw, int x, int y, unsigned w, unsigned h, unsigned lpad,
 }
 
 
+int drw_text(Drw *drw, int x, int y, unsigned w, unsigned h, unsigned lpad,
+             const char *text, int invert) {
+  pthread_mutex_lock(&font_lock);
+  int ret = text_draw(drw, x, y, w, h, lpad, text, invert);
+  pthread_mutex_unlock(&font_lock);
+
+  return ret;
+}
+
+
 void drw_map(Drw *drw, Window win, int x, int y, unsigned w, unsigned h) {
   if (!drw) return;
-  XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
+  XCopyArea(drw->dpy, drw->drawable, win, drw->ctx->gc, x, y, w, h, x, y);
 }
 
 
 void drw_sync(Drw *drw) {XSync(drw->dpy, False);}
 
 
+/// True if 0xRRGGBB pixels can be uploaded as they are.
+bool drw_ctx_rgb(DrwCtx *ctx) {
+  Visual *visual = DefaultVisual(ctx->dpy, ctx->screen);
+  int depth = DefaultDepth(ctx->dpy, ctx->screen);
+
+  return visual->class == TrueColor && (depth == 24 || depth == 32) &&
+    visual->red_mask == 0xff0000 && visual->green_mask == 0xff00 &&
+    visual->blue_mask == 0xff;
+}
+
+
+/// Uploads a ``w`` by ``h`` image of 0xRRGGBB pixels to the selected buffer.
+/// Xlib splits it in to as many requests as needed.
+void drw_put(Drw *drw, const uint32_t *pixels, unsigned w, unsigned h) {
+  DrwCtx *ctx = drw->ctx;
+  XImage *img =
+    XCreateImage(drw->dpy, DefaultVisual(drw->dpy, ctx->screen),
+                 DefaultDepth(drw->dpy, ctx->screen), ZPixmap, 0,
+                 (char *)pixels, w, h, 32, w * 4);
+  if (!img) return;
+
+  // Pixels are in host order, Xlib swaps them if the server differs
+  int one = 1;
+  img->byte_order = *(char *)&one ? LSBFirst : MSBFirst;
+
+  XPutImage(drw->dpy, drw->drawable, ctx->gc, img, 0, 0, 0, 0, w, h);
+
+  img->data = 0; // Not ours to free
+  XDestroyImage(img);
+}
+
+
 unsigned drw_fontset_getwidth(Drw *drw, const char *text) {
-  if (!drw || !drw->fonts || !text) return 0;
+  if (!drw || !drw->ctx->fonts || !text) return 0;
   return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
 }
 
 
 void drw_font_getexts(Fnt *font, const char *text, unsigned len, unsigned *w,
                       unsigned *h) {
-  XGlyphInfo ext;
-
-  if (!font || !text) return;
-
-  XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
-  if (w) *w = ext.xOff;
-  if (h) *h = font->h;
+  pthread_mutex_lock(&font_lock);
+  font_getexts(font, text, len, w, h);
+  pthread_mutex_unlock(&font_lock);
 }
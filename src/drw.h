@@ -14,6 +14,9 @@
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 
+#include <stdbool.h>
+#include <stdint.h>
+
 
 #define MAX(A, B)               ((A) > (B) ? (A) : (B))
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
@@ -32,24 +35,58 @@ enum {ColFg, ColBg}; // Clr scheme index
 typedef XftColor Clr;
 
 typedef struct {
-  unsigned w, h;
+  char *name;
+  Clr clr;
+} DrwColor;
+
+typedef struct {
+  const char *name;
+  Cursor cursor;
+} DrwCursor;
+
+/// Render state shared by all drawables on a display
+typedef struct {
   Display *dpy;
   int screen;
   Window root;
-  Drawable drawable;
   GC gc;
-  Clr *scheme;
   Fnt *fonts;
+
+  DrwColor *colors;
+  unsigned ncolors;
+  DrwCursor *cursors;
+  unsigned ncursors;
+  long *missing; // Code points no fallback font was found for
+  unsigned nmissing;
+} DrwCtx;
+
+typedef struct {
+  unsigned w, h;
+  Display *dpy;
+  DrwCtx *ctx;
+  Drawable drawable;
+  Drawable *buffers;
+  Picture *pictures; // Of the buffers, made when first composited to
+  unsigned nbuffers;
+  Clr *scheme;
 } Drw;
 
 
+// Shared context
+DrwCtx *drw_ctx_create(Display *dpy, int screen, Window root);
+void drw_ctx_free(DrwCtx *ctx);
+Cursor drw_ctx_cursor(DrwCtx *ctx, const char *name);
+
 // Drawable abstraction
-Drw *drw_create(Display *dpy, int screen, Window win, unsigned w, unsigned h);
+Drw *drw_create(DrwCtx *ctx, unsigned w, unsigned h);
 void drw_resize(Drw *drw, unsigned w, unsigned h);
 void drw_free(Drw *drw);
+void drw_buffers(Drw *drw, unsigned count);
+void drw_select(Drw *drw, unsigned i);
+Picture drw_picture(Drw *drw);
 
 // Fnt abstraction
-Fnt *drw_fontset_create(Drw *drw, const char *fonts[], size_t fontcount);
+Fnt *drw_fontset_create(DrwCtx *ctx, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt *set);
 unsigned drw_fontset_getwidth(Drw *drw, const char *text);
 void drw_font_getexts(Fnt *font, const char *text, unsigned len, unsigned *w,
@@ -58,9 +95,12 @@ void drw_font_getexts(Fnt *font, const char *text, unsigned len, unsigned *w,
 // Colorscheme abstraction
 void drw_clr_create(Drw *drw, Clr *dest, const char *clrname);
 Clr *drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount);
+void drw_scms_create(Drw *drw, Clr *scms[], const char *clrnames[][2],
+                     size_t count);
+uint32_t drw_clr_rgb(const Clr *clr);
 
 // Drawing context manipulation
-void drw_setfontset(Drw *drw, Fnt *set);
+void drw_setfontset(DrwCtx *ctx, Fnt *set);
 void drw_setscheme(Drw *drw, Clr *scm);
 
 // Drawing functions
@@ -72,3 +112,7 @@ int drw_text(Drw *drw, int x, int y, unsigned w, unsigned h, unsigned lpad,
 // Map functions
 void drw_map(Drw *drw, Window win, int x, int y, unsigned w, unsigned h);
 void drw_sync(Drw *drw);
+
+// Client side images
+bool drw_ctx_rgb(DrwCtx *ctx);
+void drw_put(Drw *drw, const uint32_t *pixels, unsigned w, unsigned h);
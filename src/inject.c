@@ -0,0 +1,348 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "inject.h"
+#include "util.h"
+
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include <stdlib.h>
+
+
+#define INJECT_MAX_SPARE 32
+#define INJECT_REMAP_DELAY 20000000 // ns clients get to translate keys
+
+
+typedef enum {InjectChar, InjectPress, InjectRelease} InjectType;
+
+typedef struct {
+  InjectType type;
+  KeySym sym;
+} InjectItem;
+
+
+/// A spare keycode and the keysym it is mapped to
+typedef struct {
+  KeySym sym;
+  uint64_t ready; // When clients have had time to translate its last keys
+  unsigned used; // Order of last use
+} InjectSpare;
+
+
+/// Keys queued on one display.  Spare keycodes are remapped in turn, each
+/// only once the keys last sent with it are confirmed and translated.
+typedef struct Inject {
+  Display *dpy;
+  KeyCode spare_first; // Belongs to inject_simulate(), the rest are spares
+  int spare_count;
+  KeyCode shift;
+
+  // The keyboard mapping, fetched again after a MappingNotify
+  KeySym *syms;
+  int low, high, per;
+
+  InjectSpare spares[INJECT_MAX_SPARE - 1];
+  int nspares;
+  unsigned uses;
+  bool unconfirmed; // Keys sent since the last round trip
+  bool shifted;
+
+  InjectItem *queue;
+  unsigned head, tail;
+  unsigned alloc; // A power of two
+  uint64_t deadline; // For the next remap when stalled
+} Inject;
+
+
+/// Finds the display's run of keycodes with no keysyms.  The first one
+/// belongs to inject_simulate(), the rest are remapped for strings.  Made
+/// once per display session and passed to whatever injects on it.
+Inject *inject_create(Display *dpy) {
+  Inject *inj = calloc(1, sizeof(Inject));
+  inj->dpy = dpy;
+  inj->shift = XKeysymToKeycode(dpy, XK_Shift_L);
+
+  int low, high, per = 0;
+  XDisplayKeycodes(dpy, &low, &high);
+  KeySym *syms = XGetKeyboardMapping(dpy, low, high - low + 1, &per);
+  int start = 0, len = 0;
+
+  for (int i = low; i <= high; i++) {
+    bool empty = true;
+    for (int j = 0; empty && j < per; j++)
+      if (syms[(i - low) * per + j]) empty = false;
+
+    if (!empty) {len = 0; continue;}
+    if (!len++) start = i;
+
+    if (inj->spare_count < len && inj->spare_count < INJECT_MAX_SPARE) {
+      inj->spare_first = start;
+      inj->spare_count = len;
+    }
+  }
+
+  XFree(syms);
+  inj->nspares = inj->spare_count ? inj->spare_count - 1 : 0;
+
+  return inj;
+}
+
+
+void inject_free(Inject *inj) {
+  if (!inj) return;
+  if (inj->syms) XFree(inj->syms);
+  free(inj->queue);
+  free(inj);
+}
+
+
+/// Presses or releases ``keysym``, mapping it to the first spare keycode if
+/// no keycode has it.
+static void inject_simulate(Inject *inj, KeySym keysym, bool press) {
+  if (!keysym) return;
+
+  KeyCode code = XKeysymToKeycode(inj->dpy, keysym);
+
+  if (!code) {
+    if (!inj->spare_count) return;
+    code = inj->spare_first;
+
+    XChangeKeyboardMapping(inj->dpy, code, 1, &keysym, 1);
+    XSync(inj->dpy, false);
+  }
+
+  XTestFakeKeyEvent(inj->dpy, code, press, 0);
+}
+
+
+static int utf8_decode(const char **s) {
+  const unsigned char *p = (const unsigned char *)*s;
+  int len = *p < 0x80 ? 1 : (*p & 0xe0) == 0xc0 ? 2 : (*p & 0xf0) == 0xe0 ? 3 :
+    (*p & 0xf8) == 0xf0 ? 4 : 0;
+
+  if (!len) {(*s)++; return -1;}
+
+  int cp = len == 1 ? *p : *p & (0x7f >> len);
+  for (int i = 1; i < len; i++) {
+    if ((p[i] & 0xc0) != 0x80) {*s += i; return -1;}
+    cp = cp << 6 | (p[i] & 0x3f);
+  }
+
+  *s += len;
+  return cp;
+}
+
+
+static KeySym inject_keysym(int cp) {
+  if (cp == '\n' || cp == '\r') return XK_Return;
+  if (cp == '\t') return XK_Tab;
+  if (cp == '\b') return XK_BackSpace;
+  if (cp < 0x20 || (0x7f <= cp && cp < 0xa0)) return NoSymbol;
+
+  // Latin-1 keysyms equal their code points
+  if (cp <= 0xff) return cp;
+
+  return 0x01000000 | cp;
+}
+
+
+static void inject_map(Inject *inj) {
+  if (inj->syms) return;
+
+  XDisplayKeycodes(inj->dpy, &inj->low, &inj->high);
+  inj->syms = XGetKeyboardMapping(inj->dpy, inj->low,
+                                  inj->high - inj->low + 1, &inj->per);
+}
+
+
+/// An existing keycode for ``sym``, unshifted or shifted, or zero.
+static KeyCode inject_find(Inject *inj, KeySym sym, bool *shifted) {
+  int first = inj->spare_first, end = first + inj->spare_count;
+
+  for (int i = inj->low; i <= inj->high; i++) {
+    if (first <= i && i < end) continue;
+
+    for (int j = 0; j < inj->per && j < 2; j++)
+      if (inj->syms[(i - inj->low) * inj->per + j] == sym) {
+        *shifted = j;
+        return i;
+      }
+  }
+
+  return 0;
+}
+
+
+/// A spare already mapped to ``sym``, or the least recently used one
+/// remapped.  Returns -1 and sets the deadline if it is still in use.
+static int inject_spare(Inject *inj, KeySym sym, uint64_t now) {
+  int lru = 0;
+
+  for (int i = 0; i < inj->nspares; i++) {
+    if (inj->spares[i].sym == sym) return i;
+    if (inj->spares[i].used < inj->spares[lru].used) lru = i;
+  }
+
+  InjectSpare *s = &inj->spares[lru];
+  if (now < s->ready) {
+    inj->deadline = s->ready;
+    return -1;
+  }
+
+  // The server must have the keys sent with it before it is remapped
+  if (s->used && inj->unconfirmed) {
+    XSync(inj->dpy, false);
+    inj->unconfirmed = false;
+  }
+
+  s->sym = sym;
+  XChangeKeyboardMapping(inj->dpy, inj->spare_first + 1 + lru, 1, &sym, 1);
+
+  return lru;
+}
+
+
+static void inject_shift(Inject *inj, bool shifted) {
+  if (inj->shifted == shifted) return;
+  XTestFakeKeyEvent(inj->dpy, inj->shift, shifted, 0);
+  inj->shifted = shifted;
+}
+
+
+/// Sends queued keys until a character needs a spare keycode that clients
+/// may still be translating earlier keys with.
+static void inject_pump(Inject *inj) {
+  Display *dpy = inj->dpy;
+  uint64_t now = get_time_ns();
+  bool sent = false;
+
+  inject_map(inj);
+  inj->deadline = 0;
+
+  for (; inj->head != inj->tail; inj->head++) {
+    InjectItem *item = &inj->queue[inj->head & (inj->alloc - 1)];
+
+    if (item->type != InjectChar) {
+      inject_shift(inj, false);
+      inject_simulate(inj, item->sym, item->type == InjectPress);
+      sent = true;
+      continue;
+    }
+
+    bool shifted = false;
+    KeyCode code = inject_find(inj, item->sym, &shifted);
+    if (shifted && !inj->shift) continue;
+
+    if (!code) {
+      if (!inj->nspares) continue;
+
+      int i = inject_spare(inj, item->sym, now);
+      if (i == -1) break;
+
+      inj->spares[i].used = ++inj->uses;
+      inj->spares[i].ready = now + INJECT_REMAP_DELAY;
+      code = inj->spare_first + 1 + i;
+    }
+
+    inject_shift(inj, shifted);
+    XTestFakeKeyEvent(dpy, code, true, 0);
+    XTestFakeKeyEvent(dpy, code, false, 0);
+    inj->unconfirmed = sent = true;
+  }
+
+  if (inj->head == inj->tail) inject_shift(inj, false);
+  if (sent) XFlush(dpy);
+}
+
+
+static void inject_push(Inject *inj, InjectType type, KeySym sym) {
+  if (inj->tail - inj->head == inj->alloc) {
+    unsigned alloc = inj->alloc ? inj->alloc * 2 : 64;
+    InjectItem *queue = malloc(alloc * sizeof(InjectItem));
+
+    for (unsigned i = inj->head; i != inj->tail; i++)
+      queue[i & (alloc - 1)] = inj->queue[i & (inj->alloc - 1)];
+
+    free(inj->queue);
+    inj->queue = queue;
+    inj->alloc = alloc;
+  }
+
+  inj->queue[inj->tail++ & (inj->alloc - 1)] = (InjectItem){type, sym};
+}
+
+
+/// Types a UTF-8 string.  Keys that need a spare keycode still in use wait
+/// for inject_timers().  Returns the number of characters queued.
+unsigned inject_string(Inject *inj, const char *text) {
+  inject_map(inj);
+  unsigned count = 0;
+
+  while (*text) {
+    KeySym sym = inject_keysym(utf8_decode(&text));
+    if (!sym) continue;
+
+    bool shifted = false;
+    KeyCode code = inject_find(inj, sym, &shifted);
+    if (shifted && !inj->shift) continue;
+
+    if (!code && !inj->nspares) {
+      message("No spare keycode for keysym 0x%lx\n", sym);
+      continue;
+    }
+
+    inject_push(inj, InjectChar, sym);
+    count++;
+  }
+
+  inject_pump(inj);
+
+  return count;
+}
+
+
+/// Presses or releases a key, after any keys still queued.
+void inject_key(Inject *inj, KeySym keysym, bool press) {
+  if (inj->head == inj->tail) inject_simulate(inj, keysym, press);
+  else inject_push(inj, press ? InjectPress : InjectRelease, keysym);
+}
+
+
+/// When queued keys can next be sent, zero if none are waiting.
+uint64_t inject_deadline(Inject *inj) {
+  return inj && inj->head != inj->tail ? inj->deadline : 0;
+}
+
+
+void inject_timers(Inject *inj) {
+  if (inj && inj->head != inj->tail && inj->deadline <= get_time_ns())
+    inject_pump(inj);
+}
+
+
+/// Fetches the mapping again when something other than the spare keycodes
+/// was remapped.
+void inject_event(Inject *inj, XEvent *e) {
+  if (e->type != MappingNotify) return;
+
+  XMappingEvent *ev = &e->xmapping;
+  XRefreshKeyboardMapping(ev);
+
+  if (!inj || ev->request != MappingKeyboard || !inj->syms) return;
+
+  int first = inj->spare_first, end = first + inj->spare_count;
+  if (first <= ev->first_keycode && ev->first_keycode + ev->count <= end)
+    return;
+
+  XFree(inj->syms);
+  inj->syms = 0;
+}
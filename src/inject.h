@@ -0,0 +1,28 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+struct Inject;
+
+struct Inject *inject_create(Display *dpy);
+void inject_free(struct Inject *inj);
+unsigned inject_string(struct Inject *inj, const char *text);
+void inject_key(struct Inject *inj, KeySym keysym, bool press);
+uint64_t inject_deadline(struct Inject *inj);
+void inject_timers(struct Inject *inj);
+void inject_event(struct Inject *inj, XEvent *e);
@@ -11,66 +11,40 @@
 
 #include "keyboard.h"
 
-#include <X11/Xatom.h>
-#include <X11/Xcursor/Xcursor.h>
+#include <X11/XF86keysym.h>
+#include <X11/extensions/XInput2.h>
 
 #include <signal.h>
+#include <ctype.h>
 #include <unistd.h>
 
 
-static int create_window(Display *dpy, int root, const char *name, int w, int h,
-                         int x, int y, unsigned long fg, unsigned long bg) {
-  XSetWindowAttributes wa;
-  wa.border_pixel = fg;
-  wa.background_pixel = bg;
-  wa.backing_store = Always;
+#define KEYBOARD_ROW_HEIGHT 50
+#define KEYBOARD_STRIP_HEIGHT 40
 
-  int win = XCreateWindow
-    (dpy, root, x, y, w, h, 0, CopyFromParent, CopyFromParent, CopyFromParent,
-     CWBorderPixel | CWBackingPixel | CWBackingStore, &wa);
 
-  // Enable window events
-  XSelectInput(dpy, win, StructureNotifyMask | ButtonReleaseMask |
-               ButtonPressMask | ExposureMask | PointerMotionMask |
-               LeaveWindowMask);
+/// A keyboard's own layer back buffers.  Outputs of the same size share
+/// only read-only drawn content, the render context's layer cache or glyph
+/// atlas, never buffers that one keyboard's presses would dirty for another.
+typedef struct KeyboardSurface {
+  void *buffers;
+  int cap_w, cap_h; // Allocated, the keyboard uses the top left
+  int nlayers;
+  int selected; // Buffer drawing goes to, as queued
+} KeyboardSurface;
 
-  // Set window properties
-  XWMHints *wmHints = XAllocWMHints();
-  wmHints->input = false;
-  wmHints->flags = InputHint;
 
-  XTextProperty str;
-  XStringListToTextProperty((char **)&name, 1, &str);
-
-  XClassHint *classHints = XAllocClassHint();
-  classHints->res_class = (char *)name;
-  classHints->res_name = (char *)name;
-
-  XSetWMProperties(dpy, win, &str, &str, 0, 0, 0, wmHints, classHints);
-
-  XFree(classHints);
-  XFree(wmHints);
-  XFree(str.value);
-
-  // Set window type
-  Atom atom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", false);
-  Atom type = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DOCK", false);
-  XChangeProperty(dpy, win, atom, XA_ATOM, 32, PropModeReplace,
-                  (unsigned char *)&type, 1);
+static bool is_modifier(Key *k) {return k && IsModifierKey(k->keysym);}
 
-  // Set cursor
-  Cursor c = XcursorLibraryLoadCursor(dpy, "hand1");
-  XDefineCursor(dpy, win, c);
 
-  return win;
+static Layer *keyboard_layer(Keyboard *kbd) {
+  return &kbd->layout->layers[kbd->layer];
 }
 
 
-static bool is_modifier(Key *k) {return k && IsModifierKey(k->keysym);}
-
-
 static int key_scheme(Keyboard *kbd, Key *k) {
-  if (k->pressed || (kbd->shift && k->keysym == XK_Shift_L) ||
+  if (k->pressed || k == kbd->popup.key ||
+      (kbd->shift && k->keysym == XK_Shift_L) ||
       (kbd->meta && k->keysym == XK_Cancel))
     return SchemePress;
 
@@ -84,79 +58,414 @@ static int key_scheme(Keyboard *kbd, Key *k) {
 
 
 Key *keyboard_find_key(Keyboard *kbd, int x, int y) {
+  Layer *layer = keyboard_layer(kbd);
 
-  for (int r = 0; r < kbd->rows; r++) {
-    Key *keys = kbd->keys[r];
+  if (x < layer->x || y < layer->y || !layer->w || !layer->h) return 0;
 
-    for (int c = 0; keys[c].keysym; c++)
-      if (keys[c].x < x && x < keys[c].x + keys[c].w &&
-          keys[c].y < y && y < keys[c].y + keys[c].h)
-        return &keys[c];
-  }
+  int gx = (x - layer->x) * LAYOUT_HIT_GRID / layer->w;
+  int gy = (y - layer->y) * LAYOUT_HIT_GRID / layer->h;
+  int gw = layer->cols * LAYOUT_HIT_GRID;
+  if (layer->rows * LAYOUT_HIT_GRID <= gy || gw <= gx) return 0;
+
+  Key *k = layer->hits[gy * gw + gx];
+
+  // Learned targets already decide the space between keys
+  if (kbd->adapt) return k;
+
+  // Exclude the space between keys
+  if (k && k->x < x && x < k->x + k->w && k->y < y && y < k->y + k->h)
+    return k;
 
   return 0;
 }
 
 
-void keyboard_draw_key(Keyboard *kbd, Key *k) {
-  Drw *drw = kbd->drw;
+/// Learns where ``k`` is touched.  The hit-test table is refolded by
+/// keyboard_prerender() rather than while handling input.
+static void keyboard_adapt(Keyboard *kbd, Key *k, int x, int y) {
+  Layer *layer = keyboard_layer(kbd);
+  if (!kbd->adapt || is_modifier(k) || !layer->w || !layer->h) return;
+
+  float ux = (float)(x - layer->x) / layer->w;
+  float uy = (float)(y - layer->y) / layer->h;
+
+  if (adapt_touch(kbd->adapt, layer, k, ux, uy)) layer->hits_dirty = true;
+}
+
+
+static void keyboard_select_buffer(Keyboard *kbd, int i) {
+  kbd->backend->select(kbd, i);
+  kbd->surface->selected = i;
+}
+
+
+/// Points drawing at the selected layer's buffer.
+static void keyboard_use_buffer(Keyboard *kbd) {
+  if (kbd->surface->selected != kbd->layer)
+    keyboard_select_buffer(kbd, kbd->layer);
+}
 
-  drw_setscheme(drw, kbd->scheme[key_scheme(kbd, k)]);
-  drw_rect(drw, k->x, k->y, k->w, k->h, 1, 1);
 
+static const char *keyboard_key_label(Keyboard *kbd, Key *k) {
   const char *label = k->label;
   if (!label) label = XKeysymToString(k->keysym);
   if (kbd->shift && k->label2) label = k->label2;
+  return label ? label : "";
+}
+
 
-  int h = drw->fonts[0].xfont->height * 2;
-  int y = k->y + (k->h - h) / 2;
-  int w = drw_fontset_getwidth(drw, label);
-  int x = k->x + (k->w - w) / 2;
-  drw_text(drw, x, y, w, h, 0, label, 0);
+static void keyboard_render_key(Keyboard *kbd, Key *k, bool map) {
+  const char *label = keyboard_key_label(kbd, k);
 
-  drw_map(drw, kbd->win, k->x, k->y, k->w, k->h);
+  keyboard_use_buffer(kbd);
+  kbd->backend->text(kbd, k->x, k->y, k->w, k->h,
+                     kbd->scheme[key_scheme(kbd, k)], label, map);
 }
 
 
-void keyboard_draw(Keyboard *kbd) {
-  drw_setscheme(kbd->drw, kbd->scheme[SchemeBG]);
-  drw_rect(kbd->drw, 0, 0, kbd->w, kbd->h, 1, 1);
-  drw_map(kbd->drw, kbd->win, 0, 0, kbd->w, kbd->h);
+/// Renders ``k`` and presents it if the keyboard is shown.  While hidden the
+/// back buffer is kept current so showing needs no rendering.
+void keyboard_draw_key(Keyboard *kbd, Key *k) {
+  keyboard_render_key(kbd, k, kbd->visible);
+}
+
 
-  for (int r = 0; r < kbd->rows; r++)
-    for (int c = 0; kbd->keys[r][c].keysym; c++)
-      keyboard_draw_key(kbd, &kbd->keys[r][c]);
+/// Hides the alternates or stops waiting for a long press, without typing.
+static void keyboard_popup_close(Keyboard *kbd) {
+  KeyboardPopup *p = &kbd->popup;
+  Key *k = p->key;
+  if (!k) return;
+
+  if (p->open) kbd->backend->popup_hide(kbd);
+  p->key = 0;
+  p->open = false;
+  keyboard_draw_key(kbd, k);
 }
 
 
-void keyboard_layout(Keyboard *kbd) {
-  int w = (kbd->w - kbd->space) / kbd->cols;
-  int h = (kbd->h - kbd->space) / kbd->rows;
-  int y = (kbd->h - h * kbd->rows + kbd->space) / 2;
-  int xOffset = (kbd->w - w * kbd->cols + kbd->space) / 2;
+static void keyboard_map_rect(Keyboard *kbd, int x, int y, int w, int h) {
+  keyboard_use_buffer(kbd);
+  kbd->backend->present(kbd, x, y, w, h);
+}
+
+
+static void keyboard_map(Keyboard *kbd) {
+  keyboard_map_rect(kbd, 0, 0, kbd->w, kbd->h);
+}
+
+
+/// Renders the suggestion strip in to the selected layer's back buffer.
+static void keyboard_render_strip(Keyboard *kbd, bool map) {
+  if (!kbd->strip) return;
+  keyboard_use_buffer(kbd);
+
+  const Backend *be = kbd->backend;
+  be->fill(kbd, 0, 0, kbd->w, kbd->strip, kbd->scheme[SchemeBG]);
+
+  int w = kbd->w / DICT_MAX_RESULTS;
+  for (int i = 0; i < kbd->nsuggestions; i++)
+    be->text(kbd, i * w + kbd->space, kbd->space, w - kbd->space,
+             kbd->strip - kbd->space, kbd->scheme[SchemeNorm],
+             kbd->suggestions[i], false);
+
+  if (map) be->present(kbd, 0, 0, kbd->w, kbd->strip);
+}
+
+
+static void keyboard_tile(RasterTile *t, int x, int y, int w, int h,
+                          Clr *scheme, const char *label) {
+  t->x = x;
+  t->y = y;
+  t->w = w;
+  t->h = h;
+  t->fg = drw_clr_rgb(&scheme[ColFg]);
+  t->bg = drw_clr_rgb(&scheme[ColBg]);
+  snprintf(t->label, sizeof(t->label), "%s", label);
+}
+
+
+/// Describes the selected layer's keys and suggestions as tiles.  Returns
+/// how many there are, which may be more than ``max``.
+int keyboard_tiles(Keyboard *kbd, RasterTile *tiles, int max) {
+  Layer *layer = keyboard_layer(kbd);
+  int n = 0;
+
+  for (int r = 0; r < layer->rows; r++)
+    for (int c = 0; layer->keys[r][c].keysym; c++, n++) {
+      Key *k = &layer->keys[r][c];
+      if (n < max)
+        keyboard_tile(&tiles[n], k->x, k->y, k->w, k->h,
+                      kbd->scheme[key_scheme(kbd, k)],
+                      keyboard_key_label(kbd, k));
+    }
+
+  int w = kbd->w / DICT_MAX_RESULTS;
+  for (int i = 0; kbd->strip && i < kbd->nsuggestions; i++, n++)
+    if (n < max)
+      keyboard_tile(&tiles[n], i * w + kbd->space, kbd->space, w - kbd->space,
+                    kbd->strip - kbd->space, kbd->scheme[SchemeNorm],
+                    kbd->suggestions[i]);
+
+  return n;
+}
+
+
+/// Draws the selected layer as one set of tiles if the backend can.
+static bool keyboard_render_tiles(Keyboard *kbd) {
+  if (!kbd->backend->tiles) return false;
+
+  int n = keyboard_tiles(kbd, 0, 0);
+  RasterTile *tiles = malloc(n * sizeof(RasterTile));
+  keyboard_tiles(kbd, tiles, n);
+
+  uint32_t bg = drw_clr_rgb(&kbd->scheme[SchemeBG][ColBg]);
+  bool ok = kbd->backend->tiles(kbd, bg, tiles, n);
+  free(tiles);
+
+  return ok;
+}
+
+
+/// Renders the selected layer in to its back buffer.
+static void keyboard_render(Keyboard *kbd) {
+  Layer *layer = keyboard_layer(kbd);
+  keyboard_use_buffer(kbd);
+
+  if (!keyboard_render_tiles(kbd)) {
+    kbd->backend->fill(kbd, 0, 0, kbd->w, kbd->h, kbd->scheme[SchemeBG]);
+
+    for (int r = 0; r < layer->rows; r++)
+      for (int c = 0; layer->keys[r][c].keysym; c++)
+        keyboard_render_key(kbd, &layer->keys[r][c], false);
+
+    keyboard_render_strip(kbd, false);
+  }
+
+  layer->dirty = false;
+}
 
-  for (int r = 0; r < kbd->rows; r++) {
-    Key *keys = kbd->keys[r];
-    int x = xOffset;
+
+void keyboard_draw(Keyboard *kbd) {
+  keyboard_render(kbd);
+  keyboard_map(kbd);
+}
+
+
+static void keyboard_layout_layer(Keyboard *kbd, Layer *layer) {
+  if (kbd->adapt) adapt_fold(kbd->adapt, layer);
+
+  int w = layer->w = (kbd->w - kbd->space) / layer->cols;
+  int rows_h = kbd->h - kbd->strip;
+  int h = layer->h = (rows_h - kbd->space) / layer->rows;
+  int y = layer->y = kbd->strip + (rows_h - h * layer->rows + kbd->space) / 2;
+  layer->x = (kbd->w - w * layer->cols + kbd->space) / 2;
+
+  for (int r = 0; r < layer->rows; r++) {
+    Key *keys = layer->keys[r];
 
     for (int c = 0; keys[c].keysym; c++) {
-      keys[c].x = x;
+      keys[c].x = layer->x + keys[c].col * w;
       keys[c].y = y;
       keys[c].w = keys[c].width * w - kbd->space;
       keys[c].h = h - kbd->space;
-      x += keys[c].w + kbd->space;
     }
 
     y += h;
   }
+}
+
 
-  keyboard_draw(kbd);
+/// Presents the selected layer, rendering it first if it is stale.
+static void keyboard_present(Keyboard *kbd) {
+  if (keyboard_layer(kbd)->dirty) keyboard_render(kbd);
+  keyboard_map(kbd);
+}
+
+
+/// Lays out every layer.  Rendering is deferred until the keyboard is shown.
+void keyboard_layout(Keyboard *kbd) {
+  keyboard_popup_close(kbd);
+  int popup_w = 0, popup_h = 0;
+
+  for (int i = 0; i < kbd->layout->nlayers; i++) {
+    Layer *layer = &kbd->layout->layers[i];
+    keyboard_layout_layer(kbd, layer);
+    layer->dirty = true;
+
+    popup_w = MAX(popup_w, LAYOUT_ALTS_MAX * layer->w + kbd->space);
+    popup_h = MAX(popup_h, layer->h + kbd->space);
+  }
+
+  kbd->backend->popup_reserve(kbd, popup_w, popup_h);
+
+  if (kbd->visible) keyboard_present(kbd);
+}
+
+
+/// Redraws every layer, after the render queue dropped some of the drawing.
+void keyboard_redraw(Keyboard *kbd) {
+  for (int i = 0; i < kbd->layout->nlayers; i++)
+    kbd->layout->layers[i].dirty = true;
+
+  if (kbd->visible) keyboard_present(kbd);
+}
+
+
+/// Renders stale layers other than the selected one so that switching
+/// layers is only a present of the layer's back buffer.
+void keyboard_prerender(Keyboard *kbd) {
+  int current = kbd->layer;
+
+  for (int i = 0; i < kbd->layout->nlayers; i++) {
+    Layer *layer = &kbd->layout->layers[i];
+    if (kbd->adapt && layer->hits_dirty) adapt_fold(kbd->adapt, layer);
+  }
+
+  for (int i = 0; i < kbd->layout->nlayers; i++)
+    if (i != current && kbd->layout->layers[i].dirty) {
+      kbd->layer = i;
+      keyboard_render(kbd);
+    }
+
+  kbd->layer = current;
+}
+
+
+static void keyboard_release_key(Keyboard *kbd, Key *k) {
+  if (!k->pressed) return;
+  if (!k->text) kbd->backend->inject_key(kbd, k->keysym, false);
+  k->pressed = false;
+}
+
+
+static KeyboardTouch *keyboard_touch_find(Keyboard *kbd, int64_t id) {
+  for (int i = 0; i < KEYBOARD_MAX_TOUCHES; i++)
+    if (kbd->touches[i].active && kbd->touches[i].id == id)
+      return &kbd->touches[i];
+
+  return 0;
+}
+
+
+/// Lets go of every key held by a touch.  The touches stay active.
+static bool keyboard_touch_drop(Keyboard *kbd) {
+  bool dropped = false;
+
+  for (int i = 0; i < KEYBOARD_MAX_TOUCHES; i++) {
+    KeyboardTouch *t = &kbd->touches[i];
+
+    if (t->key) {
+      keyboard_release_key(kbd, t->key);
+      t->key = 0;
+      dropped = true;
+    }
+  }
+
+  return dropped;
+}
+
+
+void keyboard_select_layer(Keyboard *kbd, int layer) {
+  if (layer == kbd->layer || kbd->layout->nlayers <= layer) return;
+  keyboard_popup_close(kbd);
+
+  // Modifiers stay held across layers
+  bool dropped = keyboard_touch_drop(kbd);
+  if (dropped || kbd->focus) keyboard_layer(kbd)->dirty = true;
+  kbd->focus = 0;
+
+  kbd->layer = layer;
+  keyboard_present(kbd);
+
+  // Suggestions may have changed since this layer was rendered
+  keyboard_render_strip(kbd, true);
+}
+
+
+static void keyboard_suggest(Keyboard *kbd) {
+  if (!kbd->dict || (!kbd->wordlen && !kbd->nsuggestions)) return;
+
+  kbd->nsuggestions = kbd->wordlen ?
+    dict_complete(kbd->dict, kbd->word, kbd->suggestions, DICT_MAX_RESULTS) :
+    0;
+
+  keyboard_render_strip(kbd, kbd->visible);
+}
+
+
+/// Follows the word being typed from the keys sent.
+static void keyboard_track(Keyboard *kbd, KeySym keysym) {
+  if (!kbd->dict) return;
+
+  if ((XK_a <= keysym && keysym <= XK_z) || keysym == XK_apostrophe) {
+    if (kbd->wordlen < DICT_WORD_MAX - 1) kbd->word[kbd->wordlen++] = keysym;
+
+  } else if (keysym == XK_BackSpace) {
+    if (kbd->wordlen) kbd->wordlen--;
+
+  } else kbd->wordlen = 0;
+
+  kbd->word[kbd->wordlen] = 0;
+  keyboard_suggest(kbd);
+}
+
+
+/// Types ``word`` followed by a space and starts a new word.
+static void keyboard_insert(Keyboard *kbd, const char *word) {
+  char text[DICT_WORD_MAX + 1];
+  snprintf(text, sizeof(text), "%s ", word);
+  keyboard_type(kbd, text);
+
+  kbd->wordlen = 0;
+  kbd->word[0] = 0;
+  keyboard_suggest(kbd);
+}
+
+
+/// Types the rest of a suggested word.
+static void keyboard_commit(Keyboard *kbd, int i) {
+  if (0 <= i && i < kbd->nsuggestions)
+    keyboard_insert(kbd, kbd->suggestions[i] + kbd->wordlen);
+}
+
+
+/// Types a UTF-8 string.  A latched shift is lifted while typing.
+unsigned keyboard_type(Keyboard *kbd, const char *text) {
+  const Backend *be = kbd->backend;
+
+  if (kbd->shift) be->inject_key(kbd, XK_Shift_L, false);
+  unsigned count = be->inject_string(kbd, text);
+  if (kbd->shift) be->inject_key(kbd, XK_Shift_L, true);
+
+  return count;
+}
+
+
+/// Pastes a snippet through the clipboard with a single Ctrl+V.
+bool keyboard_paste(Keyboard *kbd, const char *text) {
+  if (!kbd->clip || !clip_set(kbd->clip, text)) return false;
+
+  const Backend *be = kbd->backend;
+  if (kbd->shift) be->inject_key(kbd, XK_Shift_L, false);
+  be->inject_key(kbd, XK_Control_L, true);
+  be->inject_key(kbd, XK_v, true);
+  be->inject_key(kbd, XK_v, false);
+  be->inject_key(kbd, XK_Control_L, false);
+  if (kbd->shift) be->inject_key(kbd, XK_Shift_L, true);
+  be->flush(kbd);
+
+  return true;
 }
 
 
 void keyboard_press_key(Keyboard *kbd, Key *k) {
   if (k->pressed) return;
 
+  if (k->keysym == XK_Mode_switch) {
+    keyboard_select_layer(kbd, k->layer);
+    return;
+  }
+
   if (k->keysym == XK_Cancel) {
     kbd->meta = !kbd->meta;
     keyboard_draw_key(kbd, k);
@@ -165,93 +474,495 @@ void keyboard_press_key(Keyboard *kbd, Key *k) {
 
   if (k->keysym == XK_Shift_L) {
     kbd->shift = !kbd->shift;
-    simulate_key(kbd->drw->dpy, XK_Shift_L, kbd->shift);
+    kbd->backend->inject_key(kbd, XK_Shift_L, kbd->shift);
+
+    // Other layers are redrawn by keyboard_prerender()
+    for (int i = 0; i < kbd->layout->nlayers; i++)
+      kbd->layout->layers[i].dirty = true;
+
     keyboard_draw(kbd);
     return;
   }
 
   if (!is_modifier(k) && kbd->meta) {
-    simulate_key(kbd->drw->dpy, XK_Super_L, true);
-    usleep(100000);
-    simulate_key(kbd->drw->dpy, XK_Super_L, false);
-    usleep(100000);
+    const Backend *be = kbd->backend;
+    be->inject_key(kbd, XK_Super_L, true);
+    if (be->modifier_delay_us) usleep(be->modifier_delay_us);
+    be->inject_key(kbd, XK_Super_L, false);
+    if (be->modifier_delay_us) usleep(be->modifier_delay_us);
     kbd->meta = false;
     keyboard_draw(kbd);
   }
 
-  simulate_key(kbd->drw->dpy, k->keysym, true);
+  if (k->text) {
+    if (k->keysym != XF86XK_Paste || !keyboard_paste(kbd, k->text))
+      keyboard_type(kbd, k->text);
+
+  } else kbd->backend->inject_key(kbd, k->keysym, true);
   k->pressed = true;
   keyboard_draw_key(kbd, k);
+
+  if (!is_modifier(k)) keyboard_track(kbd, k->text ? 0 : k->keysym);
 }
 
 
 void keyboard_unpress_key(Keyboard *kbd, Key *k) {
   if (!k->pressed) return;
 
-  simulate_key(kbd->drw->dpy, k->keysym, false);
-  k->pressed = false;
+  keyboard_release_key(kbd, k);
   keyboard_draw_key(kbd, k);
 }
 
 
 void keyboard_unpress_all(Keyboard *kbd) {
-  for (int r = 0; r < kbd->rows; r++)
-    for (int c = 0; kbd->keys[r][c].keysym; c++)
-      keyboard_unpress_key(kbd, &kbd->keys[r][c]);
+  for (int i = 0; i < kbd->layout->nlayers; i++) {
+    Layer *layer = &kbd->layout->layers[i];
+
+    for (int r = 0; r < layer->rows; r++)
+      for (int c = 0; layer->keys[r][c].keysym; c++) {
+        Key *k = &layer->keys[r][c];
+
+        if (i == kbd->layer) keyboard_unpress_key(kbd, k);
+        else if (k->pressed) {
+          keyboard_release_key(kbd, k);
+          layer->dirty = true;
+        }
+      }
+  }
+}
+
+
+/// Presses ``k`` for touch ``t``.  A key held by another touch is released
+/// first so every press has its own release.
+static void keyboard_touch_press(Keyboard *kbd, KeyboardTouch *t, Key *k) {
+  for (int i = 0; i < KEYBOARD_MAX_TOUCHES; i++)
+    if (kbd->touches[i].key == k) {
+      keyboard_unpress_key(kbd, k);
+      kbd->touches[i].key = 0;
+    }
+
+  keyboard_press_key(kbd, k);
+
+  // Switching layers lets go of held keys
+  if (k->pressed) t->key = k;
+
+  // Keystroke latency, until the injected key leaves for the X server
+  if (k->pressed && kbd->event_start) {
+    kbd->backend->flush(kbd);
+
+    uint64_t ns = get_time_ns() - kbd->event_start;
+    kbd->keystrokes++;
+    kbd->keystroke_total_ns += ns;
+    if (kbd->keystroke_max_ns < ns) kbd->keystroke_max_ns = ns;
+  }
+}
+
+
+/// Waits to tell a tap on ``k`` from a long press, showing it pressed.
+static void keyboard_popup_wait(Keyboard *kbd, Key *k, int64_t id, int x,
+                                int y, bool swiping) {
+  KeyboardPopup *p = &kbd->popup;
+
+  p->key = k;
+  p->touch = id;
+  p->tx = x;
+  p->ty = y;
+  p->swiping = swiping;
+  p->open = false;
+  p->deadline = kbd->backend->clock(kbd) + KEYBOARD_LONG_PRESS_NS;
+
+  keyboard_draw_key(kbd, k);
+}
+
+
+/// Ends a wait as a tap, which the touch holds until lifted.
+static void keyboard_popup_tap(Keyboard *kbd) {
+  KeyboardPopup *p = &kbd->popup;
+  if (!p->key || p->open) return;
+
+  Key *k = p->key;
+  KeyboardTouch *t = keyboard_touch_find(kbd, p->touch);
+  p->key = 0;
+
+  if (t && !p->swiping) keyboard_touch_press(kbd, t, k);
+  else keyboard_draw_key(kbd, k);
+}
+
+
+/// Returns the alternate under a touch, or -1 once it slides below the key.
+static int keyboard_popup_pick(Keyboard *kbd, int x, int y) {
+  KeyboardPopup *p = &kbd->popup;
+  BackendPopup *v = &p->view;
+
+  if (p->key->y + p->key->h + v->cell_h < y) return -1;
+  if (x < p->x) return 0;
+  return MIN(v->n - 1, (x - p->x) / v->cell_w);
+}
+
+
+static void keyboard_popup_show(Keyboard *kbd) {
+  KeyboardPopup *p = &kbd->popup;
+  kbd->backend->popup_show(kbd, kbd->x + p->x, kbd->y + p->y, &p->view);
+  kbd->backend->flush(kbd);
+}
+
+
+/// Offers the waiting key's alternates in a row above it.  The window and
+/// its buffer already exist, so this only draws and maps.
+static void keyboard_popup_open(Keyboard *kbd) {
+  KeyboardPopup *p = &kbd->popup;
+  BackendPopup *v = &p->view;
+  Layer *layer = keyboard_layer(kbd);
+  Key *k = p->key;
+
+  // The touch is no longer a tap or a gesture
+  if (p->swiping) {
+    if (swipe_is_gesture(kbd->swipe)) {
+      keyboard_popup_close(kbd);
+      return;
+    }
+
+    kbd->swiping = 0;
+  }
+
+  v->n = 0;
+  for (const char *s = k->alts; *s && v->n < LAYOUT_ALTS_MAX;) {
+    int len = strcspn(s, " ");
+    snprintf(v->labels[v->n++], LAYOUT_ALT_MAX, "%.*s", len, s);
+    s += len + strspn(s + len, " ");
+  }
+
+  v->cell_w = layer->w;
+  v->cell_h = layer->h;
+  v->space = kbd->space;
+  v->scheme = kbd->scheme[SchemeNormABC];
+  v->press = kbd->scheme[SchemePress];
+  v->bg = kbd->scheme[SchemeBG];
+
+  int w = v->n * v->cell_w + v->space;
+  p->x = MAX(0, MIN(k->x + k->w / 2 - w / 2, kbd->w - w));
+  p->y = k->y - v->cell_h - v->space;
+  p->open = true;
+  p->opens++;
+  v->selected = keyboard_popup_pick(kbd, p->tx, p->ty);
+
+  keyboard_popup_show(kbd);
+}
+
+
+static void keyboard_popup_select(Keyboard *kbd, int x, int y) {
+  KeyboardPopup *p = &kbd->popup;
+  int i = keyboard_popup_pick(kbd, x, y);
+
+  if (i != p->view.selected) {
+    p->view.selected = i;
+    keyboard_popup_show(kbd);
+  }
+}
+
+
+/// Types the selected alternate, if any, and closes the popup.
+static void keyboard_popup_commit(Keyboard *kbd) {
+  KeyboardPopup *p = &kbd->popup;
+  int i = p->view.selected;
+
+  if (0 <= i) {
+    keyboard_type(kbd, p->view.labels[i]);
+    keyboard_track(kbd, 0);
+    p->commits++;
+  }
+
+  keyboard_popup_close(kbd);
+}
+
+
+/// When keyboard_timers() next has something to do, zero for never.  On
+/// the backend's clock.
+uint64_t keyboard_deadline(Keyboard *kbd) {
+  KeyboardPopup *p = &kbd->popup;
+  return p->key && !p->open ? p->deadline : 0;
+}
+
+
+/// Run by the event loop once the deadline has passed.
+void keyboard_timers(Keyboard *kbd) {
+  uint64_t deadline = keyboard_deadline(kbd);
+  if (deadline && deadline <= kbd->backend->clock(kbd))
+    keyboard_popup_open(kbd);
+}
+
+
+/// Types the key a gesture started on as a tap and holds it for the touch.
+static void keyboard_swipe_tap(Keyboard *kbd, KeyboardTouch *t) {
+  Key *k = kbd->swiping;
+  SwipePoint *p = &kbd->swipe->points[0];
+
+  kbd->swiping = 0;
+  keyboard_adapt(kbd, k, p->x, p->y);
+  keyboard_touch_press(kbd, t, k);
+}
+
+
+static void keyboard_swipe_end(Keyboard *kbd, KeyboardTouch *t, int x,
+                               int y) {
+  swipe_add(kbd->swipe, x, y);
+
+  if (swipe_is_gesture(kbd->swipe)) {
+    kbd->swiping = 0;
+
+    char word[DICT_WORD_MAX];
+    if (swipe_decode(kbd->swipe, kbd->dict, word))
+      keyboard_insert(kbd, word);
+
+  } else keyboard_swipe_tap(kbd, t);
+}
+
+
+void keyboard_touch_begin(Keyboard *kbd, int64_t id, int x, int y) {
+  // A reused ID means the end of the earlier touch was missed
+  KeyboardTouch *t = keyboard_touch_find(kbd, id);
+  if (t) {
+    keyboard_touch_end(kbd, id, x, y);
+    kbd->touch_lost++;
+  }
+
+  for (int i = 0; i < KEYBOARD_MAX_TOUCHES && !t; i++)
+    if (!kbd->touches[i].active) t = &kbd->touches[i];
+
+  if (!t) {
+    kbd->touch_lost++;
+    return;
+  }
+
+  t->active = true;
+  t->id = id;
+  t->key = 0;
+  kbd->touch_begins++;
+
+  // Another finger landing means a pending tap was not a gesture, so type it
+  // now to keep presses in order
+  KeyboardTouch *swiper = kbd->swiping ?
+    keyboard_touch_find(kbd, kbd->swipe_id) : 0;
+  if (swiper && !swipe_is_gesture(kbd->swipe)) keyboard_swipe_tap(kbd, swiper);
+
+  // Likewise for a key waiting for a long press, open alternates are dropped
+  keyboard_popup_tap(kbd);
+  keyboard_popup_close(kbd);
+
+  if (y < kbd->strip) {
+    keyboard_commit(kbd, x * DICT_MAX_RESULTS / kbd->w);
+    return;
+  }
+
+  Key *k = keyboard_find_key(kbd, x, y);
+  if (!k) return;
+
+  // Letters wait for the release to tell a tap from a gesture
+  if (!kbd->swiping && kbd->swipe && kbd->dict && XK_a <= k->keysym &&
+      k->keysym <= XK_z) {
+    swipe_begin(kbd->swipe, keyboard_layer(kbd), x, y);
+    kbd->swiping = k;
+    kbd->swipe_id = id;
+    if (k->alts) keyboard_popup_wait(kbd, k, id, x, y, true);
+    return;
+  }
+
+  keyboard_adapt(kbd, k, x, y);
+
+  if (is_modifier(k)) {
+    if (k->pressed) keyboard_unpress_key(kbd, k);
+    else keyboard_press_key(kbd, k);
+
+  } else if (k->alts) keyboard_popup_wait(kbd, k, id, x, y, false);
+  else keyboard_touch_press(kbd, t, k);
+}
+
+
+void keyboard_touch_update(Keyboard *kbd, int64_t id, int x, int y) {
+  KeyboardTouch *t = keyboard_touch_find(kbd, id);
+  if (!t) return;
+
+  KeyboardPopup *p = &kbd->popup;
+  bool waiting = p->key && p->touch == id;
+  if (waiting) {
+    p->tx = x;
+    p->ty = y;
+  }
+
+  if (waiting && p->open) {
+    keyboard_popup_select(kbd, x, y);
+    return;
+  }
+
+  if (kbd->swiping && kbd->swipe_id == id) {
+    swipe_add(kbd->swipe, x, y);
+    if (waiting && swipe_is_gesture(kbd->swipe)) keyboard_popup_close(kbd);
+    return;
+  }
+
+  // Sliding off a key waiting for a long press types it
+  if (waiting && keyboard_find_key(kbd, x, y) != p->key)
+    keyboard_popup_tap(kbd);
+
+  // Sliding off a key lets go of it and presses the key slid onto
+  if (!t->key) return;
+  Key *k = keyboard_find_key(kbd, x, y);
+  if (k == t->key) return;
+
+  keyboard_unpress_key(kbd, t->key);
+  t->key = 0;
+
+  if (k && !is_modifier(k)) keyboard_touch_press(kbd, t, k);
+}
+
+
+void keyboard_touch_end(Keyboard *kbd, int64_t id, int x, int y) {
+  KeyboardTouch *t = keyboard_touch_find(kbd, id);
+
+  if (!t) {
+    kbd->touch_lost++;
+    return;
+  }
+
+  KeyboardPopup *p = &kbd->popup;
+  if (p->key && p->touch == id) {
+    if (p->open) keyboard_popup_commit(kbd);
+    else keyboard_popup_tap(kbd);
+  }
+
+  if (kbd->swiping && kbd->swipe_id == id) keyboard_swipe_end(kbd, t, x, y);
+  if (t->key) keyboard_unpress_key(kbd, t->key);
+
+  t->active = false;
+  t->key = 0;
+  kbd->touch_ends++;
 }
 
 
 void keyboard_mouse_motion(Keyboard *kbd, XMotionEvent *e) {
+  // Leaving the window lets go of the key under the pointer
+  if (keyboard_touch_find(kbd, KEYBOARD_POINTER))
+    keyboard_touch_update(kbd, KEYBOARD_POINTER, e ? e->x : -1,
+                          e ? e->y : -1);
+
   Key *k = e ? keyboard_find_key(kbd, e->x, e->y) : 0;
   Key *focus = kbd->focus;
 
   if (k == focus) return;
   kbd->focus = k;
 
-  if (focus && !is_modifier(focus))
-    keyboard_unpress_key(kbd, focus);
-
-  if (k && kbd->pressed && !is_modifier(k))
-    keyboard_press_key(kbd, k);
-
   if (k) keyboard_draw_key(kbd, k);
   if (focus) keyboard_draw_key(kbd, focus);
 }
 
 
-void keyboard_mouse_press(Keyboard *kbd, XButtonEvent *e) {
-  Key *k = keyboard_find_key(kbd, e->x, e->y);
-  if (k) {
-    if (is_modifier(k)) {
-      if (k->pressed) keyboard_unpress_key(kbd, k);
-      else keyboard_press_key(kbd, k);
+static void keyboard_xi_event(Keyboard *kbd, XGenericEventCookie *cookie) {
+  if (cookie->extension != kbd->xi_opcode || !cookie->data) return;
 
-    } else {
-      keyboard_press_key(kbd, k);
-      kbd->pressed = k;
-    }
+  XIDeviceEvent *e = (XIDeviceEvent *)cookie->data;
+  if (e->event != kbd->win) return;
+
+  int x = e->event_x;
+  int y = e->event_y;
+  kbd->event_start = get_time_ns();
+
+  switch (cookie->evtype) {
+  case XI_TouchBegin:  keyboard_touch_begin(kbd, e->detail, x, y);  break;
+  case XI_TouchUpdate: keyboard_touch_update(kbd, e->detail, x, y); break;
+  case XI_TouchEnd:    keyboard_touch_end(kbd, e->detail, x, y);    break;
   }
+
+  kbd->event_start = 0;
 }
 
 
-void keyboard_mouse_release(Keyboard *kbd, XButtonEvent *e) {
-  if (kbd->pressed) {
-    keyboard_unpress_key(kbd, kbd->pressed);
-    kbd->pressed = 0;
+static void keyboard_surface_release(Keyboard *kbd) {
+  KeyboardSurface *s = kbd->surface;
+  if (!s) return;
+
+  kbd->surface = 0;
+  kbd->buffers = 0;
+  kbd->backend->buffers_free(s->buffers);
+  free(s);
+}
+
+
+/// Fits the back buffers to the keyboard's size and layer count.  They only
+/// grow, so a smaller or rotated keyboard keeps them.  Called with the
+/// backend locked.
+static void keyboard_surface_acquire(Keyboard *kbd) {
+  int n = kbd->layout->nlayers;
+  KeyboardSurface *s = kbd->surface;
+  const Backend *be = kbd->backend;
+
+  if (!s) {
+    s = kbd->surface = calloc(1, sizeof(KeyboardSurface));
+    s->cap_w = MAX(kbd->w, kbd->pool_w);
+    s->cap_h = kbd->h;
+    s->nlayers = n;
+    s->buffers = kbd->buffers = be->buffers_create(kbd, s->cap_w, s->cap_h, n);
+    kbd->buffer_allocs++;
+    return;
   }
+
+  if (s->cap_w < kbd->w || s->cap_h < kbd->h || s->nlayers != n) {
+    s->cap_w = MAX(s->cap_w, MAX(kbd->w, kbd->pool_w));
+    s->cap_h = MAX(s->cap_h, kbd->h);
+    be->buffers_resize(s->buffers, s->cap_w, s->cap_h, n);
+    kbd->buffer_allocs++;
+  }
+
+  if (s->nlayers != n) s->selected = 0;
+  s->nlayers = n;
 }
 
 
+/// Requests a new size.  Rotation and output changes arrive as bursts of
+/// these, so only the last is applied by keyboard_settle().
 void keyboard_resize(Keyboard *kbd, int width, int height) {
-  if (width == kbd->w && height == kbd->h) return;
+  kbd->resize_w = width;
+  kbd->resize_h = height;
+  kbd->resize_pending = true;
+  kbd->resize_requests++;
+}
+
+
+/// Applies the last size requested, once the events that carried it have
+/// been handled.  Only the geometry is laid out again, schemes and back
+/// buffers big enough for the new size are kept.
+void keyboard_settle(Keyboard *kbd) {
+  if (!kbd->resize_pending) return;
+  kbd->resize_pending = false;
+
+  if (kbd->resize_w == kbd->w && kbd->resize_h == kbd->h) return;
+
+  kbd->w = kbd->resize_w;
+  kbd->h = kbd->resize_h;
+  kbd->resizes++;
+
+  kbd->backend->lock(kbd);
+  keyboard_surface_acquire(kbd);
+  kbd->backend->unlock(kbd);
 
-  kbd->w = width;
-  kbd->h = height;
-  drw_resize(kbd->drw, width, height);
   keyboard_layout(kbd);
 }
 
 
+/// Tracks what the X server reports and times requested shows.
+static void keyboard_update_onscreen(Keyboard *kbd, bool onscreen) {
+  if (kbd->onscreen == onscreen) return;
+  kbd->onscreen = onscreen;
+
+  if (onscreen && kbd->show_start) {
+    uint64_t t = get_time_ns() - kbd->show_start;
+    kbd->show_start = 0;
+    kbd->shows++;
+    kbd->show_total_ns += t;
+    if (kbd->show_max_ns < t) kbd->show_max_ns = t;
+  }
+}
+
+
 void keyboard_event(Keyboard *kbd, XEvent *e) {
   switch (e->type) {
   case LeaveNotify: keyboard_mouse_motion(kbd, 0); break;
@@ -262,93 +973,189 @@ void keyboard_event(Keyboard *kbd, XEvent *e) {
 
   case ButtonPress:
     if (e->xbutton.button == 1)
-      keyboard_mouse_press(kbd, &e->xbutton);
+      keyboard_touch_begin(kbd, KEYBOARD_POINTER, e->xbutton.x, e->xbutton.y);
     break;
 
   case ButtonRelease:
     if (e->xbutton.button == 1)
-      keyboard_mouse_release(kbd, &e->xbutton);
+      keyboard_touch_end(kbd, KEYBOARD_POINTER, e->xbutton.x, e->xbutton.y);
     break;
 
+  case GenericEvent: keyboard_xi_event(kbd, &e->xcookie); break;
+
   case ConfigureNotify:
     keyboard_resize(kbd, e->xconfigure.width, e->xconfigure.height);
+    if (kbd->park)
+      keyboard_update_onscreen(kbd, kbd->mapped &&
+                               e->xconfigure.y < kbd->park_y);
+    break;
+
+  case Expose: {
+    // The back buffer is current so only the exposed area is copied
+    XExposeEvent *ex = &e->xexpose;
+    if (keyboard_layer(kbd)->dirty) keyboard_present(kbd);
+    else keyboard_map_rect(kbd, ex->x, ex->y, ex->width, ex->height);
     break;
+  }
 
-  case Expose:
-    if (!e->xexpose.count) keyboard_draw(kbd);
+  case MapNotify: case UnmapNotify:
+    kbd->mapped = e->type == MapNotify;
+    keyboard_update_onscreen(kbd, kbd->mapped);
     break;
   }
 }
 
 
+/// Shows by mapping, or moving back on screen when parked, then presenting
+/// the back buffer once.  Nothing is rendered unless it changed while hidden
+/// and there is no round trip.  Hiding keeps the back buffer current.
 void keyboard_toggle(Keyboard *kbd) {
-  Display *dpy = kbd->drw->dpy;
+  const Backend *be = kbd->backend;
   kbd->visible = !kbd->visible;
 
   if (kbd->visible) {
-    XRaiseWindow(dpy, kbd->win);
-    XMapWindow(dpy, kbd->win);
+    if (!kbd->show_start) kbd->show_start = get_time_ns();
+
+    be->window_show(kbd, true);
+    keyboard_present(kbd);
 
   } else {
-    XUnmapWindow(dpy, kbd->win);
+    kbd->show_start = 0;
+
+    be->window_show(kbd, false);
+    keyboard_popup_close(kbd);
     keyboard_unpress_all(kbd);
+
+    // The word being typed is unknown when next shown
+    kbd->wordlen = 0;
+    keyboard_suggest(kbd);
   }
 
-  XSync(dpy, false);
+  be->flush(kbd);
 }
 
 
-Keyboard *keyboard_create(Display *dpy, Key **keys, int space, const char *font,
-                          const char *colors[SchemeLast][2]) {
-  Keyboard *kbd = calloc(1, sizeof(Keyboard));
-  kbd->space = space;
+static void keyboard_init_schemes(Keyboard *kbd) {
+  for (int i = 0; i < SchemeLast; i++)
+    free(kbd->scheme[i]);
 
-  // Count rows & colums
-  for (; keys[kbd->rows]; kbd->rows++) {
-    Key *row = keys[kbd->rows];
+  kbd->backend->schemes_create(kbd, kbd->scheme, kbd->layout->colors,
+                               SchemeLast);
+}
 
-    int cols;
-    for (cols = 0; row[cols].keysym; cols++) continue;
-    if (kbd->cols < cols) kbd->cols = cols;
-  }
 
-  kbd->keys = calloc(kbd->rows, sizeof(Key *));
+/// Grows or shrinks the window in place to fit the rows and strip.
+static void keyboard_fit(Keyboard *kbd) {
+  int h = kbd->layout->rows * KEYBOARD_ROW_HEIGHT + kbd->strip;
+  if (h == kbd->h) return;
 
-  // Copy keys
-  for (int r = 0; r < kbd->rows; r++) {
-    kbd->keys[r] = calloc(kbd->cols + 1, sizeof(Key));
+  kbd->y += kbd->h - h;
+  kbd->h = h;
 
-    for (int c = 0; keys[r][c].keysym; c++)
-      kbd->keys[r][c] = keys[r][c];
-  }
+  kbd->backend->lock(kbd);
+  keyboard_surface_acquire(kbd);
+  kbd->backend->unlock(kbd);
 
-  // Init screen
-  int screen = DefaultScreen(dpy);
-  Window root = RootWindow(dpy, screen);
+  int y = kbd->park && !kbd->visible ? kbd->park_y : kbd->y;
+  kbd->backend->window_move(kbd, kbd->x, y, kbd->w, kbd->h);
+}
 
-  // Dimensions
-  Dim dim = get_display_dims(dpy, screen);
-  kbd->w = dim.width;
-  kbd->h = kbd->rows * 50;
-  kbd->x = 0;
-  kbd->y = dim.height - kbd->h;
 
-  // Create drawable
-  Drw *drw = kbd->drw = drw_create(dpy, screen, root, kbd->w, kbd->h);
+/// Lets go of every key, touch and latched modifier.
+void keyboard_reset(Keyboard *kbd) {
+  keyboard_popup_close(kbd);
+  keyboard_unpress_all(kbd);
+  if (kbd->adapt) kbd->adapt->state = AdaptIdle;
+  if (kbd->shift) kbd->backend->inject_key(kbd, XK_Shift_L, false);
+  kbd->shift = kbd->meta = false;
+  keyboard_touch_drop(kbd);
+  kbd->focus = 0;
+  kbd->swiping = 0;
+}
 
-  // Setup fonts
-  if (!drw_fontset_create(drw, &font, 1)) die("no fonts could be loaded");
 
-  // Init color schemes
-  for (int i = 0; i < SchemeLast; i++)
-    kbd->scheme[i] = drw_scm_create(drw, colors[i], 2);
+void keyboard_set_layout(Keyboard *kbd, Layout *layout) {
+  // Release anything held with the old layout
+  keyboard_reset(kbd);
+
+  // Queued drawing still refers to the old layout and schemes
+  kbd->backend->lock(kbd);
+
+  kbd->layout = layout;
+  kbd->layer = 0;
+  keyboard_surface_acquire(kbd);
+  keyboard_init_schemes(kbd);
+
+  kbd->backend->unlock(kbd);
+
+  keyboard_fit(kbd);
+  keyboard_layout(kbd);
+}
+
+
+void keyboard_set_adapt(Keyboard *kbd, Adapt *adapt) {
+  kbd->adapt = adapt;
+  keyboard_layout(kbd);
+}
+
+
+void keyboard_set_dict(Keyboard *kbd, Dict *dict) {
+  kbd->dict = dict;
+  kbd->strip = dict ? KEYBOARD_STRIP_HEIGHT : 0;
+  kbd->wordlen = kbd->nsuggestions = 0;
+  kbd->word[0] = 0;
+
+  keyboard_fit(kbd);
+  keyboard_layout(kbd);
+}
+
+
+/// Moves the keyboard to the bottom of ``out`` at its full width.
+void keyboard_set_output(Keyboard *kbd, const Output *out) {
+  // Parked below every output
+  kbd->park_y = kbd->backend->screen_height(kbd);
+  kbd->x = out->x;
+  kbd->y = out->y + out->h - kbd->h;
+  kbd->pool_w = MAX(kbd->pool_w, MAX(out->w, out->h));
+
+  int y = kbd->park && !kbd->visible ? kbd->park_y : kbd->y;
+  kbd->backend->window_move(kbd, kbd->x, y, out->w, kbd->h);
+  keyboard_resize(kbd, out->w, kbd->h);
+}
 
-  drw_setscheme(drw, kbd->scheme[SchemeNorm]);
+
+/// Input and window management use ``dpy`` while drawing goes through
+/// ``render``, which may be on another connection.  Both are only used by
+/// ``backend`` and may be zero for one that needs no display.  The keyboard
+/// spans the bottom of ``out``.
+Keyboard *keyboard_create(Display *dpy, Render *render,
+                          const Backend *backend, Layout *layout, int space,
+                          const Output *out) {
+  Keyboard *kbd = calloc(1, sizeof(Keyboard));
+  kbd->dpy = dpy;
+  kbd->render = render;
+  kbd->backend = backend;
+  kbd->space = space;
+  kbd->layout = layout;
+
+  // Dimensions
+  kbd->w = out->w;
+  kbd->h = layout->rows * KEYBOARD_ROW_HEIGHT;
+  kbd->x = out->x;
+  kbd->y = out->y + out->h - kbd->h;
+  kbd->park_y = backend->screen_height(kbd);
+  kbd->pool_w = MAX(out->w, out->h);
+
+  // Back buffers
+  backend->lock(kbd);
+  keyboard_surface_acquire(kbd);
+  backend->unlock(kbd);
+
+  // Init color schemes
+  keyboard_init_schemes(kbd);
 
   // Create window
-  Clr *clr = kbd->scheme[SchemeNorm];
-  kbd->win = create_window(dpy, root, "bbkbd", kbd->w, kbd->h, kbd->x, kbd->y,
-                           clr[ColFg].pixel, clr[ColBg].pixel);
+  backend->window_create(kbd);
 
   // Init keyboard
   keyboard_layout(kbd);
@@ -358,25 +1165,16 @@ Keyboard *keyboard_create(Display *dpy, Key **keys, int space, const char *font,
 
 
 void keyboard_destroy(Keyboard *kbd) {
-  Display *dpy = kbd->drw->dpy;
-
+  keyboard_popup_close(kbd);
   keyboard_unpress_all(kbd);
 
-  drw_sync(kbd->drw);
-  drw_free(kbd->drw);
+  kbd->backend->lock(kbd);
+  keyboard_surface_release(kbd);
+  kbd->backend->unlock(kbd);
 
   for (int i = 0; i < SchemeLast; i++)
     free(kbd->scheme[i]);
 
-  XSync(dpy, false);
-  XDestroyWindow(dpy, kbd->win);
-  XSync(dpy, false);
-  XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
-
-  if (kbd->keys) {
-    for (int r = 0; r < kbd->rows; r++)
-      free(kbd->keys[r]);
-    free(kbd->keys);
-  }
+  kbd->backend->window_destroy(kbd);
   free(kbd);
 }
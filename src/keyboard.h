@@ -12,54 +12,149 @@
 #pragma once
 
 #include "drw.h"
+#include "backend.h"
+#include "layout.h"
+#include "render.h"
+#include "clip.h"
+#include "dict.h"
+#include "swipe.h"
+#include "adapt.h"
+#include "output.h"
 #include "util.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 
-enum {
-  SchemeNorm, SchemeNormABC, SchemePress, SchemeHighlight, SchemeBG, SchemeLast
-};
+#define KEYBOARD_MAX_TOUCHES 10
+#define KEYBOARD_POINTER -1 // Touch ID of the core pointer
+#define KEYBOARD_LONG_PRESS_NS 400000000 // Until alternates are offered
 
 typedef void (*keyboard_show_cb)(bool show);
 
+struct KeyboardSurface;
+
 typedef struct {
-  char *label;
-  char *label2;
-  KeySym keysym;
-  unsigned width;
-  int x, y, w, h;
-  bool pressed;
-} Key;
+  bool active;
+  int64_t id; // XI2 touch ID or KEYBOARD_POINTER
+  Key *key; // Held by this touch
+} KeyboardTouch;
 
+/// A key with alternates waits to tell a tap from a long press, after which
+/// the touch slides over the alternates and lifting types one.
 typedef struct {
+  Key *key; // Waiting or open, zero otherwise
+  int64_t touch;
+  int tx, ty; // Where the touch last was
+  bool swiping; // The gesture decoder types the tap
+  uint64_t deadline; // Of the long press while waiting
+  bool open;
+  int x, y; // Of the popup in keyboard coordinates
+  BackendPopup view;
+  unsigned opens;
+  unsigned commits;
+} KeyboardPopup;
+
+typedef struct Keyboard {
+  Display *dpy;
   Window win;
-  Drw *drw;
+  Render *render;
+  const Backend *backend; // Drawing, windows and key injection
+  void *backend_data;
+  void *buffers; // The backend's, only used through drawing operations
+  struct KeyboardSurface *surface; // Owns buffers
 
   int space;
   int w, h;
   int x, y;
-  int rows;
-  int cols;
+  int layer;
+
+  int resize_w, resize_h; // Last requested, applied by keyboard_settle()
+  bool resize_pending;
+  int pool_w; // Back buffers are at least this wide, so rotation fits
+  unsigned resize_requests;
+  unsigned resizes; // Applied
+  unsigned buffer_allocs; // Back buffers created or grown
 
   bool meta;
   bool shift;
-  bool visible;
+  bool visible; // As requested
+  bool onscreen; // As last reported by the X server
+
+  bool park; // Hide by moving below the screen instead of unmapping
+  int park_y;
+  bool mapped;
+
+  uint64_t show_start; // When the pending show was requested
+  unsigned shows;
+  uint64_t show_total_ns;
+  uint64_t show_max_ns;
 
-  Key *pressed;
+  uint64_t event_start; // When the touch event being handled arrived
+  unsigned keystrokes; // Timed from the touch until the key is sent
+  uint64_t keystroke_total_ns;
+  uint64_t keystroke_max_ns;
+
+  KeyboardTouch touches[KEYBOARD_MAX_TOUCHES];
   Key *focus;
-  Key **keys;
+  Layout *layout;
+  struct Inject *inject; // Of the keyboard's display
+  Clip *clip;
+
+  Dict *dict;
+  int strip; // Height of the suggestion strip
+  char word[DICT_WORD_MAX]; // Being typed
+  int wordlen;
+  char suggestions[DICT_MAX_RESULTS][DICT_WORD_MAX];
+  int nsuggestions;
+
+  Swipe *swipe; // Gesture typing when set
+  Key *swiping; // Key the gesture started on
+  int64_t swipe_id; // Touch making the gesture
+
+  Adapt *adapt; // Learned touch targets when set
+
+  KeyboardPopup popup;
+  Window popup_win;
+  void *popup_buffers; // The backend's, reserved before it is shown
+  int popup_w, popup_h; // Reserved
+  BackendPopup popup_shown; // Last shown, drawn by its queued operation
+  unsigned popup_serial; // Of the last shown
+  pthread_mutex_t popup_lock;
 
-  char *font;
   Clr *scheme[SchemeLast];
 
+  int xi_opcode; // XInput2 extension when touch events are selected
+  unsigned touch_begins;
+  unsigned touch_ends;
+  unsigned touch_lost; // Touches dropped or ended without a begin
+
   keyboard_show_cb show_cb;
 } Keyboard;
 
 
 void keyboard_destroy(Keyboard *kbd);
-Keyboard *keyboard_create(Display *dpy, Key **keys, int space, const char *font,
-                          const char *colors[SchemeLast][2]);
-
+Keyboard *keyboard_create(Display *dpy, Render *render,
+                          const Backend *backend, Layout *layout, int space,
+                          const Output *out);
+void keyboard_set_output(Keyboard *kbd, const Output *out);
+void keyboard_resize(Keyboard *kbd, int width, int height);
+void keyboard_settle(Keyboard *kbd);
+void keyboard_set_layout(Keyboard *kbd, Layout *layout);
+void keyboard_reset(Keyboard *kbd);
+void keyboard_set_dict(Keyboard *kbd, Dict *dict);
+void keyboard_set_adapt(Keyboard *kbd, Adapt *adapt);
+void keyboard_select_layer(Keyboard *kbd, int layer);
+void keyboard_redraw(Keyboard *kbd);
+void keyboard_prerender(Keyboard *kbd);
+uint64_t keyboard_deadline(Keyboard *kbd);
+void keyboard_timers(Keyboard *kbd);
+int keyboard_tiles(Keyboard *kbd, RasterTile *tiles, int max);
+unsigned keyboard_type(Keyboard *kbd, const char *text);
+bool keyboard_paste(Keyboard *kbd, const char *text);
+
+void keyboard_touch_begin(Keyboard *kbd, int64_t id, int x, int y);
+void keyboard_touch_update(Keyboard *kbd, int64_t id, int x, int y);
+void keyboard_touch_end(Keyboard *kbd, int64_t id, int x, int y);
 void keyboard_event(Keyboard *kbd, XEvent *e);
 void keyboard_toggle(Keyboard *kbd);
@@ -0,0 +1,643 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "layout.h"
+#include "util.h"
+#include "log.h"
+
+#include <X11/keysym.h>
+#include <X11/XF86keysym.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+
+#define LAYOUT_MAGIC 0x4c4b4242 // "BBKL"
+#define LAYOUT_VERSION 4 // Adds alternates
+#define LAYOUT_MAX_TOKENS 16
+
+
+// Binary layout image.  All offsets are from the start of the image and an
+// offset of zero means no string.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;
+  uint32_t layers;
+  uint32_t rows;
+  uint32_t keys;
+  uint32_t colors[SchemeLast][2];
+} LayoutHeader;
+
+
+typedef struct {
+  uint32_t name;
+  uint32_t start; // First row
+  uint32_t count;
+} LayoutLayer;
+
+
+typedef struct {
+  uint32_t start; // First key
+  uint32_t count;
+} LayoutRow;
+
+
+typedef struct {
+  uint32_t label;
+  uint32_t label2;
+  uint32_t text;
+  uint32_t alts;
+  uint32_t keysym;
+  uint16_t width;
+  uint16_t col;
+  uint16_t layer;
+  uint16_t reserved;
+} LayoutKey;
+
+
+typedef struct {
+  char *data;
+  size_t size;
+  size_t alloc;
+} Buffer;
+
+
+static const char *scheme_names[SchemeLast] = {
+  [SchemeNorm]      = "norm",
+  [SchemeNormABC]   = "abc",
+  [SchemePress]     = "press",
+  [SchemeHighlight] = "highlight",
+  [SchemeBG]        = "bg",
+};
+
+
+static uint32_t buffer_add(Buffer *buf, const void *data, size_t len) {
+  if (buf->alloc < buf->size + len) {
+    buf->alloc = buf->alloc * 2 < buf->size + len ?
+      buf->size + len : buf->alloc * 2;
+    buf->data = realloc(buf->data, buf->alloc);
+  }
+
+  uint32_t offset = buf->size;
+  memcpy(buf->data + offset, data, len);
+  buf->size += len;
+
+  return offset;
+}
+
+
+static uint32_t buffer_add_str(Buffer *buf, const char *s) {
+  if (!s || !*s) return 0;
+  return buffer_add(buf, s, strlen(s) + 1);
+}
+
+
+/// Computes the layer's size in width units and its hit-test table.
+static void layout_init_layer(Layer *layer) {
+  for (layer->rows = 0; layer->keys[layer->rows]; layer->rows++) continue;
+
+  for (int r = 0; r < layer->rows; r++)
+    for (Key *k = layer->keys[r]; k->keysym; k++)
+      if (layer->cols < (int)(k->col + k->width))
+        layer->cols = k->col + k->width;
+
+  int gw = layer->cols * LAYOUT_HIT_GRID;
+  layer->hits = calloc(layer->rows * LAYOUT_HIT_GRID * gw, sizeof(Key *));
+
+  for (int r = 0; r < layer->rows; r++)
+    for (Key *k = layer->keys[r]; k->keysym; k++) {
+      k->row = r;
+
+      for (int y = 0; y < LAYOUT_HIT_GRID; y++)
+        for (int x = 0; x < (int)k->width * LAYOUT_HIT_GRID; x++)
+          layer->hits[(r * LAYOUT_HIT_GRID + y) * gw +
+                      k->col * LAYOUT_HIT_GRID + x] = k;
+    }
+}
+
+
+static void layout_init(Layout *layout) {
+  for (int i = 0; i < layout->nlayers; i++) {
+    Layer *layer = &layout->layers[i];
+    layout_init_layer(layer);
+    if (layout->rows < layer->rows) layout->rows = layer->rows;
+  }
+}
+
+
+Layout *layout_create(Layer *layers, const char *colors[SchemeLast][2]) {
+  Layout *layout = calloc(1, sizeof(Layout));
+
+  for (; layers[layout->nlayers].keys; layout->nlayers++) continue;
+  layout->layers = calloc(layout->nlayers, sizeof(Layer));
+
+  for (int i = 0; i < layout->nlayers; i++) {
+    Key **keys = layers[i].keys;
+    Layer *layer = &layout->layers[i];
+    int rows;
+
+    for (rows = 0; keys[rows]; rows++) continue;
+
+    layer->name = layers[i].name;
+    layer->keys = calloc(rows + 1, sizeof(Key *));
+
+    for (int r = 0; r < rows; r++) {
+      int count;
+      for (count = 0; keys[r][count].keysym; count++) continue;
+
+      Key *row = layer->keys[r] = calloc(count + 1, sizeof(Key));
+      unsigned col = 0;
+
+      for (int c = 0; c < count; c++) {
+        row[c] = keys[r][c];
+        row[c].col = col;
+        col += row[c].width;
+      }
+    }
+  }
+
+  memcpy(layout->colors, colors, sizeof(layout->colors));
+  layout_init(layout);
+
+  return layout;
+}
+
+
+static bool layout_check_str(size_t size, uint32_t offset) {
+  return !offset || (sizeof(LayoutHeader) <= offset && offset < size);
+}
+
+
+Layout *layout_load(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    log_msg(LOG_ERROR, "cannot open layout '%s'", path);
+    return 0;
+  }
+
+  struct stat st;
+  void *image = MAP_FAILED;
+  if (!fstat(fd, &st) && sizeof(LayoutHeader) <= st.st_size)
+    image = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (image == MAP_FAILED) {
+    log_msg(LOG_ERROR, "cannot map layout '%s'", path);
+    return 0;
+  }
+
+  // Validate
+  const char *base = image;
+  const LayoutHeader *hdr = image;
+  size_t size = st.st_size;
+  size_t rowsOffset = sizeof(LayoutHeader) + hdr->layers * sizeof(LayoutLayer);
+  size_t keysOffset = rowsOffset + hdr->rows * sizeof(LayoutRow);
+  bool valid = hdr->magic == LAYOUT_MAGIC && hdr->version == LAYOUT_VERSION &&
+    hdr->size == size && hdr->layers && !base[size - 1] &&
+    keysOffset + hdr->keys * sizeof(LayoutKey) <= size;
+
+  for (int i = 0; valid && i < SchemeLast; i++)
+    valid = hdr->colors[i][0] && hdr->colors[i][1] &&
+      layout_check_str(size, hdr->colors[i][0]) &&
+      layout_check_str(size, hdr->colors[i][1]);
+
+  const LayoutLayer *layers = (const LayoutLayer *)(hdr + 1);
+  const LayoutRow *rows = (const LayoutRow *)(base + rowsOffset);
+  const LayoutKey *keys = (const LayoutKey *)(base + keysOffset);
+
+  // Start and count are checked apart so their sum cannot wrap
+  for (unsigned l = 0; valid && l < hdr->layers; l++)
+    valid = layers[l].count && layers[l].start <= hdr->rows &&
+      layers[l].count <= hdr->rows - layers[l].start &&
+      layout_check_str(size, layers[l].name);
+
+  for (unsigned r = 0; valid && r < hdr->rows; r++)
+    valid = rows[r].count && rows[r].start <= hdr->keys &&
+      rows[r].count <= hdr->keys - rows[r].start;
+
+  for (unsigned k = 0; valid && k < hdr->keys; k++)
+    valid = keys[k].keysym && keys[k].width && keys[k].layer < hdr->layers &&
+      layout_check_str(size, keys[k].label) &&
+      layout_check_str(size, keys[k].label2) &&
+      layout_check_str(size, keys[k].text) &&
+      layout_check_str(size, keys[k].alts);
+
+  if (!valid) {
+    log_msg(LOG_ERROR, "invalid layout '%s'", path);
+    munmap(image, size);
+    return 0;
+  }
+
+  // Keys point directly into the mapped image
+  Layout *layout = calloc(1, sizeof(Layout));
+  layout->image = image;
+  layout->size = size;
+  layout->nlayers = hdr->layers;
+  layout->layers = calloc(layout->nlayers, sizeof(Layer));
+
+  for (int l = 0; l < layout->nlayers; l++) {
+    Layer *layer = &layout->layers[l];
+    layer->name = layers[l].name ? base + layers[l].name : "";
+    layer->keys = calloc(layers[l].count + 1, sizeof(Key *));
+
+    for (unsigned r = 0; r < layers[l].count; r++) {
+      const LayoutRow *row = &rows[layers[l].start + r];
+      const LayoutKey *src = keys + row->start;
+      Key *dst = layer->keys[r] = calloc(row->count + 1, sizeof(Key));
+
+      for (unsigned c = 0; c < row->count; c++) {
+        dst[c].label  = src[c].label  ? (char *)base + src[c].label  : 0;
+        dst[c].label2 = src[c].label2 ? (char *)base + src[c].label2 : 0;
+        dst[c].text   = src[c].text   ? (char *)base + src[c].text   : 0;
+        dst[c].alts   = src[c].alts   ? (char *)base + src[c].alts   : 0;
+        dst[c].keysym = src[c].keysym;
+        dst[c].width  = src[c].width;
+        dst[c].col    = src[c].col;
+        dst[c].layer  = src[c].layer;
+      }
+    }
+  }
+
+  for (int i = 0; i < SchemeLast; i++)
+    for (int j = 0; j < 2; j++)
+      layout->colors[i][j] = base + hdr->colors[i][j];
+
+  layout_init(layout);
+
+  return layout;
+}
+
+
+void layout_free(Layout *layout) {
+  if (!layout) return;
+
+  for (int l = 0; l < layout->nlayers; l++) {
+    Layer *layer = &layout->layers[l];
+
+    for (int r = 0; r < layer->rows; r++)
+      free(layer->keys[r]);
+    free(layer->keys);
+    free(layer->hits);
+  }
+
+  free(layout->layers);
+  if (layout->image) munmap(layout->image, layout->size);
+  free(layout);
+}
+
+
+static int layout_tokenize(char *s, char *tokens[]) {
+  int count = 0;
+
+  while (isspace((unsigned char)*s)) s++;
+  if (*s == '#') return 0; // Comment
+
+  while (true) {
+    while (isspace((unsigned char)*s)) s++;
+    if (!*s) break;
+    if (count == LAYOUT_MAX_TOKENS) return -1;
+
+    if (*s == '"') {
+      char *d = tokens[count++] = ++s;
+
+      while (*s && *s != '"') {
+        if (*s == '\\' && s[1]) {
+          s++;
+          if (*s == 'n') {*d++ = '\n'; s++; continue;}
+          if (*s == 't') {*d++ = '\t'; s++; continue;}
+        }
+
+        *d++ = *s++;
+      }
+
+      if (*s != '"') return -1;
+      s++;
+      *d = 0;
+
+    } else {
+      tokens[count++] = s;
+      while (*s && !isspace((unsigned char)*s)) s++;
+      if (*s) *s++ = 0;
+    }
+  }
+
+  return count;
+}
+
+
+static int layout_scheme(const char *name) {
+  for (int i = 0; i < SchemeLast; i++)
+    if (!strcmp(name, scheme_names[i])) return i;
+  return -1;
+}
+
+
+static int layout_find_layer(Buffer *layers, Buffer *strs, const char *name) {
+  LayoutLayer *l = (LayoutLayer *)layers->data;
+
+  for (unsigned i = 0; i < layers->size / sizeof(LayoutLayer); i++)
+    if (!strcmp(strs->data + l[i].name, name)) return i;
+
+  return -1;
+}
+
+
+bool layout_compile(const char *src, const char *dst) {
+  FILE *f = fopen(src, "r");
+  if (!f) {
+    fprintf(stderr, "error, cannot open '%s'\n", src);
+    return false;
+  }
+
+  Buffer layers = {0}, rows = {0}, keys = {0}, targets = {0}, strs = {0};
+  uint32_t colors[SchemeLast][2] = {{0}};
+  LayoutLayer *layer = 0;
+  LayoutRow *row = 0;
+  LayoutKey *last = 0; // Key added last
+  unsigned col = 0;
+  bool ok = true;
+  char *line = 0;
+  size_t len = 0;
+
+  buffer_add(&strs, "", 1); // Offset zero is reserved
+
+  for (int lineNum = 1; ok && getline(&line, &len, f) != -1; lineNum++) {
+    char *tokens[LAYOUT_MAX_TOKENS];
+    int count = layout_tokenize(line, tokens);
+    const char *error = 0;
+
+    if (count < 0) error = "syntax error";
+    else if (!count) continue;
+
+    else if (!strcmp(tokens[0], "color")) {
+      int scheme = count == 4 ? layout_scheme(tokens[1]) : -1;
+
+      if (scheme < 0) error = "expected: color <scheme> <fg> <bg>";
+      else
+        for (int i = 0; i < 2; i++)
+          colors[scheme][i] = buffer_add_str(&strs, tokens[i + 2]);
+
+    } else if (!strcmp(tokens[0], "layer")) {
+      if (count != 2) error = "expected: layer <name>";
+      else if (0 <= layout_find_layer(&layers, &strs, tokens[1]))
+        error = "duplicate layer";
+
+      else {
+        LayoutLayer l = {buffer_add_str(&strs, tokens[1]), 0, 0};
+        l.start = rows.size / sizeof(LayoutRow);
+        uint32_t offset = buffer_add(&layers, &l, sizeof(l));
+        layer = (LayoutLayer *)(layers.data + offset);
+        row = 0;
+      }
+
+    } else if (!strcmp(tokens[0], "row")) {
+      if (!layer) error = "row outside of layer";
+
+      else {
+        LayoutRow r = {keys.size / sizeof(LayoutKey), 0};
+        uint32_t offset = buffer_add(&rows, &r, sizeof(r));
+        row = (LayoutRow *)(rows.data + offset);
+        layer->count++;
+        col = 0;
+        last = 0;
+      }
+
+    } else if (!strcmp(tokens[0], "key")) {
+      KeySym keysym = count < 4 ? NoSymbol : XStringToKeysym(tokens[3]);
+      int width = 5 <= count ? atoi(tokens[4]) : 1;
+
+      if (count < 4 || 6 < count)
+        error = "expected: key <label> <label2> <keysym> [width] [layer]";
+      else if (!row) error = "key outside of row";
+      else if (keysym == NoSymbol) error = "unknown keysym";
+      else if (width < 1) error = "invalid width";
+      else if (keysym == XK_Mode_switch && count != 6)
+        error = "Mode_switch key without target layer";
+
+      else {
+        LayoutKey k = {0};
+        k.label = buffer_add_str(&strs, tokens[1]);
+        k.label2 = buffer_add_str(&strs, tokens[2]);
+        k.keysym = keysym;
+        k.width = width;
+        k.col = col; // Offset in width units from the start of the row
+        col += width;
+
+        // Layer names are resolved once all layers are known
+        uint32_t target = count == 6 ? buffer_add_str(&strs, tokens[5]) : 0;
+        buffer_add(&targets, &target, sizeof(target));
+        last = (LayoutKey *)(keys.data + buffer_add(&keys, &k, sizeof(k)));
+        row->count++;
+      }
+
+    } else if (!strcmp(tokens[0], "macro") ||
+               !strcmp(tokens[0], "snippet")) {
+      bool snippet = tokens[0][0] == 's';
+      int width = count == 4 ? atoi(tokens[3]) : 1;
+
+      if (count < 3 || 4 < count)
+        error = snippet ? "expected: snippet <label> <text> [width]" :
+          "expected: macro <label> <text> [width]";
+      else if (!row) error = "key outside of row";
+      else if (!*tokens[2]) error = "empty text";
+      else if (width < 1) error = "invalid width";
+
+      else {
+        LayoutKey k = {0};
+        k.label = buffer_add_str(&strs, tokens[1]);
+        k.text = buffer_add_str(&strs, tokens[2]);
+        k.keysym = snippet ? XF86XK_Paste : XK_Execute;
+        k.width = width;
+        k.col = col;
+        col += width;
+
+        uint32_t target = 0;
+        buffer_add(&targets, &target, sizeof(target));
+        last = (LayoutKey *)(keys.data + buffer_add(&keys, &k, sizeof(k)));
+        row->count++;
+      }
+
+    } else if (!strcmp(tokens[0], "alts")) {
+      if (count < 2) error = "expected: alts <alternate>...";
+      else if (!last) error = "alts without a key";
+      else if (last->alts) error = "duplicate alts";
+      else if (LAYOUT_ALTS_MAX < count - 1) error = "too many alternates";
+
+      else {
+        // Joined with spaces, a quoted alternate may not contain one
+        char alts[LAYOUT_ALTS_MAX * LAYOUT_ALT_MAX] = "";
+
+        for (int i = 1; i < count && !error; i++)
+          if (!*tokens[i] || strchr(tokens[i], ' ') ||
+              LAYOUT_ALT_MAX <= strlen(tokens[i]))
+            error = "invalid alternate";
+          else {
+            if (1 < i) strcat(alts, " ");
+            strcat(alts, tokens[i]);
+          }
+
+        if (!error) last->alts = buffer_add_str(&strs, alts);
+      }
+
+    } else error = "unknown directive";
+
+    if (error) {
+      fprintf(stderr, "%s:%d: %s\n", src, lineNum, error);
+      ok = false;
+    }
+  }
+
+  free(line);
+  fclose(f);
+
+  for (int i = 0; ok && i < SchemeLast; i++)
+    if (!colors[i][0] || !colors[i][1]) {
+      fprintf(stderr, "%s: missing color '%s'\n", src, scheme_names[i]);
+      ok = false;
+    }
+
+  for (unsigned i = 0; ok && i < layers.size / sizeof(LayoutLayer); i++)
+    if (!((LayoutLayer *)layers.data)[i].count) {
+      fprintf(stderr, "%s: empty layer\n", src);
+      ok = false;
+    }
+
+  for (unsigned i = 0; ok && i < rows.size / sizeof(LayoutRow); i++)
+    if (!((LayoutRow *)rows.data)[i].count) {
+      fprintf(stderr, "%s: empty row\n", src);
+      ok = false;
+    }
+
+  if (ok && !layers.size) {
+    fprintf(stderr, "%s: no layers\n", src);
+    ok = false;
+  }
+
+  for (unsigned k = 0; ok && k < keys.size / sizeof(LayoutKey); k++) {
+    uint32_t target = ((uint32_t *)targets.data)[k];
+    if (!target) continue;
+
+    int index = layout_find_layer(&layers, &strs, strs.data + target);
+    if (index < 0) {
+      fprintf(stderr, "%s: unknown layer '%s'\n", src, strs.data + target);
+      ok = false;
+
+    } else ((LayoutKey *)keys.data)[k].layer = index;
+  }
+
+  if (ok) {
+    // Relocate string offsets
+    uint32_t strBase =
+      sizeof(LayoutHeader) + layers.size + rows.size + keys.size;
+
+    LayoutHeader hdr;
+    hdr.magic = LAYOUT_MAGIC;
+    hdr.version = LAYOUT_VERSION;
+    hdr.size = strBase + strs.size;
+    hdr.layers = layers.size / sizeof(LayoutLayer);
+    hdr.rows = rows.size / sizeof(LayoutRow);
+    hdr.keys = keys.size / sizeof(LayoutKey);
+
+    for (int i = 0; i < SchemeLast; i++)
+      for (int j = 0; j < 2; j++)
+        hdr.colors[i][j] = strBase + colors[i][j];
+
+    for (unsigned l = 0; l < hdr.layers; l++)
+      ((LayoutLayer *)layers.data)[l].name += strBase;
+
+    for (unsigned k = 0; k < hdr.keys; k++) {
+      LayoutKey *key = (LayoutKey *)keys.data + k;
+      if (key->label) key->label += strBase;
+      if (key->label2) key->label2 += strBase;
+      if (key->text) key->text += strBase;
+      if (key->alts) key->alts += strBase;
+    }
+
+    // Write to a temporary file and rename so watchers see an atomic swap
+    char *tmp = malloc(strlen(dst) + 5);
+    sprintf(tmp, "%s.tmp", dst);
+
+    FILE *out = fopen(tmp, "wb");
+    ok = out &&
+      fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+      fwrite(layers.data, layers.size, 1, out) == 1 &&
+      fwrite(rows.data, rows.size, 1, out) == 1 &&
+      fwrite(keys.data, keys.size, 1, out) == 1 &&
+      fwrite(strs.data, strs.size, 1, out) == 1;
+    if (out && fclose(out)) ok = false;
+    if (ok && rename(tmp, dst)) ok = false;
+
+    if (!ok) {
+      fprintf(stderr, "error, cannot write '%s'\n", dst);
+      unlink(tmp);
+    }
+
+    free(tmp);
+  }
+
+  free(layers.data);
+  free(rows.data);
+  free(keys.data);
+  free(targets.data);
+  free(strs.data);
+
+  return ok;
+}
+
+
+static const char *layout_basename(const char *path) {
+  const char *name = strrchr(path, '/');
+  return name ? name + 1 : path;
+}
+
+
+int layout_watch(const char *path) {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1) return -1;
+
+  // Watch the directory so replacing the file by rename is seen
+  const char *name = layout_basename(path);
+  char *dir = name == path ? strdup(".") : strndup(path, name - path);
+
+  if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  free(dir);
+  return fd;
+}
+
+
+bool layout_changed(int fd, const char *path) {
+  const char *name = layout_basename(path);
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  ssize_t len;
+
+  while (0 < (len = read(fd, buf, sizeof(buf))))
+    for (char *ptr = buf; ptr < buf + len;) {
+      struct inotify_event *ev = (struct inotify_event *)ptr;
+      if (ev->len && !strcmp(ev->name, name)) changed = true;
+      ptr += sizeof(struct inotify_event) + ev->len;
+    }
+
+  return changed;
+}
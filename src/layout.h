@@ -0,0 +1,73 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define LAYOUT_HIT_GRID 4 // Hit-test cells per width unit and row
+#define LAYOUT_ALTS_MAX 8 // Alternates of one key
+#define LAYOUT_ALT_MAX 16 // Bytes in an alternate, with its terminator
+
+enum {
+  SchemeNorm, SchemeNormABC, SchemePress, SchemeHighlight, SchemeBG, SchemeLast
+};
+
+typedef struct {
+  char *label;
+  char *label2;
+  KeySym keysym;
+  unsigned width;
+  int layer; // Target of XK_Mode_switch keys
+  char *text; // Typed by macro keys or pasted by snippet keys
+  char *alts; // Offered on a long press, separated by spaces
+  unsigned col;
+  unsigned row;
+  int x, y, w, h;
+  bool pressed;
+} Key;
+
+typedef struct {
+  const char *name;
+  Key **keys;
+
+  int rows;
+  int cols;
+  Key **hits; // Key for each cell of a LAYOUT_HIT_GRID grid over the layer
+  bool hits_dirty; // Needs refolding with learned touch offsets
+
+  int x, y; // Origin of the first row
+  int w, h; // Size of one width unit and row
+  bool dirty;
+} Layer;
+
+typedef struct {
+  void *image;
+  size_t size;
+
+  int rows; // Of the tallest layer
+  int nlayers;
+  Layer *layers;
+  const char *colors[SchemeLast][2];
+} Layout;
+
+
+Layout *layout_create(Layer *layers, const char *colors[SchemeLast][2]);
+Layout *layout_load(const char *path);
+void layout_free(Layout *layout);
+bool layout_compile(const char *src, const char *dst);
+
+int layout_watch(const char *path);
+bool layout_changed(int fd, const char *path);
@@ -0,0 +1,194 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "log.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+
+#define LOG_EXIT_WAIT_MS 1000 // For a stalled output once the thread stops
+
+
+typedef struct {
+  LogLevel level;
+  uint64_t time;
+  char text[LOG_LINE_MAX];
+} LogEntry;
+
+
+static LogLevel log_level = LOG_INFO;
+static uint64_t log_start = 0;
+
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t log_wake;
+static atomic_bool log_running = false;
+
+// Guarded by log_lock
+static LogEntry log_ring[LOG_RING_SIZE];
+static unsigned log_head = 0;
+static unsigned log_tail = 0;
+static unsigned log_drops = 0;
+
+static unsigned log_reported = 0; // Drops written, drain thread only
+
+
+static const char *log_level_name(LogLevel level) {
+  switch (level) {
+  case LOG_ERROR: return "error";
+  case LOG_WARN:  return "warn";
+  case LOG_INFO:  return "info";
+  case LOG_DEBUG: return "debug";
+  }
+
+  return "";
+}
+
+
+/// Info goes to stdout, which is often a pipe to a supervisor, the rest to
+/// stderr.  The drain thread may block here.  Without it, a stalled output is
+/// given up on rather than hanging startup or exit.
+static void log_write(const LogEntry *e) {
+  char line[LOG_LINE_MAX + 32];
+  int len = snprintf(line, sizeof(line), "%10.3f %-5s %s\n",
+                     (e->time - log_start) / 1e9, log_level_name(e->level),
+                     e->text);
+  if ((int)sizeof(line) <= len) len = sizeof(line) - 1;
+
+  int fd = e->level == LOG_INFO ? STDOUT_FILENO : STDERR_FILENO;
+
+  for (int i = 0; i < len;) {
+    if (!atomic_load(&log_running)) {
+      struct pollfd pfd = {fd, POLLOUT};
+      if (poll(&pfd, 1, LOG_EXIT_WAIT_MS) != 1) break;
+    }
+
+    ssize_t n = write(fd, line + i, len - i);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    i += n;
+  }
+}
+
+
+static void log_drain() {
+  while (true) {
+    LogEntry e;
+
+    pthread_mutex_lock(&log_lock);
+    bool empty = log_head == log_tail;
+    if (!empty) e = log_ring[log_tail++ & (LOG_RING_SIZE - 1)];
+    unsigned drops = log_drops;
+    pthread_mutex_unlock(&log_lock);
+
+    if (log_reported != drops) {
+      LogEntry note = {LOG_WARN, get_time_ns()};
+      snprintf(note.text, sizeof(note.text), "%u log messages dropped",
+               drops - log_reported);
+      log_reported = drops;
+      log_write(&note);
+    }
+
+    if (empty) break;
+    log_write(&e);
+  }
+}
+
+
+static void *log_main(void *arg) {
+  while (atomic_load(&log_running)) {
+    while (sem_wait(&log_wake) == -1 && errno == EINTR) continue;
+    log_drain();
+  }
+
+  return 0;
+}
+
+
+/// Starts the thread that writes logged messages.  Before this, and after
+/// log_shutdown(), messages are written directly.
+void log_init(LogLevel level) {
+  log_level = level;
+  if (!log_start) log_start = get_time_ns();
+
+  sem_init(&log_wake, 0, 0);
+  atomic_store(&log_running, true);
+
+  if (pthread_create(&log_thread, 0, log_main, 0)) {
+    atomic_store(&log_running, false);
+    sem_destroy(&log_wake);
+  }
+}
+
+
+/// Writes anything still queued and stops the thread.
+void log_shutdown() {
+  if (!atomic_exchange(&log_running, false)) return;
+
+  sem_post(&log_wake);
+  pthread_join(log_thread, 0);
+  sem_destroy(&log_wake);
+  log_drain();
+}
+
+
+/// Queues a message without ever waiting on the output.  When the ring is
+/// full the message is dropped and counted.
+void log_vmsg(LogLevel level, const char *fmt, va_list ap) {
+  if (log_level < level) return;
+
+  if (!log_start) log_start = get_time_ns();
+
+  LogEntry e;
+  e.level = level;
+  e.time = get_time_ns();
+  vsnprintf(e.text, sizeof(e.text), fmt, ap);
+
+  int len = strlen(e.text);
+  if (len && e.text[len - 1] == '\n') e.text[len - 1] = 0;
+
+  if (!atomic_load(&log_running)) {
+    log_write(&e);
+    return;
+  }
+
+  pthread_mutex_lock(&log_lock);
+  bool full = log_head - log_tail == LOG_RING_SIZE;
+  if (full) log_drops++;
+  else log_ring[log_head++ & (LOG_RING_SIZE - 1)] = e;
+  pthread_mutex_unlock(&log_lock);
+
+  if (!full) sem_post(&log_wake);
+}
+
+
+void log_msg(LogLevel level, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  log_vmsg(level, fmt, ap);
+  va_end(ap);
+}
+
+
+unsigned log_dropped() {
+  pthread_mutex_lock(&log_lock);
+  unsigned drops = log_drops;
+  pthread_mutex_unlock(&log_lock);
+  return drops;
+}
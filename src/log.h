@@ -0,0 +1,28 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdarg.h>
+
+
+#define LOG_RING_SIZE 256 // Messages, must be a power of two
+#define LOG_LINE_MAX 240
+
+typedef enum {LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG} LogLevel;
+
+
+void log_init(LogLevel level);
+void log_shutdown();
+void log_msg(LogLevel level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void log_vmsg(LogLevel level, const char *fmt, va_list ap);
+unsigned log_dropped();
@@ -0,0 +1,127 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "output.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+#ifdef XINERAMA
+#include <X11/extensions/Xinerama.h>
+#endif
+
+#ifdef RANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+
+
+/// Returns true if the geometry changed.
+static bool outputs_query(Outputs *o) {
+  Outputs prev = *o;
+
+  o->w = DisplayWidth(o->dpy, o->screen);
+  o->h = DisplayHeight(o->dpy, o->screen);
+  o->count = 0;
+
+#ifdef XINERAMA
+  if (XineramaIsActive(o->dpy)) {
+    int n = 0;
+    XineramaScreenInfo *info = XineramaQueryScreens(o->dpy, &n);
+
+    for (int i = 0; i < n && o->count < OUTPUT_MAX; i++) {
+      Output out = {info[i].x_org, info[i].y_org, info[i].width,
+                    info[i].height};
+
+      // Cloned outputs show the same keyboard
+      bool dup = false;
+      for (int j = 0; j < o->count && !dup; j++) {
+        Output *p = &o->outputs[j];
+        dup = p->x == out.x && p->y == out.y && p->w == out.w &&
+          p->h == out.h;
+      }
+
+      if (!dup) o->outputs[o->count++] = out;
+    }
+
+    if (info) XFree(info);
+  }
+#endif
+
+  if (!o->count) {
+    Output out = {0, 0, o->w, o->h};
+    o->outputs[o->count++] = out;
+  }
+
+  if (prev.w != o->w || prev.h != o->h || prev.count != o->count) return true;
+
+  for (int i = 0; i < o->count; i++) {
+    Output *a = &prev.outputs[i];
+    Output *b = &o->outputs[i];
+    if (a->x != b->x || a->y != b->y || a->w != b->w || a->h != b->h)
+      return true;
+  }
+
+  return false;
+}
+
+
+Outputs *outputs_create(Display *dpy, int screen) {
+  Outputs *o = calloc(1, sizeof(Outputs));
+  o->dpy = dpy;
+  o->screen = screen;
+
+#ifdef RANDR
+  int error;
+  if (XRRQueryExtension(dpy, &o->rr_event, &error))
+    XRRSelectInput(dpy, RootWindow(dpy, screen), RRScreenChangeNotifyMask);
+  else o->rr_event = 0;
+#endif
+
+  outputs_query(o);
+
+  for (int i = 0; i < o->count; i++)
+    message("Output %d %dx%d+%d+%d\n", i, o->outputs[i].w, o->outputs[i].h,
+            o->outputs[i].x, o->outputs[i].y);
+
+  return o;
+}
+
+
+void outputs_destroy(Outputs *o) {free(o);}
+
+
+/// Requeries after a RandR screen change.  Returns true if the geometry
+/// changed.
+bool outputs_event(Outputs *o, XEvent *e) {
+#ifdef RANDR
+  if (!o->rr_event || e->type != o->rr_event + RRScreenChangeNotify)
+    return false;
+
+  // Updates the screen size Xlib reports
+  XRRUpdateConfiguration(e);
+  return outputs_query(o);
+
+#else
+  return false;
+#endif
+}
+
+
+/// Returns the output containing the point, or the first.
+int outputs_find(Outputs *o, int x, int y) {
+  for (int i = 0; i < o->count; i++) {
+    Output *out = &o->outputs[i];
+    if (out->x <= x && x < out->x + out->w && out->y <= y &&
+        y < out->y + out->h) return i;
+  }
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <stdbool.h>
+
+
+#define OUTPUT_MAX 8
+
+typedef struct {
+  int x, y;
+  int w, h;
+} Output;
+
+/// Monitor geometry, queried once and then only when RandR reports a change
+typedef struct {
+  Display *dpy;
+  int screen;
+  int rr_event; // RandR event base, zero when changes are not reported
+
+  int w, h; // Of the whole screen
+  int count;
+  Output outputs[OUTPUT_MAX];
+} Outputs;
+
+
+Outputs *outputs_create(Display *dpy, int screen);
+void outputs_destroy(Outputs *o);
+bool outputs_event(Outputs *o, XEvent *e);
+int outputs_find(Outputs *o, int x, int y);
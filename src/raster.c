@@ -0,0 +1,497 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "raster.h"
+#include "drw.h"
+#include "util.h"
+#include "log.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define RASTER_GLYPHS 128 // Code points cached by each thread
+#define RASTER_EXTRA_BITS 8 // Of the hash of other code points
+#define RASTER_BANDS 4 // Background fill jobs per thread
+
+
+typedef struct {
+  bool loaded;
+  uint32_t c;
+  int left, top; // Of the bitmap relative to the pen
+  int w, h;
+  int advance;
+  unsigned char *bitmap; // One byte of coverage per pixel
+} RasterGlyph;
+
+typedef struct RasterWorker {
+  Raster *r;
+  pthread_t thread;
+  unsigned generation; // Last jobs run
+
+  FT_Library lib;
+  FT_Face face;
+  int ascent, descent;
+  RasterGlyph glyphs[RASTER_GLYPHS];
+  RasterGlyph extra[1 << RASTER_EXTRA_BITS]; // Other code points by hash
+
+  bool sorted; // Seen the raster's fallbacks
+  FT_Face faces[RASTER_FACES]; // Opened on first use
+  bool failed[RASTER_FACES];
+} RasterWorker;
+
+
+static uint32_t utf8_next(const char **s) {
+  const unsigned char *p = (const unsigned char *)*s;
+  uint32_t c = *p++;
+  int more = c < 0x80 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : 3;
+
+  if (more) c &= 0x3f >> more;
+  for (; more && (*p & 0xc0) == 0x80; more--) c = c << 6 | (*p++ & 0x3f);
+
+  *s = (const char *)p;
+  return c;
+}
+
+
+static void glyph_free(RasterGlyph *g) {
+  free(g->bitmap);
+  memset(g, 0, sizeof(RasterGlyph));
+}
+
+
+/// Lists the fonts fontconfig would fall back to, the way Xft does.
+static void raster_sort(Raster *r) {
+  pthread_mutex_lock(&r->faces_lock);
+
+  if (!r->sorted) {
+    FcResult result;
+    FcFontSet *set = FcFontSort(0, r->pattern, FcTrue, 0, &result);
+
+    for (int i = 0; set && i < set->nfont && r->nfaces < RASTER_FACES; i++) {
+      FcChar8 *file;
+      FcCharSet *charset;
+      int index = 0;
+
+      if (FcPatternGetString(set->fonts[i], FC_FILE, 0, &file) !=
+          FcResultMatch ||
+          FcPatternGetCharSet(set->fonts[i], FC_CHARSET, 0, &charset) !=
+          FcResultMatch) continue;
+      FcPatternGetInteger(set->fonts[i], FC_INDEX, 0, &index);
+
+      r->files[r->nfaces] = strdup((const char *)file);
+      r->indexes[r->nfaces] = index;
+      r->charsets[r->nfaces++] = FcCharSetCopy(charset);
+    }
+
+    if (set) FcFontSetDestroy(set);
+    r->sorted = true;
+  }
+
+  pthread_mutex_unlock(&r->faces_lock);
+}
+
+
+/// The first face with a glyph for ``c``.  The font's own if none has one,
+/// so its missing glyph box is drawn.
+static FT_Face worker_face(RasterWorker *w, uint32_t c) {
+  Raster *r = w->r;
+  if (FT_Get_Char_Index(w->face, c)) return w->face;
+
+  if (!w->sorted) {
+    raster_sort(r);
+    w->sorted = true;
+  }
+
+  for (int i = 0; i < r->nfaces; i++) {
+    if (w->failed[i] || !FcCharSetHasChar(r->charsets[i], c)) continue;
+
+    if (!w->faces[i] &&
+        (FT_New_Face(w->lib, r->files[i], r->indexes[i], &w->faces[i]) ||
+         FT_Set_Pixel_Sizes(w->faces[i], 0, r->pixel_size + 0.5))) {
+      log_msg(LOG_WARN, "cannot open fallback font '%s'", r->files[i]);
+      if (w->faces[i]) FT_Done_Face(w->faces[i]);
+      w->faces[i] = 0;
+      w->failed[i] = true;
+      continue;
+    }
+
+    if (FT_Get_Char_Index(w->faces[i], c)) return w->faces[i];
+  }
+
+  return w->face;
+}
+
+
+static RasterGlyph *worker_glyph(RasterWorker *w, uint32_t c) {
+  RasterGlyph *g = c < RASTER_GLYPHS ? &w->glyphs[c] :
+    &w->extra[(c * 2654435761u) >> (32 - RASTER_EXTRA_BITS)];
+  if (g->loaded && g->c == c) return g;
+
+  glyph_free(g);
+  g->loaded = true;
+  g->c = c;
+  FT_Face face = worker_face(w, c);
+  if (FT_Load_Char(face, c, FT_LOAD_RENDER)) return g;
+
+  FT_GlyphSlot slot = face->glyph;
+  FT_Bitmap *bm = &slot->bitmap;
+  g->left = slot->bitmap_left;
+  g->top = slot->bitmap_top;
+  g->w = bm->width;
+  g->h = bm->rows;
+  g->advance = slot->advance.x >> 6;
+
+  if (bm->pixel_mode != FT_PIXEL_MODE_GRAY) g->w = g->h = 0;
+  if (g->w && g->h) {
+    g->bitmap = malloc(g->w * g->h);
+    for (int y = 0; y < g->h; y++)
+      memcpy(g->bitmap + y * g->w, bm->buffer + y * bm->pitch, g->w);
+  }
+
+  return g;
+}
+
+
+static int worker_width(RasterWorker *w, const char *text) {
+  int width = 0;
+  while (*text) width += worker_glyph(w, utf8_next(&text))->advance;
+  return width;
+}
+
+
+static void fill(Raster *r, int x, int y, int w, int h, uint32_t color) {
+  for (int j = y; j < y + h; j++) {
+    uint32_t *p = r->pixels + (size_t)j * r->w + x;
+    for (int i = 0; i < w; i++) p[i] = color;
+  }
+}
+
+
+static uint32_t blend(uint32_t dst, uint32_t src, unsigned a) {
+  uint32_t out = 0;
+
+  for (int shift = 0; shift < 24; shift += 8) {
+    int d = dst >> shift & 0xff;
+    int s = src >> shift & 0xff;
+    out |= (uint32_t)(d + (s - d) * (int)a / 255) << shift;
+  }
+
+  return out;
+}
+
+
+/// Draws a glyph clipped to ``tile``.
+static void draw_glyph(Raster *r, const RasterTile *tile, RasterGlyph *g,
+                       int penx, int baseline) {
+  int x0 = penx + g->left;
+  int y0 = baseline - g->top;
+
+  for (int y = MAX(0, tile->y - y0); y < g->h; y++) {
+    int py = y0 + y;
+    if (tile->y + tile->h <= py) break;
+
+    uint32_t *row = r->pixels + (size_t)py * r->w;
+    const unsigned char *src = g->bitmap + y * g->w;
+
+    for (int x = MAX(0, tile->x - x0); x < g->w; x++) {
+      int px = x0 + x;
+      if (tile->x + tile->w <= px) break;
+      if (src[x]) row[px] = blend(row[px], tile->fg, src[x]);
+    }
+  }
+}
+
+
+static void clip_tile(Raster *r, const RasterTile *in, RasterTile *out) {
+  out->x = MAX(0, in->x);
+  out->y = MAX(0, in->y);
+  out->w = MIN(r->w, in->x + in->w) - out->x;
+  out->h = MIN(r->h, in->y + in->h) - out->y;
+  out->fg = in->fg;
+}
+
+
+static void job_band(Raster *r, RasterWorker *w, int job) {
+  int y = r->h * job / r->njobs;
+  fill(r, 0, y, r->w, r->h * (job + 1) / r->njobs - y, r->bg);
+}
+
+
+/// Centers the label the way drw_text() does in a box of twice the font
+/// height.
+static void job_tile(Raster *r, RasterWorker *w, int job) {
+  const RasterTile *tile = &r->tiles[job];
+  RasterTile clip;
+  clip_tile(r, tile, &clip);
+  if (clip.w <= 0 || clip.h <= 0) return;
+
+  fill(r, clip.x, clip.y, clip.w, clip.h, tile->bg);
+
+  const char *text = tile->label;
+  int x = tile->x + (tile->w - worker_width(w, text)) / 2;
+  int baseline =
+    tile->y + (tile->h - w->ascent - w->descent) / 2 + w->ascent;
+
+  while (*text) {
+    RasterGlyph *g = worker_glyph(w, utf8_next(&text));
+    if (g->bitmap) draw_glyph(r, &clip, g, x, baseline);
+    x += g->advance;
+  }
+}
+
+
+static void raster_work(Raster *r, RasterWorker *w) {
+  int job;
+  while ((job = atomic_fetch_add(&r->next, 1)) < r->njobs) r->fn(r, w, job);
+}
+
+
+static void *raster_thread(void *arg) {
+  RasterWorker *w = (RasterWorker *)arg;
+  Raster *r = w->r;
+
+  pthread_mutex_lock(&r->lock);
+
+  while (true) {
+    while (r->running && w->generation == r->generation)
+      pthread_cond_wait(&r->wake, &r->lock);
+    if (!r->running) break;
+
+    w->generation = r->generation;
+    pthread_mutex_unlock(&r->lock);
+
+    raster_work(r, w);
+
+    pthread_mutex_lock(&r->lock);
+    if (!--r->busy) pthread_cond_signal(&r->done);
+  }
+
+  pthread_mutex_unlock(&r->lock);
+
+  return 0;
+}
+
+
+/// Runs ``njobs`` calls of ``fn`` across the pool and waits for them.
+static void raster_run(Raster *r, raster_job fn, int njobs) {
+  pthread_mutex_lock(&r->lock);
+  r->fn = fn;
+  r->njobs = njobs;
+  atomic_store(&r->next, 0);
+  r->busy = r->threads - 1;
+  r->generation++;
+  pthread_cond_broadcast(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+
+  raster_work(r, &r->workers[0]);
+
+  pthread_mutex_lock(&r->lock);
+  while (r->busy) pthread_cond_wait(&r->done, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+}
+
+
+/// Matches a font name the way Xft would, without a display.
+FcPattern *raster_match(const char *font) {
+  FcPattern *pattern = FcNameParse((const FcChar8 *)font);
+  if (!pattern) return 0;
+
+  FcConfigSubstitute(0, pattern, FcMatchPattern);
+  FcDefaultSubstitute(pattern);
+
+  FcResult result;
+  FcPattern *match = FcFontMatch(0, pattern, &result);
+  FcPatternDestroy(pattern);
+
+  return match;
+}
+
+
+static bool worker_init(RasterWorker *w, const char *file, int index,
+                        double size) {
+  if (FT_Init_FreeType(&w->lib)) return false;
+  if (FT_New_Face(w->lib, file, index, &w->face)) return false;
+  if (FT_Set_Pixel_Sizes(w->face, 0, size + 0.5)) return false;
+
+  FT_Size_Metrics *m = &w->face->size->metrics;
+  w->ascent = m->ascender >> 6;
+  w->descent = -m->descender >> 6;
+
+  return true;
+}
+
+
+static void worker_free(RasterWorker *w) {
+  for (int i = 0; i < RASTER_GLYPHS; i++) glyph_free(&w->glyphs[i]);
+  for (int i = 0; i < 1 << RASTER_EXTRA_BITS; i++) glyph_free(&w->extra[i]);
+  for (int i = 0; i < RASTER_FACES; i++)
+    if (w->faces[i]) FT_Done_Face(w->faces[i]);
+  if (w->face) FT_Done_Face(w->face);
+  if (w->lib) FT_Done_FreeType(w->lib);
+}
+
+
+/// Uses the file and pixel size of a matched ``font``.  Returns zero if the
+/// font cannot be opened with FreeType.
+Raster *raster_create(FcPattern *font, int threads) {
+  FcChar8 *file;
+  int index = 0;
+  double size = 0;
+
+  if (FcPatternGetString(font, FC_FILE, 0, &file) != FcResultMatch ||
+      FcPatternGetDouble(font, FC_PIXEL_SIZE, 0, &size) != FcResultMatch) {
+    log_msg(LOG_ERROR, "raster font has no file or pixel size");
+    return 0;
+  }
+  FcPatternGetInteger(font, FC_INDEX, 0, &index);
+
+  Raster *r = calloc(1, sizeof(Raster));
+  r->font = hash_bytes(HASH_INIT, file, strlen((const char *)file));
+  r->font = hash_bytes(r->font, &index, sizeof(index));
+  r->font = hash_bytes(r->font, &size, sizeof(size));
+  r->pixel_size = size;
+  r->pattern = FcPatternDuplicate(font);
+  r->threads = MAX(1, MIN(threads, RASTER_THREADS_MAX));
+  r->workers = calloc(r->threads, sizeof(RasterWorker));
+  r->running = true;
+  pthread_mutex_init(&r->faces_lock, 0);
+  pthread_mutex_init(&r->lock, 0);
+  pthread_cond_init(&r->wake, 0);
+  pthread_cond_init(&r->done, 0);
+
+  for (int i = 0; i < r->threads; i++) {
+    RasterWorker *w = &r->workers[i];
+    w->r = r;
+
+    if (!worker_init(w, (const char *)file, index, size)) {
+      log_msg(LOG_ERROR, "cannot open raster font '%s'", file);
+      r->threads = i + 1;
+      raster_destroy(r);
+      return 0;
+    }
+  }
+
+  // The first worker is the calling thread
+  for (int i = 1; i < r->threads; i++)
+    if (pthread_create(&r->workers[i].thread, 0, raster_thread,
+                       &r->workers[i]))
+      die("failed to start raster thread");
+
+  return r;
+}
+
+
+void raster_destroy(Raster *r) {
+  if (!r) return;
+
+  pthread_mutex_lock(&r->lock);
+  bool started = r->running;
+  r->running = false;
+  pthread_cond_broadcast(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+
+  for (int i = 0; i < r->threads; i++) {
+    RasterWorker *w = &r->workers[i];
+    if (i && started && w->thread) pthread_join(w->thread, 0);
+    worker_free(w);
+  }
+
+  for (int i = 0; i < r->nfaces; i++) {
+    free(r->files[i]);
+    FcCharSetDestroy(r->charsets[i]);
+  }
+
+  FcPatternDestroy(r->pattern);
+  pthread_mutex_destroy(&r->faces_lock);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->wake);
+  pthread_cond_destroy(&r->done);
+  free(r->workers);
+  free(r->pixels);
+  free(r);
+}
+
+
+/// Identifies the image raster_draw() would produce.
+uint64_t raster_key(Raster *r, int w, int h, uint32_t bg,
+                    const RasterTile *tiles, int n) {
+  int dims[3] = {w, h, n};
+  uint64_t key = hash_bytes(r->font, dims, sizeof(dims));
+  key = hash_bytes(key, &bg, sizeof(bg));
+
+  for (int i = 0; i < n; i++) {
+    const RasterTile *t = &tiles[i];
+    int rect[4] = {t->x, t->y, t->w, t->h};
+    uint32_t colors[2] = {t->fg, t->bg};
+
+    key = hash_bytes(key, rect, sizeof(rect));
+    key = hash_bytes(key, colors, sizeof(colors));
+    key = hash_bytes(key, t->label, strlen(t->label) + 1);
+  }
+
+  return key;
+}
+
+
+/// Fills a ``w`` by ``h`` image with ``bg`` and draws ``tiles`` over it.
+/// Tiles must not overlap.  The image belongs to the raster and is valid
+/// until the next draw.
+const uint32_t *raster_draw(Raster *r, int w, int h, uint32_t bg,
+                            const RasterTile *tiles, int n) {
+  size_t size = (size_t)w * h;
+  if (r->size < size) {
+    free(r->pixels);
+    r->pixels = malloc(size * sizeof(uint32_t));
+    r->size = size;
+  }
+
+  r->w = w;
+  r->h = h;
+  r->bg = bg;
+  r->tiles = tiles;
+
+  raster_run(r, job_band, MIN(h, r->threads * RASTER_BANDS));
+  raster_run(r, job_tile, n);
+
+  return r->pixels;
+}
+
+
+/// Draws ``label`` as one byte of coverage per pixel in a box as wide as its
+/// advance and as high as the font, with the baseline at the ascent.  Uses
+/// the calling thread's face so must not overlap raster_draw().  The mask is
+/// the caller's to free.
+uint8_t *raster_label(Raster *r, const char *label, int *w, int *h) {
+  RasterWorker *wk = &r->workers[0];
+  int width = *w = MAX(1, worker_width(wk, label));
+  int height = *h = wk->ascent + wk->descent;
+  uint8_t *mask = calloc((size_t)width * height, 1);
+
+  for (int pen = 0; *label;) {
+    RasterGlyph *g = worker_glyph(wk, utf8_next(&label));
+    int x0 = pen + g->left;
+    int y0 = wk->ascent - g->top;
+
+    for (int y = MAX(0, -y0); g->bitmap && y < g->h && y0 + y < height; y++)
+      for (int x = MAX(0, -x0); x < g->w && x0 + x < width; x++) {
+        uint8_t *dst = &mask[(y0 + y) * width + x0 + x];
+        *dst = MAX(*dst, g->bitmap[y * g->w + x]);
+      }
+
+    pen += g->advance;
+  }
+
+  return mask;
+}
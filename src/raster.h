@@ -0,0 +1,80 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <fontconfig/fontconfig.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+
+#define RASTER_THREADS_MAX 64
+#define RASTER_LABEL_MAX 64
+#define RASTER_FACES 16 // The font's own and its fallbacks
+
+/// A key or suggestion: a filled rectangle with a centered label
+typedef struct {
+  int x, y, w, h;
+  uint32_t fg, bg; // 0xRRGGBB
+  char label[RASTER_LABEL_MAX];
+} RasterTile;
+
+struct Raster;
+struct RasterWorker;
+typedef void (*raster_job)(struct Raster *r, struct RasterWorker *w, int job);
+
+/// Draws tiles with FreeType in to client memory on a pool of threads, each
+/// with its own face and glyph cache.  The calling thread is one of them.
+typedef struct Raster {
+  uint64_t font; // Hash of the font file, face and size
+  double pixel_size;
+  int threads;
+  struct RasterWorker *workers;
+
+  // Fallback faces, sorted the first time the font lacks a code point
+  pthread_mutex_t faces_lock;
+  FcPattern *pattern;
+  bool sorted;
+  int nfaces;
+  char *files[RASTER_FACES];
+  int indexes[RASTER_FACES];
+  FcCharSet *charsets[RASTER_FACES];
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  unsigned generation; // Of the jobs being run
+  int busy; // Threads still working on them
+  bool running;
+
+  raster_job fn;
+  int njobs;
+  atomic_int next;
+
+  uint32_t *pixels;
+  size_t size;
+  int w, h;
+  uint32_t bg;
+  const RasterTile *tiles;
+} Raster;
+
+
+FcPattern *raster_match(const char *font);
+Raster *raster_create(FcPattern *font, int threads);
+void raster_destroy(Raster *r);
+uint64_t raster_key(Raster *r, int w, int h, uint32_t bg,
+                    const RasterTile *tiles, int n);
+const uint32_t *raster_draw(Raster *r, int w, int h, uint32_t bg,
+                            const RasterTile *tiles, int n);
+uint8_t *raster_label(Raster *r, const char *label, int *w, int *h);
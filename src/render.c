@@ -0,0 +1,170 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "render.h"
+#include "util.h"
+
+
+static void *render_thread(void *arg) {
+  Render *r = (Render *)arg;
+
+  while (true) {
+    sem_wait(&r->wake);
+    if (!atomic_load(&r->running)) break;
+
+    pthread_mutex_lock(&r->lock);
+
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    while (tail != atomic_load_explicit(&r->head, memory_order_acquire)) {
+      RenderOp *op = &r->ops[tail & (RENDER_QUEUE_SIZE - 1)];
+      op->fn(op->data, op);
+      atomic_store_explicit(&r->tail, ++tail, memory_order_release);
+    }
+
+    XFlush(r->dpy);
+    pthread_cond_broadcast(&r->drained);
+    pthread_mutex_unlock(&r->lock);
+  }
+
+  return 0;
+}
+
+
+/// When threaded, drawing uses a second connection to the display of ``dpy``
+/// and a thread of its own.  Otherwise operations run immediately on ``dpy``.
+Render *render_create(Display *dpy, bool threaded) {
+  Render *r = calloc(1, sizeof(Render));
+  r->threaded = threaded;
+  r->dpy = dpy;
+
+  if (threaded) {
+    r->dpy = XOpenDisplay(DisplayString(dpy));
+    if (!r->dpy) die("cannot open render display");
+
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->drained, 0);
+    sem_init(&r->wake, 0, 0);
+  }
+
+  int screen = DefaultScreen(r->dpy);
+  r->ctx = drw_ctx_create(r->dpy, screen, RootWindow(r->dpy, screen));
+
+  return r;
+}
+
+
+/// Until started, the render connection belongs to the calling thread.
+void render_start(Render *r) {
+  if (!r->threaded) return;
+
+  // Resources created so far must exist before the other connection uses them
+  XSync(r->dpy, false);
+
+  atomic_store(&r->running, true);
+  if (pthread_create(&r->thread, 0, render_thread, r))
+    die("failed to start render thread");
+}
+
+
+void render_destroy(Render *r) {
+  if (r->threaded && atomic_load(&r->running)) {
+    atomic_store(&r->running, false);
+    sem_post(&r->wake);
+    pthread_join(r->thread, 0);
+  }
+
+  cache_close(r->cache);
+  atlas_destroy(r->atlas);
+  raster_destroy(r->raster);
+  drw_ctx_free(r->ctx);
+
+  if (r->threaded) {
+    XCloseDisplay(r->dpy);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->drained);
+    sem_destroy(&r->wake);
+  }
+
+  free(r);
+}
+
+
+void render_push(Render *r, const RenderOp *op) {
+  if (!r->threaded || !atomic_load(&r->running)) {
+    op->fn(op->data, op);
+    return;
+  }
+
+  unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  unsigned used = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+
+  // Rather than wait on rendering redraws are dropped and redone by
+  // render_recover() once the queue drains.  The reserve keeps room for
+  // everything else.
+  if (op->redraw && RENDER_QUEUE_SIZE - RENDER_QUEUE_RESERVE <= used) {
+    r->stalls++;
+    r->dropped = true;
+    sem_post(&r->wake);
+    return;
+  }
+
+  if (used == RENDER_QUEUE_SIZE) {
+    render_lock(r);
+    render_unlock(r);
+  }
+
+  r->ops[head & (RENDER_QUEUE_SIZE - 1)] = *op;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+
+/// Wakes the render thread to draw everything pushed so far.
+void render_flush(Render *r) {
+  if (!r->threaded || !atomic_load(&r->running)) return;
+
+  if (atomic_load_explicit(&r->head, memory_order_relaxed) !=
+      atomic_load_explicit(&r->tail, memory_order_acquire))
+    sem_post(&r->wake);
+}
+
+
+/// True once redraws were dropped and the queue has drained enough to take
+/// a full redraw.
+bool render_recover(Render *r) {
+  if (!r->dropped) return false;
+
+  unsigned used = atomic_load_explicit(&r->head, memory_order_relaxed) -
+    atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (RENDER_QUEUE_SIZE / 2 < used) return false;
+
+  r->dropped = false;
+  return true;
+}
+
+
+/// Waits for queued drawing to finish and takes the render connection.  Used
+/// for rare changes such as resizing or replacing colors.
+void render_lock(Render *r) {
+  if (!r->threaded || !atomic_load(&r->running)) return;
+
+  render_flush(r);
+  pthread_mutex_lock(&r->lock);
+
+  while (atomic_load_explicit(&r->head, memory_order_relaxed) !=
+         atomic_load_explicit(&r->tail, memory_order_acquire))
+    pthread_cond_wait(&r->drained, &r->lock);
+}
+
+
+void render_unlock(Render *r) {
+  if (r->threaded && atomic_load(&r->running))
+    pthread_mutex_unlock(&r->lock);
+}
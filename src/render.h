@@ -0,0 +1,73 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include "drw.h"
+#include "raster.h"
+#include "cache.h"
+#include "atlas.h"
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+
+#define RENDER_QUEUE_SIZE 4096 // Must be a power of two
+#define RENDER_QUEUE_RESERVE 256 // Slots only ops that change state may use
+#define RENDER_TEXT_MAX 64
+
+struct RenderOp;
+typedef void (*render_fn)(void *data, const struct RenderOp *op);
+
+/// A snapshot of everything needed to perform one drawing operation
+typedef struct RenderOp {
+  render_fn fn;
+  void *data;
+  int x, y, w, h;
+  int arg;
+  const void *ptr;
+  const void *ptr2;
+  char text[RENDER_TEXT_MAX]; // For strings that may change before drawing
+  bool redraw; // Only redraws current state so may be dropped
+} RenderOp;
+
+typedef struct {
+  Display *dpy; // Connection used for drawing
+  DrwCtx *ctx;
+  Raster *raster; // Draws whole buffers in client memory when set
+  Cache *cache; // Of what the raster drew, saved for the next start
+  Atlas *atlas; // Composites labels on the server instead when set
+  bool threaded;
+
+  pthread_t thread;
+  pthread_mutex_t lock; // Held by the render thread while it draws
+  pthread_cond_t drained; // Signaled by the render thread once idle
+  sem_t wake;
+  atomic_bool running;
+  atomic_uint head; // Written by the producer only
+  atomic_uint tail; // Written by the render thread only
+  unsigned stalls; // Redraws dropped for a full queue
+  bool dropped; // Since the last render_recover()
+
+  RenderOp ops[RENDER_QUEUE_SIZE];
+} Render;
+
+
+Render *render_create(Display *dpy, bool threaded);
+void render_start(Render *r);
+void render_destroy(Render *r);
+void render_push(Render *r, const RenderOp *op);
+void render_flush(Render *r);
+bool render_recover(Render *r);
+void render_lock(Render *r);
+void render_unlock(Render *r);
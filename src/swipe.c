@@ -0,0 +1,201 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "swipe.h"
+#include "util.h"
+
+#include <X11/keysym.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+#define SWIPE_SAMPLES 32
+#define SWIPE_MIN_STEP 4       // Pixels between recorded points
+#define SWIPE_RANK_WEIGHT 0.05 // Cost per doubling of a word's rank
+#define SWIPE_END_RADIUS 0.6   // Of a key width, for the first and last letter
+
+
+Swipe *swipe_create() {return calloc(1, sizeof(Swipe));}
+void swipe_destroy(Swipe *s) {free(s);}
+
+
+static float swipe_dist(SwipePoint a, SwipePoint b) {
+  return hypotf(a.x - b.x, a.y - b.y);
+}
+
+
+/// Starts a path and takes the key centers from ``layer``.
+void swipe_begin(Swipe *s, Layer *layer, int x, int y) {
+  s->npoints = 0;
+  s->length = 0;
+  memset(s->has, 0, sizeof(s->has));
+
+  for (int r = 0; r < layer->rows; r++)
+    for (Key *k = layer->keys[r]; k->keysym; k++)
+      if (XK_a <= k->keysym && k->keysym <= XK_z) {
+        int i = k->keysym - XK_a;
+        s->keys[i] = (SwipePoint){k->x + k->w / 2.0, k->y + k->h / 2.0};
+        s->has[i] = true;
+      }
+
+  // Letters count as passed within about one key of the path
+  s->radius = layer->w;
+  swipe_add(s, x, y);
+}
+
+
+void swipe_add(Swipe *s, int x, int y) {
+  SwipePoint p = {x, y};
+
+  if (s->npoints) {
+    float d = swipe_dist(s->points[s->npoints - 1], p);
+    if (d < SWIPE_MIN_STEP) return;
+    s->length += d;
+  }
+
+  // Keep the end of long paths
+  if (s->npoints == SWIPE_MAX_POINTS) s->npoints--;
+  s->points[s->npoints++] = p;
+}
+
+
+bool swipe_is_gesture(Swipe *s) {return s->radius < s->length;}
+
+
+/// Resamples a polyline to ``SWIPE_SAMPLES`` evenly spaced points.
+static void swipe_resample(const SwipePoint *in, int n, SwipePoint *out) {
+  float total = 0;
+  for (int i = 1; i < n; i++) total += swipe_dist(in[i - 1], in[i]);
+
+  float step = total / (SWIPE_SAMPLES - 1);
+  float pos = 0; // Distance along the current segment
+  int seg = 1;
+
+  out[0] = in[0];
+
+  for (int i = 1; i < SWIPE_SAMPLES - 1; i++) {
+    float want = step;
+
+    while (seg < n) {
+      float len = swipe_dist(in[seg - 1], in[seg]) - pos;
+
+      if (want <= len) {
+        pos += want;
+        float t = pos / swipe_dist(in[seg - 1], in[seg]);
+        out[i].x = in[seg - 1].x + t * (in[seg].x - in[seg - 1].x);
+        out[i].y = in[seg - 1].y + t * (in[seg].y - in[seg - 1].y);
+        break;
+      }
+
+      want -= len;
+      pos = 0;
+      seg++;
+    }
+
+    if (n <= seg) out[i] = in[n - 1];
+  }
+
+  out[SWIPE_SAMPLES - 1] = in[n - 1];
+}
+
+
+typedef struct {
+  Swipe *swipe;
+  SwipePoint path[SWIPE_SAMPLES];
+} SwipeDecode;
+
+
+/// The state is the index of the path point where the last letter was
+/// passed.  Letters must be passed in order and the first must be near the
+/// start of the path.
+static int swipe_filter(void *data, int state, int depth, char c) {
+  Swipe *s = ((SwipeDecode *)data)->swipe;
+
+  if (c < 'a' || 'z' < c || !s->has[c - 'a']) return -1;
+  if (!depth && s->radius * SWIPE_END_RADIUS <
+      swipe_dist(s->points[0], s->keys[c - 'a']))
+    return -1;
+
+  return s->next[c - 'a'][state];
+}
+
+
+static void swipe_match(void *data, int state, const char *word,
+                        uint32_t rank) {
+  SwipeDecode *d = (SwipeDecode *)data;
+  Swipe *s = d->swipe;
+
+  // The last letter must be near the end of the path
+  int last = word[strlen(word) - 1] - 'a';
+  if (s->radius * SWIPE_END_RADIUS <
+      swipe_dist(s->points[s->npoints - 1], s->keys[last]))
+    return;
+
+  // Template through the key centers, without repeated letters
+  SwipePoint keys[DICT_WORD_MAX];
+  int n = 0;
+  for (const char *c = word; *c; c++)
+    if (!n || c[-1] != *c) keys[n++] = s->keys[*c - 'a'];
+
+  SwipePoint tmpl[SWIPE_SAMPLES];
+  if (n == 1) for (int i = 0; i < SWIPE_SAMPLES; i++) tmpl[i] = keys[0];
+  else swipe_resample(keys, n, tmpl);
+
+  float dist = 0;
+  for (int i = 0; i < SWIPE_SAMPLES; i++)
+    dist += swipe_dist(tmpl[i], d->path[i]);
+
+  float cost = dist / SWIPE_SAMPLES / s->radius +
+    SWIPE_RANK_WEIGHT * log2f(rank + 1);
+
+  if (cost < s->cost) {
+    s->cost = cost;
+    strcpy(s->word, word);
+  }
+}
+
+
+/// Finds the word whose key path best matches the recorded path.
+bool swipe_decode(Swipe *s, Dict *dict, char *word) {
+  uint64_t start = get_time_ns();
+
+  // Next point near each letter at or after each point
+  float r2 = s->radius * s->radius;
+  for (int c = 0; c < 26; c++) {
+    int next = -1;
+    s->next[c][s->npoints] = -1;
+
+    for (int i = s->npoints - 1; 0 <= i; i--) {
+      float dx = s->points[i].x - s->keys[c].x;
+      float dy = s->points[i].y - s->keys[c].y;
+      if (s->has[c] && dx * dx + dy * dy <= r2) next = i;
+      s->next[c][i] = next;
+    }
+  }
+
+  SwipeDecode d = {s};
+  swipe_resample(s->points, s->npoints, d.path);
+
+  s->cost = INFINITY;
+  s->word[0] = 0;
+  dict_walk(dict, swipe_filter, swipe_match, &d);
+  strcpy(word, s->word);
+
+  uint64_t t = get_time_ns() - start;
+  s->decodes++;
+  s->total_ns += t;
+  if (s->max_ns < t) s->max_ns = t;
+  message("Swipe decoded '%s' in %.2fms\n", word, t / 1e6);
+
+  return word[0];
+}
@@ -0,0 +1,57 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include "layout.h"
+#include "dict.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define SWIPE_MAX_POINTS 1024
+#define SWIPE_BUDGET_NS 20000000 // 20ms per decode
+
+typedef struct {
+  float x, y;
+} SwipePoint;
+
+typedef struct {
+  SwipePoint points[SWIPE_MAX_POINTS];
+  int npoints;
+  float length;
+
+  // Key centers of the letters a-z on the current layer
+  SwipePoint keys[26];
+  bool has[26];
+  float radius;
+
+  // For each letter and point, the next point near the letter's key
+  int16_t next[26][SWIPE_MAX_POINTS + 1];
+
+  // Best candidate while decoding
+  char word[DICT_WORD_MAX];
+  float cost;
+
+  // Decode timing
+  unsigned decodes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+} Swipe;
+
+
+Swipe *swipe_create();
+void swipe_destroy(Swipe *s);
+void swipe_begin(Swipe *s, Layer *layer, int x, int y);
+void swipe_add(Swipe *s, int x, int y);
+bool swipe_is_gesture(Swipe *s);
+bool swipe_decode(Swipe *s, Dict *dict, char *word);
@@ -0,0 +1,405 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#include "trace.h"
+#include "util.h"
+
+#include <X11/extensions/XInput2.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+
+#define TRACE_MAGIC 0x544b4242 // "BBKT"
+#define TRACE_VERSION 2 // Adds XInput2 touch records
+
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t kbd;
+  uint64_t btn;
+} TraceHeader;
+
+
+typedef struct {
+  uint64_t time; // ns since start of trace
+  uint32_t type;
+  uint32_t size;
+} TraceRecord;
+
+
+/// XInput2 touch events are stored as a GenericEvent record with this body
+/// because the event data lives outside the XEvent.
+typedef struct {
+  uint32_t evtype;
+  uint32_t id;
+  uint64_t window;
+  double x, y;
+} TraceTouch;
+
+
+typedef struct {
+  unsigned count;
+  uint64_t total;
+  uint64_t max;
+} TraceStat;
+
+
+static const char *event_type_name(int type) {
+  static const char * const names[LASTEvent] = {
+    [KeyPress]         = "KeyPress",
+    [KeyRelease]       = "KeyRelease",
+    [ButtonPress]      = "ButtonPress",
+    [ButtonRelease]    = "ButtonRelease",
+    [MotionNotify]     = "MotionNotify",
+    [EnterNotify]      = "EnterNotify",
+    [LeaveNotify]      = "LeaveNotify",
+    [FocusIn]          = "FocusIn",
+    [FocusOut]         = "FocusOut",
+    [KeymapNotify]     = "KeymapNotify",
+    [Expose]           = "Expose",
+    [GraphicsExpose]   = "GraphicsExpose",
+    [NoExpose]         = "NoExpose",
+    [VisibilityNotify] = "VisibilityNotify",
+    [CreateNotify]     = "CreateNotify",
+    [DestroyNotify]    = "DestroyNotify",
+    [UnmapNotify]      = "UnmapNotify",
+    [MapNotify]        = "MapNotify",
+    [MapRequest]       = "MapRequest",
+    [ReparentNotify]   = "ReparentNotify",
+    [ConfigureNotify]  = "ConfigureNotify",
+    [ConfigureRequest] = "ConfigureRequest",
+    [GravityNotify]    = "GravityNotify",
+    [ResizeRequest]    = "ResizeRequest",
+    [CirculateNotify]  = "CirculateNotify",
+    [CirculateRequest] = "CirculateRequest",
+    [PropertyNotify]   = "PropertyNotify",
+    [SelectionClear]   = "SelectionClear",
+    [SelectionRequest] = "SelectionRequest",
+    [SelectionNotify]  = "SelectionNotify",
+    [ColormapNotify]   = "ColormapNotify",
+    [ClientMessage]    = "ClientMessage",
+    [MappingNotify]    = "MappingNotify",
+    [GenericEvent]     = "GenericEvent",
+  };
+
+  if (type < 0 || LASTEvent <= type || !names[type]) return "Unknown";
+  return names[type];
+}
+
+
+/// Only the part of the XEvent union used by the event type is stored.
+static size_t event_size(int type) {
+  switch (type) {
+  case KeyPress: case KeyRelease:         return sizeof(XKeyEvent);
+  case ButtonPress: case ButtonRelease:   return sizeof(XButtonEvent);
+  case MotionNotify:                      return sizeof(XMotionEvent);
+  case EnterNotify: case LeaveNotify:     return sizeof(XCrossingEvent);
+  case Expose:                            return sizeof(XExposeEvent);
+  case VisibilityNotify:                  return sizeof(XVisibilityEvent);
+  case CreateNotify:                      return sizeof(XCreateWindowEvent);
+  case DestroyNotify:                     return sizeof(XDestroyWindowEvent);
+  case UnmapNotify:                       return sizeof(XUnmapEvent);
+  case MapNotify:                         return sizeof(XMapEvent);
+  case MapRequest:                        return sizeof(XMapRequestEvent);
+  case ReparentNotify:                    return sizeof(XReparentEvent);
+  case ConfigureNotify:                   return sizeof(XConfigureEvent);
+  case ConfigureRequest:                  return sizeof(XConfigureRequestEvent);
+  case PropertyNotify:                    return sizeof(XPropertyEvent);
+  case ClientMessage:                     return sizeof(XClientMessageEvent);
+  default:                                return sizeof(XEvent);
+  }
+}
+
+
+Trace *trace_create(const char *path, Window kbd, Window btn, int xi) {
+  FILE *f = fopen(path, "wb");
+  if (!f) die("failed to open trace '%s':", path);
+
+  TraceHeader hdr = {TRACE_MAGIC, TRACE_VERSION, kbd, btn};
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+    die("failed to write trace '%s':", path);
+
+  Trace *trace = calloc(1, sizeof(Trace));
+  trace->f = f;
+  trace->start = get_time_ns();
+  trace->xi = xi;
+
+  return trace;
+}
+
+
+void trace_destroy(Trace *trace) {
+  if (!trace) return;
+  fclose(trace->f);
+  free(trace);
+}
+
+
+static bool is_touch(int evtype) {
+  return evtype == XI_TouchBegin || evtype == XI_TouchUpdate ||
+    evtype == XI_TouchEnd;
+}
+
+
+static void trace_write(Trace *trace, int type, const void *data,
+                        size_t size) {
+  TraceRecord rec;
+  rec.time = get_time_ns() - trace->start;
+  rec.type = type;
+  rec.size = size;
+
+  if (fwrite(&rec, sizeof(rec), 1, trace->f) != 1 ||
+      fwrite(data, rec.size, 1, trace->f) != 1)
+    message("Failed to write trace record\n");
+}
+
+
+/// Generic events must already have their data from XGetEventData().  Only
+/// XInput2 touch events are kept.
+void trace_record(Trace *trace, XEvent *e) {
+  if (e->type != GenericEvent) {
+    trace_write(trace, e->type, e, event_size(e->type));
+    return;
+  }
+
+  XGenericEventCookie *cookie = &e->xcookie;
+  if (!trace->xi || cookie->extension != trace->xi || !cookie->data ||
+      !is_touch(cookie->evtype)) return;
+
+  XIDeviceEvent *dev = (XIDeviceEvent *)cookie->data;
+  TraceTouch touch =
+    {cookie->evtype, dev->detail, dev->event, dev->event_x, dev->event_y};
+  trace_write(trace, GenericEvent, &touch, sizeof(touch));
+}
+
+
+/// Live events are handled as the event loop would, cookie data included.
+static void trace_drain(Display *dpy, trace_cb cb, void *data) {
+  while (XPending(dpy)) {
+    XEvent ev;
+    XNextEvent(dpy, &ev);
+    if (ev.type == GenericEvent) XGetEventData(dpy, &ev.xcookie);
+
+    cb(&ev, data);
+    XFreeEventData(dpy, &ev.xcookie);
+  }
+}
+
+
+static void trace_wait(Display *dpy, uint64_t until, trace_cb cb, void *data) {
+  while (true) {
+    trace_drain(dpy, cb, data);
+
+    uint64_t now = get_time_ns();
+    if (until <= now) break;
+
+    struct timeval tv;
+    tv.tv_sec = (until - now) / 1000000000;
+    tv.tv_usec = (until - now) % 1000000000 / 1000;
+
+    int xfd = ConnectionNumber(dpy);
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(xfd, &fds);
+    if (select(xfd + 1, &fds, 0, 0, &tv) == -1 && errno != EINTR) break;
+  }
+}
+
+
+static void trace_report(TraceStat *stats, unsigned skipped,
+                         uint64_t elapsed) {
+  unsigned count = 0;
+  uint64_t total = 0;
+
+  fprintf(stdout, "%-18s %8s %12s %10s %10s\n", "Event", "Count", "Total us",
+          "Avg us", "Max us");
+
+  for (int i = 0; i < LASTEvent; i++) {
+    TraceStat *s = &stats[i];
+    if (!s->count) continue;
+
+    fprintf(stdout, "%-18s %8u %12.1f %10.2f %10.2f\n", event_type_name(i),
+            s->count, s->total / 1e3, s->total / 1e3 / s->count, s->max / 1e3);
+
+    count += s->count;
+    total += s->total;
+  }
+
+  fprintf(stdout, "%-18s %8u %12.1f\n", "Total", count, total / 1e3);
+  fprintf(stdout, "Replay took %.3fs, %.0f events/s\n", elapsed / 1e9,
+          elapsed ? count * 1e9 / elapsed : 0);
+  if (skipped) fprintf(stdout, "Skipped %u events for other windows\n",
+                       skipped);
+}
+
+
+/// Rebuilds a touch event as a cookie that already carries its data.
+static void trace_touch(XEvent *ev, XIDeviceEvent *dev, const TraceTouch *t,
+                        Display *dpy, int xi, Window window, uint64_t time) {
+  memset(dev, 0, sizeof(XIDeviceEvent));
+  dev->type = GenericEvent;
+  dev->display = dpy;
+  dev->extension = xi;
+  dev->evtype = t->evtype;
+  dev->time = time / 1000000;
+  dev->deviceid = dev->sourceid = XIAllMasterDevices;
+  dev->detail = t->id;
+  dev->event = window;
+  dev->root_x = dev->event_x = t->x;
+  dev->root_y = dev->event_y = t->y;
+
+  XGenericEventCookie *cookie = &ev->xcookie;
+  memset(cookie, 0, sizeof(XGenericEventCookie));
+  cookie->type = GenericEvent;
+  cookie->display = dpy;
+  cookie->extension = xi;
+  cookie->evtype = t->evtype;
+  cookie->data = dev;
+}
+
+
+/// Without a display, ``dpy`` zero, events go straight to ``cb`` as fast as
+/// possible.  Only events for the keyboard and button are replayed, other
+/// windows recorded, clients and the root, are gone or not ours to touch.
+void trace_replay(const char *path, Display *dpy, Window kbd, Window btn,
+                  int xi, bool realtime, trace_cb cb, void *data) {
+  FILE *f = fopen(path, "rb");
+  if (!f) die("failed to open trace '%s':", path);
+
+  TraceHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC ||
+      !hdr.version || TRACE_VERSION < hdr.version)
+    die("invalid trace file '%s'", path);
+
+  TraceStat stats[LASTEvent] = {{0}};
+  unsigned skipped = 0;
+  uint64_t start = get_time_ns();
+  TraceRecord rec;
+  XIDeviceEvent dev;
+
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    XEvent ev;
+    memset(&ev, 0, sizeof(ev));
+
+    if (sizeof(ev) < rec.size || fread(&ev, rec.size, 1, f) != 1)
+      die("truncated trace file '%s'", path);
+
+    // Translate recorded windows to the current ones.  Touch bodies overlap
+    // the XEvent header so are rebuilt rather than patched.
+    Window recorded = ev.xany.window;
+    TraceTouch touch;
+    if (rec.type == GenericEvent) {
+      memcpy(&touch, &ev, sizeof(touch));
+      recorded = touch.window;
+    }
+
+    Window win = recorded == hdr.kbd ? kbd : (recorded == hdr.btn ? btn : 0);
+    if (!win) {
+      skipped++;
+      continue;
+    }
+
+    if (rec.type == GenericEvent)
+      trace_touch(&ev, &dev, &touch, dpy, xi, win, rec.time);
+
+    else {
+      ev.xany.display = dpy;
+      ev.xany.window = win;
+    }
+
+    if (dpy && realtime) trace_wait(dpy, start + rec.time, cb, data);
+    else if (dpy) trace_drain(dpy, cb, data);
+
+    uint64_t t = get_time_ns();
+    cb(&ev, data);
+    t = get_time_ns() - t;
+
+    if (ev.type < LASTEvent) {
+      TraceStat *s = &stats[ev.type];
+      s->count++;
+      s->total += t;
+      if (s->max < t) s->max = t;
+    }
+  }
+
+  if (dpy) XSync(dpy, false);
+  fclose(f);
+
+  trace_report(stats, skipped, get_time_ns() - start);
+}
+
+
+/// Compiles a touch script to a trace that replays as XInput2 touch events
+/// on the keyboard window.  Each line is ``<ms> begin|update|end <id> <x>
+/// <y>`` with coordinates in keyboard window pixels.
+bool trace_compile(const char *src, const char *dst) {
+  FILE *in = fopen(src, "r");
+  if (!in) {
+    fprintf(stderr, "error, cannot open '%s'\n", src);
+    return false;
+  }
+
+  Trace *trace = trace_create(dst, 1, 2, 0);
+  char *line = 0;
+  size_t len = 0;
+  unsigned lineno = 0;
+  bool ok = true;
+
+  while (ok && getline(&line, &len, in) != -1) {
+    lineno++;
+
+    char *s = line + strspn(line, " \t");
+    if (*s == '#' || *s == '\n' || !*s) continue;
+
+    double ms, x, y;
+    char name[16];
+    unsigned id;
+
+    if (sscanf(s, "%lf %15s %u %lf %lf", &ms, name, &id, &x, &y) != 5) {
+      fprintf(stderr, "%s:%u: expected <ms> <event> <id> <x> <y>\n", src,
+              lineno);
+      ok = false;
+      break;
+    }
+
+    uint32_t evtype;
+    if (!strcmp(name, "begin")) evtype = XI_TouchBegin;
+    else if (!strcmp(name, "update")) evtype = XI_TouchUpdate;
+    else if (!strcmp(name, "end")) evtype = XI_TouchEnd;
+    else {
+      fprintf(stderr, "%s:%u: unknown touch event '%s'\n", src, lineno,
+              name);
+      ok = false;
+      break;
+    }
+
+    TraceTouch touch = {evtype, id, 1, x, y};
+    TraceRecord rec = {ms * 1e6, GenericEvent, sizeof(touch)};
+
+    if (fwrite(&rec, sizeof(rec), 1, trace->f) != 1 ||
+        fwrite(&touch, sizeof(touch), 1, trace->f) != 1) {
+      fprintf(stderr, "error, cannot write '%s'\n", dst);
+      ok = false;
+    }
+  }
+
+  free(line);
+  fclose(in);
+  trace_destroy(trace);
+  if (!ok) unlink(dst);
+
+  return ok;
+}
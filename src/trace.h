@@ -0,0 +1,35 @@
+/******************************************************************************\
+
+                     Copyright (C) 2020-2021 Buildbotics LLC.
+
+       This program is free software; you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+                       (at your option) any later version.
+
+\******************************************************************************/
+
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+
+
+typedef void (*trace_cb)(XEvent *e, void *data);
+
+typedef struct {
+  FILE *f;
+  uint64_t start;
+  int xi; // XInput2 opcode, touch events are recorded when set
+} Trace;
+
+
+Trace *trace_create(const char *path, Window kbd, Window btn, int xi);
+void trace_destroy(Trace *trace);
+void trace_record(Trace *trace, XEvent *e);
+void trace_replay(const char *path, Display *dpy, Window kbd, Window btn,
+                  int xi, bool realtime, trace_cb cb, void *data);
+bool trace_compile(const char *src, const char *dst);
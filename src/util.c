@@ -10,25 +10,102 @@
 \******************************************************************************/
 
 #include "util.h"
+#include "inject.h"
+#include "log.h"
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
-#include <X11/extensions/XTest.h>
-
-#ifdef XINERAMA
-#include <X11/extensions/Xinerama.h>
-#endif
 
 
 bool verbose = false;
 
+static pthread_mutex_t displays_lock = PTHREAD_MUTEX_INITIALIZER;
+static DisplayCtx *displays[DISPLAY_MAX];
+
+
+static void atoms_init(DisplayCtx *d) {
+  static char *names[AtomLast] = {
+    [NetWMWindowType]        = "_NET_WM_WINDOW_TYPE",
+    [NetWMWindowTypeDock]    = "_NET_WM_WINDOW_TYPE_DOCK",
+    [NetWMWindowTypeUtility] = "_NET_WM_WINDOW_TYPE_UTILITY",
+    [Clipboard]              = "CLIPBOARD",
+    [Targets]                = "TARGETS",
+    [Utf8String]             = "UTF8_STRING",
+    [Incr]                   = "INCR",
+    [BbkbdOccluded]          = "_BBKBD_OCCLUDED",
+  };
+
+  // One round trip for all atoms
+  XInternAtoms(d->dpy, names, AtomLast, false, d->atoms);
+}
+
+
+/// Opens display ``name``, or the default when zero.  Returns zero if it
+/// cannot be opened.
+DisplayCtx *display_open(const char *name) {
+  Display *dpy = XOpenDisplay(name);
+  if (!dpy) return 0;
+
+  DisplayCtx *d = calloc(1, sizeof(DisplayCtx));
+  d->dpy = dpy;
+  d->inject = inject_create(dpy);
+  atoms_init(d);
+
+  pthread_mutex_lock(&displays_lock);
+
+  int i;
+  for (i = 0; i < DISPLAY_MAX && displays[i]; i++) continue;
+  if (i < DISPLAY_MAX) displays[i] = d;
+
+  pthread_mutex_unlock(&displays_lock);
+
+  if (i == DISPLAY_MAX) die("too many displays");
+
+  return d;
+}
+
+
+void display_close(DisplayCtx *d) {
+  pthread_mutex_lock(&displays_lock);
+
+  for (int i = 0; i < DISPLAY_MAX; i++)
+    if (displays[i] == d) displays[i] = 0;
+
+  pthread_mutex_unlock(&displays_lock);
+
+  inject_free(d->inject);
+  XCloseDisplay(d->dpy);
+  free(d);
+}
+
+
+DisplayCtx *display_ctx(Display *dpy) {
+  DisplayCtx *d = 0;
+
+  pthread_mutex_lock(&displays_lock);
+
+  for (int i = 0; i < DISPLAY_MAX && !d; i++)
+    if (displays[i] && displays[i]->dpy == dpy) d = displays[i];
+
+  pthread_mutex_unlock(&displays_lock);
+
+  if (!d) die("display not opened with display_open()");
+
+  return d;
+}
+
 
 void die(const char *fmt, ...) {
+  log_shutdown();
+
   va_list ap;
 
   va_start(ap, fmt);
@@ -45,85 +122,46 @@ void die(const char *fmt, ...) {
 }
 
 
+/// Debug output.  Queued by the logger so it never blocks the caller.
 void message(const char *fmt, ...) {
   if (!verbose) return;
 
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  log_vmsg(LOG_DEBUG, fmt, ap);
   va_end(ap);
-  fflush(stderr);
 }
 
 
 
-int find_unused_keycode(Display *dpy) {
-  // Derived from:
-  // https://stackoverflow.com/questions/44313966/
-  //   c-xtest-emitting-key-presses-for-every-unicode-character
-
-  int keycode_low, keycode_high;
-  XDisplayKeycodes(dpy, &keycode_low, &keycode_high);
+/// Resident memory of the process, or zero if unknown.
+long get_rss_kb() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
 
-  int keysyms_per_keycode = 0;
-  KeySym *keysyms =
-    XGetKeyboardMapping(dpy, keycode_low, keycode_high - keycode_low,
-                        &keysyms_per_keycode);
+  long size = 0, pages = 0;
+  if (fscanf(f, "%ld %ld", &size, &pages) != 2) pages = 0;
+  fclose(f);
 
-  for (int i = keycode_low; i <= keycode_high; i++) {
-    bool key_is_empty = true;
-
-    for (int j = 0; j < keysyms_per_keycode; j++) {
-      int symindex = (i - keycode_low) * keysyms_per_keycode + j;
-      if (keysyms[symindex]) key_is_empty = false;
-      else break;
-    }
-
-    if (key_is_empty) {
-      XFree(keysyms);
-      return i;
-    }
-  }
-
-  XFree(keysyms);
-  return 1;
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
 }
 
 
-void simulate_key(Display *dpy, KeySym keysym, bool press) {
-  if (!keysym) return;
-
-  KeyCode code = XKeysymToKeycode(dpy, keysym);
-
-  if (!code) {
-    static int tmp_keycode = 0;
-    if (!tmp_keycode) tmp_keycode = find_unused_keycode(dpy);
-
-    code = tmp_keycode;
-    XChangeKeyboardMapping(dpy, tmp_keycode, 1, &keysym, 1);
-    XSync(dpy, false);
-  }
-
-  XTestFakeKeyEvent(dpy, code, press, 0);
+uint64_t get_time_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 
-Dim get_display_dims(Display *dpy, int screen) {
-  Dim dim;
+/// FNV-1a, continuing from ``h``.  Start with HASH_INIT.
+uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data;
 
-#ifdef XINERAMA
-  if (XineramaIsActive(dpy)) {
-    int i = 0;
-    XineramaScreenInfo *info = XineramaQueryScreens(dpy, &i);
-    dim.width  = info[0].width;
-    dim.height = info[0].height;
-    XFree(info);
-    return dim;
+  for (size_t i = 0; i < size; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ull;
   }
-#endif
-
-  dim.width  = DisplayWidth(dpy, screen);
-  dim.height = DisplayHeight(dpy, screen);
 
-  return dim;
+  return h;
 }
@@ -14,15 +14,32 @@
 #include <X11/Xlib.h>
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 extern bool verbose;
 
-typedef struct {
-  int width;
-  int height;
-} Dim;
+enum {
+  NetWMWindowType, NetWMWindowTypeDock, NetWMWindowTypeUtility, Clipboard,
+  Targets, Utf8String, Incr, BbkbdOccluded, AtomLast
+};
+
+#define DISPLAY_MAX 64
+#define HASH_INIT 0xcbf29ce484222325ull // FNV-1a offset basis
 
+/// State belonging to one X display.  Found from the connection, so code
+/// holding only a Display can reach it.
+typedef struct {
+  Display *dpy;
+  Atom atoms[AtomLast];
+  struct Inject *inject; // Keys queued for the spare keycodes
+} DisplayCtx;
+
+DisplayCtx *display_open(const char *name);
+void display_close(DisplayCtx *d);
+DisplayCtx *display_ctx(Display *dpy);
 void die(const char *fmt, ...);
 void message(const char *fmt, ...);
-void simulate_key(Display *dpy, KeySym keysym, bool press);
-Dim get_display_dims(Display *dpy, int screen);
+uint64_t get_time_ns();
+long get_rss_kb();
+uint64_t hash_bytes(uint64_t h, const void *data, size_t size);
@@ -11,18 +11,19 @@
 
 #include "wm.h"
 #include "util.h"
+#include "log.h"
 
+#include <X11/Xatom.h>
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-#define MAX_CLIENTS 32
 #define WINDOW_FMT "0x%06lx"
 
+// The error handler is process wide, so detection is one display at a time
+static pthread_mutex_t wm_detect_lock = PTHREAD_MUTEX_INITIALIZER;
 static bool wm_detected = false;
-static Display *wm_dpy = 0;
-static Window wm_clients[MAX_CLIENTS] = {0};
-static Window wm_active = 0;
-static int wm_keyboard_margin = 0;
 
 
 
@@ -177,13 +178,10 @@ static int on_wm_detected(Display *dpy, XErrorEvent *e) {
 
 
 static int on_x_error(Display *dpy, XErrorEvent *e) {
-  char text[1024];
+  char text[128];
 
   XGetErrorText(dpy, e->error_code, text, sizeof(text));
-  fprintf(stderr, "X error:\n"
-          "  Request: %d %s\n"
-          "  Code: %d %s\n"
-          "  Resource: %lu\n",
+  log_msg(LOG_ERROR, "X error: request %d %s, code %d %s, resource %lu",
           e->request_code, request_name(e->request_code), e->error_code, text,
           e->resourceid);
 
@@ -191,49 +189,122 @@ static int on_x_error(Display *dpy, XErrorEvent *e) {
 }
 
 
-static void _activate_window(Window win) {
-  Dim dim = get_display_dims(wm_dpy, DefaultScreen(wm_dpy));
-  int y_offset = 0;
-  int width = dim.width;
-  int height = dim.height - wm_keyboard_margin + y_offset;
+/// Enforces the stacking layers, top to bottom: buttons, keyboards, active
+/// client then other clients.  Whatever disturbed the stack, this is one
+/// raise and one restack so clients cannot start a raise loop.
+static void _restack(WM *wm) {
+  Window stack[WM_MAX_CLIENTS + 2 * OUTPUT_MAX];
+  int n = 0;
 
-  XRaiseWindow(wm_dpy, win);
-  XMoveResizeWindow(wm_dpy, win, 0, -y_offset, width, height);
-  XSetInputFocus(wm_dpy, win, RevertToNone, CurrentTime);
-  XSync(wm_dpy, false);
-  wm_active = win;
-  printf("Activated " WINDOW_FMT "\n", win);
+  for (int i = 0; i < OUTPUT_MAX; i++)
+    if (wm->buttons[i]) stack[n++] = wm->buttons[i]->win;
+
+  for (int i = 0; i < OUTPUT_MAX; i++)
+    if (wm->keyboards[i]) stack[n++] = wm->keyboards[i]->win;
+
+  if (wm->active) stack[n++] = wm->active;
+
+  for (int i = 0; i < WM_MAX_CLIENTS; i++)
+    if (wm->clients[i] && wm->clients[i] != wm->active)
+      stack[n++] = wm->clients[i];
+
+  if (!n) return;
+  XRaiseWindow(wm->dpy, stack[0]);
+  XRestackWindows(wm->dpy, stack, n);
+}
+
+
+static Output _output(WM *wm, int i) {
+  if (wm->outputs && i < wm->outputs->count) return wm->outputs->outputs[i];
+
+  int screen = DefaultScreen(wm->dpy);
+  Output out = {0, 0, DisplayWidth(wm->dpy, screen),
+                DisplayHeight(wm->dpy, screen)};
+  return out;
+}
+
+
+static int _keyboard_output(WM *wm, Keyboard *kbd) {
+  return wm->outputs ? outputs_find(wm->outputs, kbd->x, kbd->y) : 0;
+}
+
+
+/// Height of the visible keyboard on output ``i``.
+static int _margin(WM *wm, int i) {
+  if (wm->overlay) return 0;
+
+  for (int j = 0; j < OUTPUT_MAX; j++) {
+    Keyboard *kbd = wm->keyboards[j];
+    if (kbd && kbd->visible && _keyboard_output(wm, kbd) == i) return kbd->h;
+  }
+
+  return 0;
 }
 
 
-static void _focus_window() {
-  if (wm_active) return _activate_window(wm_active);
+static int _client(WM *wm, Window win) {
+  for (int i = 0; i < WM_MAX_CLIENTS; i++)
+    if (wm->clients[i] == win) return i;
 
-  for (int i = 0; i < MAX_CLIENTS; i++)
-    if (wm_clients[i]) {
+  return -1;
+}
+
+
+/// Fills the client's output above its keyboard.
+static void _place_client(WM *wm, int i) {
+  Output out = _output(wm, wm->client_output[i]);
+  int height = out.h - _margin(wm, wm->client_output[i]);
+  XMoveResizeWindow(wm->dpy, wm->clients[i], out.x, out.y, out.w, height);
+}
+
+
+static void _activate_window(WM *wm, Window win) {
+  wm->active = win;
+  _restack(wm);
+
+  int i = _client(wm, win);
+  if (i != -1) _place_client(wm, i);
+
+  XSetInputFocus(wm->dpy, win, RevertToNone, CurrentTime);
+  XSync(wm->dpy, false);
+  log_msg(LOG_INFO, "Activated " WINDOW_FMT, win);
+}
+
+
+static void _focus_window(WM *wm) {
+  if (wm->active) return _activate_window(wm, wm->active);
+
+  for (int i = 0; i < WM_MAX_CLIENTS; i++)
+    if (wm->clients[i]) {
       XWindowAttributes attrs;
-      XGetWindowAttributes(wm_dpy, wm_clients[i], &attrs);
+      XGetWindowAttributes(wm->dpy, wm->clients[i], &attrs);
 
       if (attrs.map_state == IsViewable) {
-        _activate_window(wm_clients[i]);
+        _activate_window(wm, wm->clients[i]);
         break;
       }
     }
 }
 
 
-void wm_init(Display *dpy) {
-  wm_dpy = dpy;
+/// Becomes the display's window manager.
+void wm_manage(WM *wm) {
+  Display *dpy = wm->dpy;
   Window root = DefaultRootWindow(dpy);
+  wm->managing = true;
 
   // Check for other WM
+  pthread_mutex_lock(&wm_detect_lock);
+  wm_detected = false;
   XSetErrorHandler(on_wm_detected);
   XSelectInput(dpy, root, SubstructureRedirectMask | SubstructureNotifyMask);
   XSync(dpy, false);
 
-  if (wm_detected) die("Window manager already exists on display");
-
+  bool detected = wm_detected;
   XSetErrorHandler(on_x_error);
+  pthread_mutex_unlock(&wm_detect_lock);
+
+  if (detected) die("Window manager already exists on display");
 
   XGrabServer(dpy);
 
@@ -258,29 +329,31 @@ void wm_init(Display *dpy) {
 }
 
 
-void wm_event(XEvent *e) {
+void wm_event(WM *wm, XEvent *e) {
+  if (!wm->managing) return;
+
   switch (e->type) {
   case DestroyNotify: {
     XDestroyWindowEvent *ex = &e->xdestroywindow;
 
-    if (wm_active == ex->window) wm_active = 0;
+    if (wm->active == ex->window) wm->active = 0;
 
-    for (unsigned i = 0; i < MAX_CLIENTS; i++)
-      if (wm_clients[i] && wm_clients[i] == ex->window) {
-        printf("Clear WM client " WINDOW_FMT "\n", ex->window);
-        wm_clients[i] = 0;
+    for (unsigned i = 0; i < WM_MAX_CLIENTS; i++)
+      if (wm->clients[i] && wm->clients[i] == ex->window) {
+        log_msg(LOG_INFO, "Clear WM client " WINDOW_FMT, ex->window);
+        wm->clients[i] = 0;
       }
 
-    _focus_window();
+    _focus_window(wm);
     break;
   }
 
   case UnmapNotify: {
     XUnmapEvent *ex = &e->xunmap;
 
-    if (wm_active == ex->window) {
-      wm_active = 0;
-      _focus_window();
+    if (wm->active == ex->window) {
+      wm->active = 0;
+      _focus_window(wm);
     }
 
     break;
@@ -289,24 +362,138 @@ void wm_event(XEvent *e) {
   case MapRequest: {
     XMapRequestEvent *ex = &e->xmaprequest;
 
-    for (int i = 0; i < MAX_CLIENTS; i++)
-      if (!wm_clients[i]) {
-        wm_clients[i] = ex->window;
+    for (int i = 0; i < WM_MAX_CLIENTS; i++)
+      if (!wm->clients[i]) {
+        wm->clients[i] = ex->window;
 
-        XMapWindow(wm_dpy, ex->window);
-        printf("Mapped " WINDOW_FMT "\n", ex->window);
-        _activate_window(wm_clients[i]);
+        // Clients stay on the output they asked to map on
+        XWindowAttributes attrs;
+        XGetWindowAttributes(wm->dpy, ex->window, &attrs);
+        wm->client_output[i] = !wm->outputs ? 0 :
+          outputs_find(wm->outputs, attrs.x + attrs.width / 2,
+                       attrs.y + attrs.height / 2);
+
+        XMapWindow(wm->dpy, ex->window);
+        log_msg(LOG_INFO, "Mapped " WINDOW_FMT, ex->window);
+        _activate_window(wm, wm->clients[i]);
         return;
       }
 
-    printf("Too many windows\n");
+    log_msg(LOG_WARN, "Too many windows");
     break;
   }
   }
 }
 
 
-void wm_keyboard(Keyboard *kbd) {
-  wm_keyboard_margin = kbd->visible ? kbd->h : 0;
-  _focus_window();
+/// Publishes the screen areas covered by keyboards on the root window as
+/// ``_BBKBD_OCCLUDED``, CARDINAL x, y, width and height for each visible
+/// keyboard.  All zero when none are visible.
+static void _publish_occluded(WM *wm) {
+  Display *dpy = wm->dpy;
+  Atom *atoms = display_ctx(dpy)->atoms;
+  long rects[4 * OUTPUT_MAX] = {0};
+  int n = 0;
+
+  for (int i = 0; i < OUTPUT_MAX; i++) {
+    Keyboard *kbd = wm->keyboards[i];
+    if (!kbd || !kbd->visible) continue;
+
+    rects[n++] = kbd->x;
+    rects[n++] = kbd->y;
+    rects[n++] = kbd->w;
+    rects[n++] = kbd->h;
+  }
+
+  XChangeProperty(dpy, DefaultRootWindow(dpy), atoms[BbkbdOccluded],
+                  XA_CARDINAL, 32, PropModeReplace, (unsigned char *)rects,
+                  n ? n : 4);
+}
+
+
+/// In overlay mode clients keep their geometry while the keyboard is shown
+/// over them.  Until wm_manage() is called only stacking is tracked.
+WM *wm_create(Display *dpy, bool overlay) {
+  WM *wm = calloc(1, sizeof(WM));
+  wm->dpy = dpy;
+  wm->overlay = overlay;
+  return wm;
+}
+
+
+void wm_destroy(WM *wm) {
+  if (wm->overlay)
+    XDeleteProperty(wm->dpy, DefaultRootWindow(wm->dpy),
+                    display_ctx(wm->dpy)->atoms[BbkbdOccluded]);
+
+  free(wm);
+}
+
+
+/// Clients are placed on ``outputs``, which are used again after every
+/// change to them.
+void wm_set_outputs(WM *wm, Outputs *outputs) {
+  wm->outputs = outputs;
+  if (!wm->managing) return;
+
+  for (int i = 0; i < WM_MAX_CLIENTS; i++)
+    if (wm->clients[i]) {
+      if (outputs->count <= wm->client_output[i]) wm->client_output[i] = 0;
+      if (wm->clients[i] != wm->active) _place_client(wm, i);
+    }
+
+  _focus_window(wm);
+}
+
+
+/// Stops managing a keyboard or button window before it is destroyed.
+void wm_forget(WM *wm, Window win) {
+  for (int i = 0; i < OUTPUT_MAX; i++) {
+    if (wm->keyboards[i] && wm->keyboards[i]->win == win) wm->keyboards[i] = 0;
+    if (wm->buttons[i] && wm->buttons[i]->win == win) wm->buttons[i] = 0;
+  }
+}
+
+
+/// Buttons are kept on top by the window manager rather than raising
+/// themselves.
+void wm_button(WM *wm, Button *btn) {
+  if (!wm->managing) return;
+
+  int slot = -1;
+  for (int i = 0; i < OUTPUT_MAX; i++)
+    if (wm->buttons[i] == btn) slot = -2;
+    else if (!wm->buttons[i] && slot == -1) slot = i;
+
+  if (0 <= slot) wm->buttons[slot] = btn;
+
+  btn->managed = true;
+  _restack(wm);
+}
+
+
+/// Called when ``kbd`` is shown or hidden.  Clients on its output are
+/// resized to the space left above it.
+void wm_keyboard(WM *wm, Keyboard *kbd) {
+  int slot = -1;
+  for (int i = 0; i < OUTPUT_MAX; i++)
+    if (wm->keyboards[i] == kbd) slot = -2;
+    else if (!wm->keyboards[i] && slot == -1) slot = i;
+
+  if (0 <= slot) wm->keyboards[slot] = kbd;
+
+  if (wm->overlay) {
+    _publish_occluded(wm);
+    if (wm->managing) _restack(wm);
+    return;
+  }
+
+  if (!wm->managing) return;
+
+  int out = _keyboard_output(wm, kbd);
+  for (int i = 0; i < WM_MAX_CLIENTS; i++)
+    if (wm->clients[i] && wm->clients[i] != wm->active &&
+        wm->client_output[i] == out) _place_client(wm, i);
+
+  _focus_window(wm);
 }
@@ -12,10 +12,37 @@
 #pragma once
 
 #include "keyboard.h"
+#include "button.h"
+#include "output.h"
 
 #include <X11/Xlib.h>
 
+#include <stdbool.h>
 
-void wm_init(Display *dpy);
-void wm_event(XEvent *e);
-void wm_keyboard(Keyboard *kbd);
+
+#define WM_MAX_CLIENTS 32
+
+/// Window management of one display
+typedef struct {
+  Display *dpy;
+  bool managing; // Clients are managed, otherwise only stacking is tracked
+  bool overlay; // Clients keep their geometry under the keyboard
+
+  Window clients[WM_MAX_CLIENTS];
+  int client_output[WM_MAX_CLIENTS];
+  Window active;
+
+  Outputs *outputs;
+  Keyboard *keyboards[OUTPUT_MAX];
+  Button *buttons[OUTPUT_MAX];
+} WM;
+
+
+WM *wm_create(Display *dpy, bool overlay);
+void wm_destroy(WM *wm);
+void wm_manage(WM *wm);
+void wm_event(WM *wm, XEvent *e);
+void wm_set_outputs(WM *wm, Outputs *outputs);
+void wm_forget(WM *wm, Window win);
+void wm_button(WM *wm, Button *btn);
+void wm_keyboard(WM *wm, Keyboard *kbd);